@@ -154,6 +154,46 @@ public:
 	int hamming_dec(int block_len);
 };
 
+/**
+ * \brief A \e BitsetExt replacement for decoding, over storage given by the caller
+ *
+ * Holds at most the given number of bits in a plain array and does not
+ * allocate, so it can be used for every marker candidate of every frame. It
+ * provides the operations used when reading a marker code: \e push_back,
+ * \e pop_front, Hamming decoding and conversion into a number, with the same
+ * results as \e BitsetExt.
+ */
+class ALVAR_EXPORT BitsetBuffer {
+protected:
+	bool *bits;
+	int capacity;
+	int first;
+	int length;
+	int hamming_dec_block(unsigned long block_len, int &read, int &write);
+public:
+	/** \brief Constructor
+	 *  \param storage Array of at least \e capacity elements for the bits
+	 *  \param capacity The largest number of bits held
+	 */
+	BitsetBuffer(bool *storage, int capacity);
+	/** \brief The length of the \e BitsetBuffer */
+	int Length() const { return length; }
+	/** \brief Clear the bits */
+	void clear() { first = 0; length = 0; }
+	/** \brief Push back one bit, ignored when the buffer is full */
+	void push_back(const bool bit) { if (first + length < capacity) bits[first + length++] = bit; }
+	/** \brief Pop the front bit */
+	bool pop_front() { length--; return bits[first++]; }
+	/** \brief The bit in position \e pos */
+	bool operator[](int pos) const { return bits[first + pos]; }
+	/** \brief Hamming decoding 'in-place' using the defined block length, see \e BitsetExt::hamming_dec */
+	int hamming_dec(int block_len);
+	/** \brief The bits as 'unsigned long', the largest value if they do not fit */
+	unsigned long ulong() const;
+	/** \brief The bits as 'unsigned char' */
+	unsigned char uchar() const { return (unsigned char)ulong(); }
+};
+
 } // namespace alvar
 
 #endif
@@ -35,6 +35,7 @@
 #include "Pose.h"
 #include "Util.h"
 #include "FileFormat.h"
+#include "FrameArena.h"
 #include <vector>
 
 #include <ros/ros.h>
@@ -97,6 +98,7 @@ protected:
 	void camInfoCallback (const sensor_msgs::CameraInfoConstPtr &);
 	ros::Subscriber sub_;
 	ros::NodeHandle n_;
+	bool rectified;
 
 private:
 	bool LoadCalibXML(const char *calibfile);
@@ -204,40 +206,80 @@ public:
 	/** \brief Invert operation for \e GetOpenglProjectionMatrix */
 	void SetOpenglProjectionMatrix(double proj_matrix[16], const int width, const int height);
 
+	/** \brief Tells whether the images are already rectified (e.g. \e image_rect topics).
+	 *
+	 * The distortion coefficients are then ignored, and \e SetCameraInfo takes the
+	 * intrinsic matrix from the projection matrix P of the camera info.
+	 */
+	void SetRectified(bool _rectified = true) { rectified = _rectified; }
+
+	/** \brief True when the points need to be distorted and undistorted.
+	 *
+	 * False when the images are rectified or all the distortion coefficients
+	 * are zero; \e Undistort and \e Distort then return without touching the points.
+	 */
+	bool IsDistorted() const {
+		return !rectified && ((calib_D_data[0] != 0) || (calib_D_data[1] != 0) ||
+		                      (calib_D_data[2] != 0) || (calib_D_data[3] != 0));
+	}
+
+	/** \brief Distortion coefficients for the OpenCV functions, NULL when there is no distortion */
+	const CvMat *Distortion() const { return IsDistorted() ? &calib_D : NULL; }
+
 	/** \brief Unapplys the lens distortion for points on image plane. */
 	void Undistort(std::vector<PointDouble >& points);
 
+	/** \brief Unapplys the lens distortion for \e count points on image plane. */
+	void Undistort(PointDouble *points, size_t count);
+
 	/** \brief Unapplys the lens distortion for one point on an image plane. */
 	void Undistort(PointDouble &point);
 
 	/** \brief Unapplys the lens distortion for one point on an image plane. */
 	void Undistort(CvPoint2D32f& point);
 
+	/** \brief Unapplys the lens distortion for \e count points with coordinates in separate arrays.
+	 *
+	 * Computes in single precision, for the contour points before line fitting.
+	 */
+	void Undistort(float *x, float *y, size_t count);
+
 	/** \brief Applys the lens distortion for one point on an image plane. */
 	void Distort(CvPoint2D32f& point);
 
 	/** \brief Applys the lens distortion for points on image plane. */
 	void Distort(std::vector<PointDouble>& points);
 
+	/** \brief Applys the lens distortion for \e count points on image plane. */
+	void Distort(PointDouble *points, size_t count);
+
 	/** \brief Applys the lens distortion for points on image plane. */
 	void Distort(PointDouble &point);
 
+	/** \brief Applys the lens distortion for \e count points with coordinates in separate arrays.
+	 *
+	 * Computes in single precision, for the points where the marker content is sampled.
+	 */
+	void Distort(float *x, float *y, size_t count);
+
 	/** \brief Calculate exterior orientation */
 	void CalcExteriorOrientation(std::vector<CvPoint3D64f>& pw, std::vector<CvPoint2D64f>& pi, Pose *pose);
 
 	/** \brief Calculate exterior orientation
 	 */
 	void CalcExteriorOrientation(std::vector<CvPoint3D64f>& pw, std::vector<PointDouble >& pi,
-						CvMat *rodriques, CvMat *tra);
+						CvMat *rodriques, CvMat *tra, FrameArena *arena = NULL);
 
 	/** \brief Calculate exterior orientation
 	 */
-	void CalcExteriorOrientation(std::vector<PointDouble >& pw, std::vector<PointDouble >& pi,
-						CvMat *rodriques, CvMat *tra);
+	void CalcExteriorOrientation(const std::vector<PointDouble >& pw, const std::vector<PointDouble >& pi,
+						CvMat *rodriques, CvMat *tra, FrameArena *arena = NULL);
 
 	/** \brief Calculate exterior orientation
+	 *
+	 * The point buffers are taken from \e arena when one is given.
 	 */
-	void CalcExteriorOrientation(std::vector<PointDouble>& pw, std::vector<PointDouble >& pi, Pose *pose);
+	void CalcExteriorOrientation(const std::vector<PointDouble>& pw, const std::vector<PointDouble >& pi, Pose *pose, FrameArena *arena = NULL);
 
 	/** \brief Update existing pose based on new observations. Use (CV_32FC3 and CV_32FC2) for matrices. */
 	bool CalcExteriorOrientation(const CvMat* object_points, CvMat* image_points, Pose *pose);
@@ -279,9 +321,21 @@ struct ALVAR_EXPORT Homography {
 	
 	/** \brief Find Homography for two point-sets */
 	void Find(const std::vector<PointDouble>& pw, const std::vector<PointDouble>& pi);
+
+	/** \brief Find Homography for two point-sets of \e size points
+	 *
+	 * Four point correspondences are solved directly without heap allocations.
+	 */
+	void Find(const PointDouble *pw, const PointDouble *pi, int size);
 	
 	/** \brief Project points using the Homography */
 	void ProjectPoints(const std::vector<PointDouble>& from, std::vector<PointDouble>& to);
+
+	/** \brief Project \e count points using the Homography */
+	void ProjectPoints(const PointDouble *from, PointDouble *to, size_t count);
+
+	/** \brief Project \e count points using the Homography into separate single precision coordinate arrays */
+	void ProjectPoints(const PointDouble *from, float *to_x, float *to_y, size_t count);
 };
 
 } // namespace alvar
@@ -34,6 +34,8 @@
 #include "Util.h"
 #include "Line.h"
 #include "Camera.h"
+#include "FrameArena.h"
+#include "FrameImageCache.h"
 
 namespace alvar {
 
@@ -42,7 +44,8 @@ namespace alvar {
 */
 enum ALVAR_EXPORT LabelingMethod
 {
-	CVSEQ
+	CVSEQ,     ///< \e LabelingCvSeq, border following over the whole image
+	RUNLENGTH  ///< \e LabelingRunLength, run-length encoding with union-find
 };
 
 /**
@@ -54,10 +57,137 @@ class ALVAR_EXPORT Labeling
 protected :
 
 	Camera	 *cam;
+	FrameArena *arena;
+	FrameImageCache *image_cache;
+	bool gray_shared;                ///< \e gray belongs to \e image_cache
 	int thresh_param1, thresh_param2;
 
+	IplImage *source;                ///< Image being thresholded by \e ThresholdRows
+	int converted_rows;              ///< Rows of \e gray converted from \e source
+	int thresholded_rows;            ///< Rows of \e bw produced
+	std::vector<int> column_sums;    ///< Sums of the box filter window columns for the current row
+	std::vector<int> prefix_sums;    ///< Prefix sums of \e column_sums with replicated borders
+
+	bool cascade_enabled;
+	int cascade_min_contrast;
+	double cascade_max_side_ratio;
+
+	/**
+	 * \brief Rejects quads with strongly unequal sides or nearly flat or sharp corners.
+	*/
+	bool CheckShape(const CvPoint *quad) const;
+
+	/**
+	 * \brief Compares \e gray just inside and outside the edges of the quad.
+	 *
+	 * At least three edges must be darker inside by \e cascade_min_contrast.
+	 * The mean of the outside samples is returned in \e outside_mean.
+	*/
+	bool CheckEdgeContrast(const CvPoint *quad, double *outside_mean) const;
+
+	/**
+	 * \brief Checks that \e gray is dark just inside the corners of the quad.
+	*/
+	bool CheckBorderDarkness(const CvPoint *quad, double outside_mean) const;
+
+	/**
+	 * \brief A quad that passed all checks, with its contour stored in \e contour_points.
+	 *
+	 * The contour is \e contour_points[first] ... \e contour_points[first+count-1]
+	 * and \e corners are the indices of the polygon vertices in it, in contour order.
+	*/
+	struct QuadCandidate
+	{
+		int first;
+		int count;
+		int corners[4];
+	};
+
+	/**
+	 * \brief Contours of the quads of the current frame, one after another.
+	*/
+	std::vector<CvPoint> contour_points;
+
+	/**
+	 * \brief Quads of the current frame that are passed on to line fitting.
+	*/
+	std::vector<QuadCandidate> quads;
+
+	/**
+	 * \brief Approximates a closed contour with a polygon of four vertices (Douglas-Peucker).
+	 *
+	 * Gives up as soon as a fifth vertex would be needed.
+	 * \return false unless exactly four vertices approximate the contour within \e eps
+	*/
+	bool ApproxQuad(const CvPoint *points, int count, double eps, int corners[4]) const;
+
+	/**
+	 * \brief Tests the contour recorded last in \e contour_points and adds it to \e quads if it is a marker candidate.
+	 *
+	 * The contour is approximated with \e ApproxQuad and checked against the image border,
+	 * \e min_area and convexity before the rejection cascade. A rejected contour is
+	 * removed from \e contour_points.
+	*/
+	bool AddQuadCandidate(size_t first, double perimeter, double min_area);
+
+	/**
+	 * \brief Converts \e image to \e gray and thresholds it to \e bw, allocating both when needed.
+	 *
+	 * Same as \e BeginThreshold followed by \e ThresholdRows for all rows.
+	*/
+	void ThresholdImage(IplImage *image);
+
+	/**
+	 * \brief Starts converting and thresholding \e image a few rows at a time.
+	 *
+	 * The rows of \e bw are produced by \e ThresholdRows in order, and the rows of
+	 * \e gray are converted a band ahead of them. \e bw equals the result of
+	 * \e cvAdaptiveThreshold with \e CV_ADAPTIVE_THRESH_MEAN_C and \e CV_THRESH_BINARY_INV,
+	 * but the box filter keeps only column sums over the rows of the window instead of
+	 * a full size mean image, so the rows being processed stay in cache. The one pixel
+	 * frame of \e bw is cleared, so borders can be followed without bounds checks.
+	*/
+	void BeginThreshold(IplImage *image);
+
+	/**
+	 * \brief Produces the rows of \e bw up to \e y_end (exclusive).
+	*/
+	void ThresholdRows(int y_end);
+
+	/**
+	 * \brief Follows one border of \e bw starting from pixel (x, y) and marks its pixels.
+	 *
+	 * The marking is that of Suzuki and Abe (1985), used also by \e cvFindContours.
+	 * Outer borders are recorded to \e contour_points unless they get longer than
+	 * a convex shape of their bounding box could be; then they are only marked.
+	 * Hole borders are only marked.
+	 * \return true if the whole border was recorded
+	*/
+	bool TraceBorder(int x, int y, bool hole, double *perimeter);
+
+	/**
+	 * \brief Fits lines to the edges of \e quads and stores their intersections to \e blob_corners.
+	*/
+	void FitQuadCorners(IplImage *image, bool visualize);
+
 public :
 
+	/**
+	 * \brief Counters of the candidate rejection cascade for the latest \e LabelSquares call.
+	*/
+	struct CascadeStats
+	{
+		int contours;           ///< Contours that were long enough to be approximated
+		int quads;              ///< Convex 4-vertex polygons that entered the cascade
+		int rejected_shape;     ///< Rejected by the aspect and angle check
+		int rejected_contrast;  ///< Rejected by the edge contrast check
+		int rejected_border;    ///< Rejected by the border darkness check
+		int accepted;           ///< Passed on to line fitting and decoding
+
+		CascadeStats() : contours(0), quads(0), rejected_shape(0),
+			rejected_contrast(0), rejected_border(0), accepted(0) {}
+	};
+
 	/**
 	 * \brief Pointer to grayscale image that is thresholded for labeling.
 	*/
@@ -69,9 +199,16 @@ public :
 
 	/**
 	 * \brief Vector of 4-length vectors where the corners of detected blobs are stored.
+	 *
+	 * The vector is not shrunk between frames; entries beyond the current blobs are left empty.
 	*/
 	std::vector<std::vector<PointDouble> > blob_corners;
 
+	/**
+	 * \brief Rejection counters of the latest frame.
+	*/
+	CascadeStats cascade_stats;
+
 	/**
 	 * \brief Two alternatives for thresholding the gray image. ADAPT (adaptive threshold) is only supported currently.
 	*/
@@ -92,6 +229,16 @@ public :
 	*/
 	void SetCamera(Camera* camera) {cam = camera;}
 
+	/**
+	 * \brief Sets the arena that is used for per-frame temporaries.
+	*/
+	void SetArena(FrameArena* _arena) {arena = _arena;}
+
+	/**
+	 * \brief Sets the cache whose gray image is used when it holds the labeled image.
+	*/
+	void SetImageCache(FrameImageCache* _image_cache) {image_cache = _image_cache;}
+
 	/**
 	 * \brief Labels image and filters blobs to obtain square-shaped objects from the scene.
 	*/
@@ -104,10 +251,29 @@ public :
 		thresh_param1 = param1;
 		thresh_param2 = param2;
 	}
+
+	/**
+	 * \brief Sets the cheap checks that quads must pass before the edges are fitted.
+	 * \param enabled When false every convex quad is fitted and decoded as before; off by default
+	 * \param min_contrast Minimum gray level difference between the outside and the inside of the marker border
+	 * \param max_side_ratio Maximum ratio between the longest and the shortest side of the quad
+	*/
+	void SetCascadeParams(bool enabled=false, int min_contrast=10, double max_side_ratio=8.0)
+	{
+		cascade_enabled = enabled;
+		cascade_min_contrast = min_contrast;
+		cascade_max_side_ratio = max_side_ratio;
+	}
 };
 
 /**
  * \brief Labeling class that uses OpenCV routines to find connected components.
+ *
+ * \e LabelSquares follows the borders of the thresholded image itself and keeps
+ * only the outer borders that are approximated by four vertices; \e LabelImage
+ * uses \e cvFindContours. The whole frame is thresholded before any border is
+ * followed, since a border starting on one row can run through any row below it;
+ * \e LabelingRunLength labels the rows as they are thresholded.
 */
 class ALVAR_EXPORT LabelingCvSeq : public Labeling
 {
@@ -134,6 +300,69 @@ public:
 	CvSeq* LabelImage(IplImage* image, int min_size, bool approx=false);
 };
 
+/**
+ * \brief Labeling class that finds connected components from runs of object pixels.
+ *
+ * The thresholded image is encoded row by row as runs, and overlapping runs of
+ * adjacent rows (8-connectivity) are merged with union-find. Only the blobs whose
+ * bounding box can hold a quad large enough have their outer border followed
+ * for quad extraction, starting from their first run. The quads are the same as
+ * those of \e LabelingCvSeq; cluttered images with many small blobs and holes
+ * are labeled faster.
+*/
+class ALVAR_EXPORT LabelingRunLength : public Labeling
+{
+
+public :
+
+	/**
+	 * \brief Horizontal run of object pixels [x0, x1) on row y.
+	*/
+	struct Run
+	{
+		int y;
+		int x0, x1;
+	};
+
+	/**
+	 * \brief Connected component of the latest \e LabelSquares call.
+	*/
+	struct Blob
+	{
+		int first_run;          ///< Topmost run of the blob (leftmost on its row), where its outer border starts
+		int min_x, max_x;       ///< Bounding box, inclusive
+		int min_y, max_y;
+		int area;               ///< Number of pixels
+	};
+
+	/**
+	 * \brief Runs of the latest frame in raster order.
+	*/
+	std::vector<Run> runs;
+
+	/**
+	 * \brief Blobs of the latest frame, ordered by their first run.
+	*/
+	std::vector<Blob> blobs;
+
+	LabelingRunLength();
+
+	void LabelSquares(IplImage* image, bool visualize=false);
+
+protected :
+
+	int _min_edge;
+	int _min_area;
+
+	/** \brief Union-find parents of the runs; the root is the first run of the blob */
+	std::vector<int> parent;
+	/** \brief Index of the first run of every row and one past the last row */
+	std::vector<int> row_begin;
+
+	int FindRoot(int i);
+	void Union(int a, int b);
+};
+
 } // namespace alvar
 
 #endif
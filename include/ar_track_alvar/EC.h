@@ -35,6 +35,9 @@
 #include "Camera.h"
 #include "MarkerDetector.h"
 #include "MultiMarker.h"
+#include <algorithm>
+#include <map>
+#include <vector>
 
 namespace alvar {
 
@@ -233,6 +236,82 @@ public:
 	}
 };
 
+/** \brief Map from feature id to \e ExternalContainer items stored contiguously in id order
+ *
+ * This can be used instead of \e std::map<int,T> as the external container. The items
+ * are kept sorted by id in one array, so the passes over the container made by the EC
+ * methods walk memory linearly. New ids are usually larger than the existing ones and are
+ * appended; other inserts and single erases move the tail of the array. Use
+ * \e EraseItemsEC (or \e EraseIf) for erasing several items in one pass, and note that
+ * inserting or erasing invalidates the iterators and references to the items.
+ */
+template<typename T>
+class ECMap {
+public:
+	typedef int key_type;
+	typedef T mapped_type;
+	typedef std::pair<int,T> value_type;
+	typedef typename std::vector<value_type>::iterator iterator;
+	typedef typename std::vector<value_type>::const_iterator const_iterator;
+protected:
+	std::vector<value_type> items;
+	static bool IdLess(const value_type &item, int id) { return item.first < id; }
+public:
+	iterator begin() { return items.begin(); }
+	iterator end() { return items.end(); }
+	const_iterator begin() const { return items.begin(); }
+	const_iterator end() const { return items.end(); }
+	size_t size() const { return items.size(); }
+	bool empty() const { return items.empty(); }
+	void clear() { items.clear(); }
+	void reserve(size_t n) { items.reserve(n); }
+	/** \brief Find the item with the given \e id, or \e end() */
+	iterator find(int id) {
+		iterator iter = std::lower_bound(items.begin(), items.end(), id, IdLess);
+		if ((iter != items.end()) && (iter->first == id)) return iter;
+		return items.end();
+	}
+	const_iterator find(int id) const {
+		const_iterator iter = std::lower_bound(items.begin(), items.end(), id, IdLess);
+		if ((iter != items.end()) && (iter->first == id)) return iter;
+		return items.end();
+	}
+	/** \brief The item with the given \e id; a default item is inserted if there is none */
+	T &operator[](int id) {
+		if (items.empty() || (items.back().first < id)) {
+			items.push_back(value_type(id, T()));
+			return items.back().second;
+		}
+		iterator iter = std::lower_bound(items.begin(), items.end(), id, IdLess);
+		if ((iter == items.end()) || (iter->first != id)) {
+			iter = items.insert(iter, value_type(id, T()));
+		}
+		return iter->second;
+	}
+	/** \brief Erase one item, returning the iterator to the item after it */
+	iterator erase(iterator iter) { return items.erase(iter); }
+	/** \brief Erase the item with the given \e id, returning the number of items erased */
+	size_t erase(int id) {
+		iterator iter = find(id);
+		if (iter == items.end()) return 0;
+		items.erase(iter);
+		return 1;
+	}
+	/** \brief Erase the items for which \e erase_test returns true in one pass */
+	template<typename F>
+	int EraseIf(F erase_test) {
+		iterator iter_out = items.begin();
+		for (iterator iter = items.begin(); iter != items.end(); iter++) {
+			if (erase_test(*iter)) continue;
+			if (iter_out != iter) *iter_out = *iter;
+			iter_out++;
+		}
+		int count = int(items.end() - iter_out);
+		items.erase(iter_out, items.end());
+		return count;
+	}
+};
+
 /** \brief Erasing items from container using \e DoEraseTest type functor */
 template<typename T, typename F>
 inline int EraseItemsEC(std::map<int,T> &container, F do_erase_test) {
@@ -248,6 +327,21 @@ inline int EraseItemsEC(std::map<int,T> &container, F do_erase_test) {
 	return count;
 }
 
+/** \brief Adapts a \e DoEraseTest type functor to the items of \e ECMap */
+template<typename T, typename F>
+class EraseItemTest {
+	F &do_erase_test;
+public:
+	EraseItemTest(F &_do_erase_test) : do_erase_test(_do_erase_test) {}
+	bool operator()(const std::pair<int,T> &item) const { return do_erase_test(item.second); }
+};
+
+/** \brief Erasing items from \e ECMap using \e DoEraseTest type functor */
+template<typename T, typename F>
+inline int EraseItemsEC(ECMap<T> &container, F do_erase_test) {
+	return container.EraseIf(EraseItemTest<T,F>(do_erase_test));
+}
+
 /** \brief Version of \e TrackerFeatures using external container */
 class TrackerFeaturesEC : public TrackerFeatures {
 protected:
@@ -258,9 +352,10 @@ public:
 		: TrackerFeatures(_max_features, _min_features, _quality_level, _min_distance, _pyr_levels, win_size), purge(false) {}
 
 	/** \brief Track features with matching type id. New features will have id's in the specified id range. */
-	template<typename T>
-	bool Track(IplImage *img, IplImage *mask, std::map<int,T> &container, int type_id=-1, int first_id=-1, int last_id=-1)
+	template<typename C>
+	bool Track(IplImage *img, IplImage *mask, C &container, int type_id=-1, int first_id=-1, int last_id=-1)
 	{
+		typedef typename C::mapped_type T;
 		DoHandleTest<T> do_handle_test_default(type_id);
 		if (type_id == -1) type_id=0;
 		return Track(img, mask, container, do_handle_test_default, type_id, first_id, last_id);
@@ -271,8 +366,8 @@ public:
 	bool Track(IplImage *img, IplImage *mask, std::map<int,T> &container, F do_handle_test, int type_id=0, int first_id=0, int last_id=65535)
 	{
 		// Update features to match the ones in the given container
-		typename std::map<int,T>::iterator iter = container.begin();
-		typename std::map<int,T>::iterator iter_end = container.end();
+		typename C::iterator iter = container.begin();
+		typename C::iterator iter_end = container.end();
 		feature_count = 0;
 		for (;iter != iter_end; iter++) {
 			T &f = iter->second;
@@ -307,14 +402,15 @@ public:
 	}*/
 
 	/** \brief Track features matching the given functor. If first_id >= 0 we call \e AddFeatures with the specified id range. */
-	template<typename T, typename F>
-	bool Track(IplImage *img, IplImage *mask, std::map<int,T> &container, F do_handle_test, int type_id=0, int first_id=-1, int last_id=-1)
+	template<typename C, typename F>
+	bool Track(IplImage *img, IplImage *mask, C &container, F do_handle_test, int type_id=0, int first_id=-1, int last_id=-1)
 	{
+		typedef typename C::mapped_type T;
 		// When first_id && last_id are < 0 then we don't add new features...
 		if (first_id < 0) last_id = -1;
 		// Update features to match the ones in the given container
-		typename std::map<int,T>::iterator iter = container.begin();
-		typename std::map<int,T>::iterator iter_end = container.end();
+		typename C::iterator iter = container.begin();
+		typename C::iterator iter_end = container.end();
 		feature_count = 0;
 		for (;iter != iter_end; iter++) {
 			T &f = iter->second;
@@ -354,9 +450,10 @@ public:
 	}
 
 	/** \brief add features to the previously tracked frame if there are less than min_features */
-	template<typename T>
-	bool AddFeatures(std::map<int,T> &container, int type_id=0, int first_id=0, int last_id=65535)
+	template<typename C>
+	bool AddFeatures(C &container, int type_id=0, int first_id=0, int last_id=65535)
 	{
+		typedef typename C::mapped_type T;
 		if (TrackerFeatures::AddFeatures() == 0) return false;
 		// Update the container to have the updated features
 		for (int i=0; i<feature_count; i++) {
@@ -371,9 +468,10 @@ public:
 	}
 
 	/** \brief Erases the items matching with \e type_id having \e has_p2d == false . If \e type_id == -1 doesn't test the type. */
-	template<typename T>
-	int EraseNonTracked(std::map<int,T> &container, int type_id=-1)
+	template<typename C>
+	int EraseNonTracked(C &container, int type_id=-1)
 	{
+		typedef typename C::mapped_type T;
 		DoEraseTest<T> do_erase_test(true, false, type_id);
 		return EraseItemsEC(container, do_erase_test);
 	}
@@ -390,208 +488,186 @@ public:
 
 /** \brief Version of \e Camera using external container */
 class ALVAR_EXPORT CameraEC : public Camera {
+protected:
+	/** \brief Point buffers reused by the pose methods instead of allocating matrices on every call */
+	std::vector<float> world_points_fl, image_observations_fl;
+	std::vector<double> world_points_db, image_observations_db, weights_db;
 public:
 	/** \brief Undistort the items with matching \e type_id */
-	template<typename T>
-	void Undistort(std::map<int,T> &container, int type_id=-1) {
+	template<typename C>
+	void Undistort(C &container, int type_id=-1) {
+		typedef typename C::mapped_type T;
 		DoHandleTest<T> do_handle_test_default(type_id);
 		return Undistort(container, do_handle_test_default);
 	}
 	/** \brief Undistort the items matching the given functor */
-	template<typename T, typename F>
-	void Undistort(std::map<int,T> &container, F &do_handle_test) {
-		typename std::map<int,T>::iterator iter = container.begin();
-		typename std::map<int,T>::iterator iter_end = container.end();
+	template<typename C, typename F>
+	void Undistort(C &container, F &do_handle_test) {
+		typedef typename C::mapped_type T;
+		typename C::iterator iter = container.begin();
+		typename C::iterator iter_end = container.end();
 		for (;iter != iter_end; iter++) {
 			T &f = iter->second;
-			if (!do_handle(f)) continue;
-			if (f.has_p2d) Undistort(f.p2d);
+			if (!do_handle_test(f)) continue;
+			if (f.has_p2d) Camera::Undistort(f.p2d);
 		}
 	}
 	/** \brief Distort the items with matching \e type_id */
-	template<typename T>
-	void Distort(std::map<int,T> &container, int type_id=-1) {
+	template<typename C>
+	void Distort(C &container, int type_id=-1) {
+		typedef typename C::mapped_type T;
 		DoHandleTest<T> do_handle_test_default(type_id);
 		return Distort(container, do_handle_test_default);
 	}
 	/** \brief Distort the items matching the given functor */
-	template<typename T, typename F>
-	void Distort(std::map<int,T> &container, F &do_handle_test) {
-		typename std::map<int,T>::iterator iter = container.begin();
-		typename std::map<int,T>::iterator iter_end = container.end();
+	template<typename C, typename F>
+	void Distort(C &container, F &do_handle_test) {
+		typedef typename C::mapped_type T;
+		typename C::iterator iter = container.begin();
+		typename C::iterator iter_end = container.end();
 		for (;iter != iter_end; iter++) {
 			T &f = iter->second;
-			if (!do_handle(f)) continue;
-			if (f.has_p2d) Distort(f.p2d);
+			if (!do_handle_test(f)) continue;
+			if (f.has_p2d) Camera::Distort(f.p2d);
 		}
 	}
 	/** \brief Calculate the \e pose using the items with matching \e type_id */
-	template<typename T>
-	bool CalcExteriorOrientation(std::map<int,T> &container, Pose *pose, int type_id=-1) {
+	template<typename C>
+	bool CalcExteriorOrientation(C &container, Pose *pose, int type_id=-1) {
+		typedef typename C::mapped_type T;
 		DoHandleTest<T> do_handle_test_default(type_id);
 		return CalcExteriorOrientation(container, pose, do_handle_test_default);
 	}
 	/** \brief Calculate the \e pose using the items matching the given functor */
-	template<typename T, typename F>
-	bool CalcExteriorOrientation(std::map<int,T> &container, Pose *pose, F do_handle_test) {
+	template<typename C, typename F>
+	bool CalcExteriorOrientation(C &container, Pose *pose, F do_handle_test) {
+		typedef typename C::mapped_type T;
 		int count_points = container.size();
 		if(count_points < 4) return false;
-		CvMat* world_points = cvCreateMat(count_points, 1, CV_32FC3);
-		CvMat* image_observations = cvCreateMat(count_points*2, 1, CV_32FC2);
-		typename std::map<int,T>::iterator iter = container.begin();
-		typename std::map<int,T>::iterator iter_end = container.end();
+		world_points_fl.resize(count_points*3);
+		image_observations_fl.resize(count_points*2);
+		typename C::iterator iter = container.begin();
+		typename C::iterator iter_end = container.end();
 		int ind = 0;
 		for (;iter != iter_end; iter++) {
 			T &f = iter->second;
 			if (!do_handle_test(f)) continue;
 			if (f.has_p2d && f.has_p3d) {
-				world_points->data.fl[ind*3+0] = (float)f.p3d.x;
-				world_points->data.fl[ind*3+1] = (float)f.p3d.y;
-				world_points->data.fl[ind*3+2] = (float)f.p3d.z;
-				image_observations->data.fl[ind*2+0]  = (float)f.p2d.x;
-				image_observations->data.fl[ind*2+1]  = (float)f.p2d.y;
+				world_points_fl[ind*3+0] = (float)f.p3d.x;
+				world_points_fl[ind*3+1] = (float)f.p3d.y;
+				world_points_fl[ind*3+2] = (float)f.p3d.z;
+				image_observations_fl[ind*2+0]  = (float)f.p2d.x;
+				image_observations_fl[ind*2+1]  = (float)f.p2d.y;
 				ind++;
 			}
 		}
 		if (ind<4) return false;
 
-		CvRect r; r.x = 0; r.y = 0; r.height = ind; r.width = 1;
-		CvMat world_points_sub;
-		cvGetSubRect(world_points, &world_points_sub, r);
-		CvMat image_observations_sub;
-		cvGetSubRect(image_observations, &image_observations_sub, r);
-
-		bool ret = Camera::CalcExteriorOrientation(&world_points_sub, &image_observations_sub, pose);
-
-		cvReleaseMat(&image_observations);
-		cvReleaseMat(&world_points);
-
-		return ret;		
+		CvMat world_points = cvMat(ind, 1, CV_32FC3, &world_points_fl[0]);
+		CvMat image_observations = cvMat(ind, 1, CV_32FC2, &image_observations_fl[0]);
+		return Camera::CalcExteriorOrientation(&world_points, &image_observations, pose);
 	}
 	/** \brief Update the \e pose using the items with matching \e type_id */
-	template<typename T>
-	bool UpdatePose(std::map<int,T> &container, Pose *pose, int type_id=-1, std::map<int,double> *weights=0) {
+	template<typename C>
+	bool UpdatePose(C &container, Pose *pose, int type_id=-1, std::map<int,double> *weights=0) {
+		typedef typename C::mapped_type T;
 		DoHandleTest<T> do_handle_test_default(type_id);
 		return UpdatePose(container, pose, do_handle_test_default, weights);
 	}
 	/** \brief Update the rotation in \e pose using the items with matching \e type_id */
-	template<typename T>
-	bool UpdateRotation(std::map<int,T> &container, Pose *pose, int type_id=-1) {
+	template<typename C>
+	bool UpdateRotation(C &container, Pose *pose, int type_id=-1) {
+		typedef typename C::mapped_type T;
 		DoHandleTest<T> do_handle_test_default(type_id);
 		return UpdateRotation(container, pose, do_handle_test_default);
 	}
 	/** \brief Update the rotation in \e pose using the items  matching the given functor */
-	template<typename T, typename F>
-	bool UpdateRotation(std::map<int,T> &container, Pose *pose, F do_handle_test) {
+	template<typename C, typename F>
+	bool UpdateRotation(C &container, Pose *pose, F do_handle_test) {
+		typedef typename C::mapped_type T;
 		int count_points = container.size();
 		if(count_points < 6) return false;
-
-		CvMat* world_points = cvCreateMat(count_points, 1, CV_64FC3);
-		CvMat* image_observations = cvCreateMat(count_points*2, 1, CV_64F); // [u v u v u v ...]'
+		world_points_db.resize(count_points*3);
+		image_observations_db.resize(count_points*2); // [u v u v u v ...]'
 
 		int ind = 0;
-		typename std::map<int,T>::iterator iter = container.begin();
-		typename std::map<int,T>::iterator iter_end = container.end();
+		typename C::iterator iter = container.begin();
+		typename C::iterator iter_end = container.end();
 		for (;iter != iter_end; iter++) {
 			T &f = iter->second;
 			if (!do_handle_test(f)) continue;
 			if (f.has_p2d && f.has_p3d) {
-				world_points->data.db[ind*3+0] = f.p3d.x;
-				world_points->data.db[ind*3+1] = f.p3d.y;
-				world_points->data.db[ind*3+2] = f.p3d.z;
-				image_observations->data.db[ind*2+0] = f.p2d.x;
-				image_observations->data.db[ind*2+1] = f.p2d.y;
+				world_points_db[ind*3+0] = f.p3d.x;
+				world_points_db[ind*3+1] = f.p3d.y;
+				world_points_db[ind*3+2] = f.p3d.z;
+				image_observations_db[ind*2+0] = f.p2d.x;
+				image_observations_db[ind*2+1] = f.p2d.y;
 				ind++;
 			}
 		}
 		if (ind < 6) return false;
 
-		CvRect r; r.x = 0; r.y = 0; r.height = ind; r.width = 1;
-		CvMat world_points_sub;
-		cvGetSubRect(world_points, &world_points_sub, r);
-
-		r.height = 2*ind;
-		CvMat image_observations_sub;
-		cvGetSubRect(image_observations, &image_observations_sub, r);
-
-		bool ret = UpdateRotation(&world_points_sub, &image_observations_sub, pose);
-
-		cvReleaseMat(&image_observations);
-		cvReleaseMat(&world_points);
-
-		return ret;		
+		CvMat world_points = cvMat(ind, 1, CV_64FC3, &world_points_db[0]);
+		CvMat image_observations = cvMat(2*ind, 1, CV_64F, &image_observations_db[0]);
+		return UpdateRotation(&world_points, &image_observations, pose);
 	}	
 	/** \brief Update the \e pose using the items matching the given functor */
-	template<typename T, typename F>
-	bool UpdatePose(std::map<int,T> &container, Pose *pose, F do_handle_test, std::map<int,double> *weights=0) {
+	template<typename C, typename F>
+	bool UpdatePose(C &container, Pose *pose, F do_handle_test, std::map<int,double> *weights=0) {
+		typedef typename C::mapped_type T;
 		int count_points = container.size();
 		if(count_points < 4) return false; // Note, UpdatePose calls CalcExteriorOrientation if 4 or 5 points
-
-		CvMat* world_points = cvCreateMat(count_points, 1, CV_64FC3);
-		CvMat* image_observations = cvCreateMat(count_points*2, 1, CV_64F); // [u v u v u v ...]'
-		CvMat* w = 0;
-		if(weights) w = cvCreateMat(count_points*2, 1, CV_64F);
+		world_points_db.resize(count_points*3);
+		image_observations_db.resize(count_points*2); // [u v u v u v ...]'
+		if(weights) weights_db.resize(count_points*2);
 
 		int ind = 0;
-		typename std::map<int,T>::iterator iter = container.begin();
-		typename std::map<int,T>::iterator iter_end = container.end();
+		typename C::iterator iter = container.begin();
+		typename C::iterator iter_end = container.end();
 		for (;iter != iter_end; iter++) {
 			T &f = iter->second;
 			if (!do_handle_test(f)) continue;
 			if (f.has_p2d && f.has_p3d) {
-				world_points->data.db[ind*3+0] = f.p3d.x;
-				world_points->data.db[ind*3+1] = f.p3d.y;
-				world_points->data.db[ind*3+2] = f.p3d.z;
-				image_observations->data.db[ind*2+0] = f.p2d.x;
-				image_observations->data.db[ind*2+1] = f.p2d.y;
+				world_points_db[ind*3+0] = f.p3d.x;
+				world_points_db[ind*3+1] = f.p3d.y;
+				world_points_db[ind*3+2] = f.p3d.z;
+				image_observations_db[ind*2+0] = f.p2d.x;
+				image_observations_db[ind*2+1] = f.p2d.y;
 
 				if(weights) 
-					w->data.db[ind*2+1] = w->data.db[ind*2+0] = (*weights)[iter->first];
+					weights_db[ind*2+1] = weights_db[ind*2+0] = (*weights)[iter->first];
 				ind++;
 			}
 		}
 		if (ind < 4) return false; // Note, UpdatePose calls CalcExteriorOrientation if 4 or 5 points
 
-		CvRect r; r.x = 0; r.y = 0; r.height = ind; r.width = 1;
-		CvMat world_points_sub;
-		cvGetSubRect(world_points, &world_points_sub, r);
-
-		r.height = 2*ind;
-		CvMat image_observations_sub;
-		cvGetSubRect(image_observations, &image_observations_sub, r);
-
-		bool ret;
+		CvMat world_points = cvMat(ind, 1, CV_64FC3, &world_points_db[0]);
+		CvMat image_observations = cvMat(2*ind, 1, CV_64F, &image_observations_db[0]);
 		if (weights) {
-			CvMat w_sub;
-			cvGetSubRect(w, &w_sub, r);
-			ret = UpdatePose(&world_points_sub, &image_observations_sub, pose, &w_sub);
+			CvMat w = cvMat(2*ind, 1, CV_64F, &weights_db[0]);
+			return UpdatePose(&world_points, &image_observations, pose, &w);
 		}
-		else 
-			ret = UpdatePose(&world_points_sub, &image_observations_sub, pose);
-
-		cvReleaseMat(&image_observations);
-		cvReleaseMat(&world_points);
-		if(w) cvReleaseMat(&w);
-
-		return ret;		
+		return UpdatePose(&world_points, &image_observations, pose);
 	}
 
 	/** \brief Projects \e p3d in the items matching with \e type_id into \e projected_p2d . If \e type_id == -1 doesn't test the type. */
-	template<typename T>
-	float Reproject(std::map<int,T> &container, Pose *pose, int type_id=-1, bool needs_has_p2d=false, bool needs_has_p3d=false, float average_outlier_limit=0.f)
+	template<typename C>
+	float Reproject(C &container, Pose *pose, int type_id=-1, bool needs_has_p2d=false, bool needs_has_p3d=false, float average_outlier_limit=0.f)
 	{
+		typedef typename C::mapped_type T;
 		DoHandleTest<T> do_handle_test(type_id, needs_has_p2d, needs_has_p3d);
 		return Reproject(container, pose, do_handle_test, average_outlier_limit);
 	}
 	/** \brief Projects \e p3d in the items matching with the given functor */
-	template<typename T, typename F>
-	float Reproject(std::map<int,T> &container, Pose *pose, F do_handle_test, float average_outlier_limit=0.f)
+	template<typename C, typename F>
+	float Reproject(C &container, Pose *pose, F do_handle_test, float average_outlier_limit=0.f)
 	{
+		typedef typename C::mapped_type T;
 		float reprojection_sum=0.f;
 		int   reprojection_count=0;
 		float limit_sq = average_outlier_limit*average_outlier_limit;
-		typename std::map<int,T>::iterator iter = container.begin();
-		typename std::map<int,T>::iterator iter_end = container.end();
+		typename C::iterator iter = container.begin();
+		typename C::iterator iter_end = container.end();
 		for(;iter != iter_end;iter++) {
 			T &f = iter->second;
 			if (!do_handle_test(f)) continue;
@@ -614,9 +690,10 @@ public:
 	 * If \e type_id == -1 doesn't test the type. 
 	 * If \e pose is given calls \e Reproject() internally -- otherwise assumes it has been called beforehands. 
 	 */
-	template<typename T>
-	int EraseUsingReprojectionError(std::map<int,T> &container, float reprojection_error_limit, int type_id=-1, Pose *pose = 0)
+	template<typename C>
+	int EraseUsingReprojectionError(C &container, float reprojection_error_limit, int type_id=-1, Pose *pose = 0)
 	{
+		typedef typename C::mapped_type T;
 		if (pose) Reproject(container, pose, type_id, false, false);
 		DoEraseTest<T> do_erase_test(reprojection_error_limit, false, false, type_id) ;
 		return EraseItemsEC(container, do_erase_test);
@@ -671,10 +748,10 @@ public:
 	}
 
 	/** \brief Detect markers in the image and fill in their 2D-positions in the given external container */
-	template<typename T>
+	template<typename C>
 	int Detect(IplImage *image,
 			   Camera *cam,
-			   std::map<int,T> &container,
+			   C &container,
 			   int type_id=0,
 			   int first_id=0,
 			   int last_id=65535,
@@ -684,11 +761,12 @@ public:
 			   double max_track_error=0.2,
 			   LabelingMethod labeling_method=CVSEQ)
 	{
+		typedef typename C::mapped_type T;
 		int ret;
 
 		// The existing markers in the container are marked to not have valid p2d (has_p2d=false)
-		typename std::map<int,T>::iterator iter = container.begin();
-		typename std::map<int,T>::iterator iter_end = container.end();
+		typename C::iterator iter = container.begin();
+		typename C::iterator iter_end = container.end();
 		for (;iter != iter_end; iter++) {
 			T &f = iter->second;
 			if (f.type_id != type_id) continue;
@@ -716,8 +794,9 @@ public:
 	}
 
 	/** \brief Fill in 3D-coordinates for \e marker_id marker corners using \e edge_length and \e pose */
-	template<typename T>
-	void MarkerToEC(std::map<int,T> &container, int marker_id, double edge_length, Pose &pose, int type_id=0, int first_id=0,int last_id=65535) {
+	template<typename C>
+	void MarkerToEC(C &container, int marker_id, double edge_length, Pose &pose, int type_id=0, int first_id=0,int last_id=65535) {
+		typedef typename C::mapped_type T;
 		CvMat *m3 = cvCreateMat(4,4,CV_64F); cvSetIdentity(m3);
 		pose.GetMatrix(m3);
 
@@ -759,8 +838,9 @@ public:
 class MultiMarkerEC : public MultiMarker {
 public:
 	/** \brief Fill in 3D-coordinates for marker corners to the given container */
-	template<typename T>
-	bool MarkersToEC(std::map<int,T> &container, int type_id=0, int first_id=0,int last_id=65535) {
+	template<typename C>
+	bool MarkersToEC(C &container, int type_id=0, int first_id=0,int last_id=65535) {
+		typedef typename C::mapped_type T;
 		bool ret = false;
 		for (size_t i = 0; i < marker_indices.size(); i++) {
 			if (marker_status[i] == 0) continue; // Skip the ones not in point cloud 
@@ -782,22 +862,22 @@ public:
 		return ret;
 	}
 
-	template<typename T>
-	bool MarkersFromEC(std::map<int,T> &container, int type_id=0, int first_id=0,int last_id=65535) {
+	template<typename C>
+	bool MarkersFromEC(C &container, int type_id=0, int first_id=0,int last_id=65535) {
 		// TODO...
 		return false;
 	}
 
-	template<typename T>
-	bool Save(std::map<int,T> &container, const char* fname, FILE_FORMAT format = FILE_FORMAT_DEFAULT, int type_id=0, int first_id=0,int last_id=65535) {
+	template<typename C>
+	bool Save(C &container, const char* fname, FILE_FORMAT format = FILE_FORMAT_DEFAULT, int type_id=0, int first_id=0,int last_id=65535) {
 		if (!MarkersFromEC(container, type_id, first_id, last_id)) return false;
 		if (!MultiMarker::Save(fname, format)) return false;
 		return true;
 	}
 
 	/** \brief Fill in 3D-coordinates for marker corners to the given container using save \e MultiMarker file */
-	template<typename T>
-	bool Load(std::map<int,T> &container, const char* fname, FILE_FORMAT format = FILE_FORMAT_DEFAULT, int type_id=0, int first_id=0,int last_id=65535) {
+	template<typename C>
+	bool Load(C &container, const char* fname, FILE_FORMAT format = FILE_FORMAT_DEFAULT, int type_id=0, int first_id=0,int last_id=65535) {
 		if (!MultiMarker::Load(fname, format)) return false;
 		return MarkersToEC(container, type_id, first_id, last_id);
 	}
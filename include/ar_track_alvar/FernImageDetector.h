@@ -90,11 +90,20 @@ public:
     void train(const std::string &filename);
     void train(Mat &image);
     void findFeatures(Mat &image, bool planeAssumption = true);
+
+    /** \brief Number of threads classifying the keypoints in \e findFeatures
+     *
+     *  Use 0 for one thread per core. Without OpenMP support the keypoints
+     *  are always classified in one thread.
+     */
+    void setThreadCount(int n) { mThreadCount = n; }
 	
     bool read(const std::string &filename, const bool binary = true);
     bool write(const std::string &filename, const bool binary = true);
 
 private:
+    int parallelThreads() const;
+
     PatchGenerator mPatchGenerator;
     LDetector mLDetector;
     std::vector<FernClassifierWrapper> mClassifier;
@@ -109,6 +118,7 @@ private:
     cv::Mat mCorrespondences;
     cv::Mat mHomography;
     double mInlierRatio;
+    int mThreadCount;
 };
 
 } // namespace alvar
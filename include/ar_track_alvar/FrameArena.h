@@ -0,0 +1,178 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+#ifndef FRAMEARENA_H
+#define FRAMEARENA_H
+
+/**
+ * \file FrameArena.h
+ *
+ * \brief This file implements a resettable arena for per-frame temporaries.
+ */
+
+#include "Alvar.h"
+#include "Uncopyable.h"
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace alvar {
+
+/**
+ * \brief Bump allocator for temporaries that live at most one frame.
+ *
+ * Memory is handed out from a list of blocks that are kept when the arena is
+ * \e Reset, so once the arena has grown to the working set of a typical frame
+ * no further heap allocations are made. Objects allocated from the arena are
+ * never destructed; only use it for types with trivial destructors.
+ */
+class ALVAR_EXPORT FrameArena : private Uncopyable
+{
+public:
+    /**
+     * \brief Position in the arena that can be returned to with \e Release.
+     */
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
+
+    /**
+     * \brief Constructor.
+     *
+     * \param block_size Size of each block in bytes. Larger requests get a block of their own.
+     */
+    FrameArena(size_t block_size = 64*1024);
+
+    /**
+     * \brief Destructor.
+     */
+    ~FrameArena();
+
+    /**
+     * \brief Returns \e bytes of uninitialized memory aligned to \e alignment.
+     */
+    void *Allocate(size_t bytes, size_t alignment = 16);
+
+    /**
+     * \brief Returns \e count default constructed elements of type \e T.
+     */
+    template<class T>
+    T *Allocate(size_t count) {
+        T *p = static_cast<T *>(Allocate(count * sizeof(T)));
+        for (size_t i = 0; i < count; i++) new (p + i) T();
+        return p;
+    }
+
+    /**
+     * \brief Returns the current position so that later allocations can be released.
+     */
+    Mark GetMark() const;
+
+    /**
+     * \brief Releases everything allocated after \e mark was taken.
+     */
+    void Release(const Mark &mark);
+
+    /**
+     * \brief Releases everything. The blocks are kept for reuse.
+     */
+    void Reset();
+
+    /**
+     * \brief Total number of bytes reserved from the heap.
+     */
+    size_t Capacity() const;
+
+    /**
+     * \brief Number of blocks reserved from the heap.
+     */
+    size_t BlockCount() const { return blocks.size(); }
+
+private:
+    struct Block {
+        char *data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t block_size;
+    size_t current;
+    size_t offset;
+};
+
+/**
+ * \brief Scoped allocation from a \e FrameArena.
+ *
+ * Everything allocated through the scope is released when it goes out of
+ * scope. When constructed with a NULL arena the scope allocates from a small
+ * buffer of its own on the stack, so that functions taking an optional arena
+ * keep working for callers that do not have one without touching the heap.
+ * Only when that buffer runs out does the scope reserve a private arena.
+ */
+class ALVAR_EXPORT FrameArenaScope : private Uncopyable
+{
+public:
+    /**
+     * \brief Constructor.
+     *
+     * \param arena The arena to allocate from, or NULL to use the local buffer.
+     */
+    FrameArenaScope(FrameArena *arena);
+
+    /**
+     * \brief Destructor.
+     */
+    ~FrameArenaScope();
+
+    /**
+     * \brief Returns \e bytes of uninitialized memory aligned to \e alignment.
+     */
+    void *Allocate(size_t bytes, size_t alignment = 16);
+
+    /**
+     * \brief Returns \e count default constructed elements of type \e T.
+     */
+    template<class T>
+    T *Allocate(size_t count) {
+        T *p = static_cast<T *>(Allocate(count * sizeof(T)));
+        for (size_t i = 0; i < count; i++) new (p + i) T();
+        return p;
+    }
+
+    /**
+     * \brief The arena used by this scope, or NULL while it allocates from its local buffer.
+     */
+    FrameArena *Get() { return arena; }
+
+private:
+    static const size_t LOCAL_SIZE = 4096;
+    FrameArena *owned;
+    FrameArena *arena;
+    FrameArena::Mark mark;
+    size_t local_offset;
+    double local[LOCAL_SIZE/sizeof(double)];
+};
+
+} // namespace alvar
+
+#endif
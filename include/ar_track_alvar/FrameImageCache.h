@@ -0,0 +1,94 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+#ifndef FRAMEIMAGECACHE_H
+#define FRAMEIMAGECACHE_H
+
+/**
+ * \file FrameImageCache.h
+ *
+ * \brief This file implements a cache for the images derived from one frame.
+ */
+
+#include "Alvar.h"
+#include "Uncopyable.h"
+#include <cxcore.h>
+
+namespace alvar {
+
+/**
+ * \brief Gray image of the current frame, computed at most once.
+ *
+ * When several consumers process the same frame (e.g. \e MarkerDetector and
+ * \e TrackerFeatures in \e SimpleSfM), they can share one cache instead of
+ * each converting the frame again. Call \e SetImage once per frame; the
+ * gray image is made on first request and kept until the next frame.
+ * The buffer is reused between frames of the same size.
+ */
+class ALVAR_EXPORT FrameImageCache : private Uncopyable
+{
+public:
+    /**
+     * \brief Constructor.
+     */
+    FrameImageCache();
+
+    /**
+     * \brief Destructor.
+     */
+    ~FrameImageCache();
+
+    /**
+     * \brief Starts a new frame. The images derived from the previous frame are invalidated.
+     *
+     * \param image The frame, 1, 3 or 4 channels of 8 bits. It must stay valid until the next call.
+     */
+    void SetImage(IplImage *image);
+
+    /**
+     * \brief The frame given to \e SetImage.
+     */
+    IplImage *GetImage() const { return image; }
+
+    /**
+     * \brief Number of frames given to \e SetImage.
+     */
+    long GetFrameCount() const { return frame_count; }
+
+    /**
+     * \brief 8-bit single channel version of the frame.
+     *
+     * A single channel frame is returned as such. The returned image must not be modified.
+     */
+    IplImage *GetGray();
+
+private:
+    IplImage *image;
+    long frame_count;
+    IplImage *gray;
+    bool gray_ready;
+};
+
+} // namespace alvar
+
+#endif
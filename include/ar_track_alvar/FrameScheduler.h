@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file 
+ * 
+ * Decides which incoming camera frames the detection nodes process
+ *
+ */
+
+#ifndef AR_TRACK_ALVAR_FRAME_SCHEDULER_H
+#define AR_TRACK_ALVAR_FRAME_SCHEDULER_H
+
+#include <ros/ros.h>
+#include "ar_track_alvar/Filter.h"
+
+namespace ar_track_alvar
+{
+
+/**
+ * How frames are picked for processing. The values match the frame_policy
+ * enum in cfg/Params.cfg.
+ */
+enum FramePolicy
+{
+  /** Process the newest frame as soon as it arrives, skipping stale ones */
+  PROCESS_LATEST = 0,
+  /** Process at most max_frequency frames per second */
+  FIXED_RATE = 1,
+  /** Process every frame the transport delivers */
+  AS_FAST_AS_POSSIBLE = 2
+};
+
+/**
+ * Frame scheduler for callback-driven processing. Call startFrame() first in
+ * the image callback and finishFrame() once the frame has been processed.
+ *
+ * Frames are skipped adaptively from the measured processing time: with
+ * FIXED_RATE the processing interval grows to the processing time when the
+ * detector cannot keep up with max_frequency, and with PROCESS_LATEST a frame
+ * is dropped when it is older than the transport latency plus one frame
+ * period, i.e. when a newer frame has already been captured.
+ */
+class FrameScheduler
+{
+ public:
+  FrameScheduler(FramePolicy policy = FIXED_RATE, double max_frequency = 10.0);
+
+  void setPolicy(FramePolicy policy) { policy_ = policy; }
+  FramePolicy getPolicy() const { return policy_; }
+  void setMaxFrequency(double max_frequency) { max_frequency_ = max_frequency; }
+
+  /** Returns true if the frame with the given stamp should be processed now */
+  bool startFrame(const ros::Time &stamp);
+  /** Marks the end of processing of the frame accepted by startFrame() */
+  void finishFrame();
+
+  /** Age of the last frame when startFrame() was called, in seconds */
+  double getFrameAge() const { return frame_age_; }
+  /** Smoothed processing time of the accepted frames, in seconds */
+  double getProcessingTime() const { return processing_time_.get(); }
+  /** Smoothed period of the incoming frames, in seconds */
+  double getFramePeriod() const { return frame_period_.get(); }
+
+  unsigned long processed_count;
+  unsigned long skipped_count;
+
+ private:
+  FramePolicy policy_;
+  double max_frequency_;
+  double frame_age_;
+  double min_latency_;
+  ros::Time last_stamp_;
+  ros::Time last_processed_stamp_;
+  ros::WallTime processing_start_;
+  bool processing_;
+  alvar::FilterRunningAverage processing_time_;
+  alvar::FilterRunningAverage frame_period_;
+};
+
+} // namespace
+
+#endif // include guard
@@ -0,0 +1,181 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+#ifndef KALMAN_FIXED_H
+#define KALMAN_FIXED_H
+
+/**
+ * \file KalmanFixed.h
+ *
+ * \brief This file implements a fixed-size Kalman filter on Eigen.
+ */
+
+#include "Alvar.h"
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+
+namespace alvar {
+
+/**
+ * \brief Fixed-size counterpart of \e KalmanSensor
+ *
+ * The state dimension \e N and measurement dimension \e M are compile time
+ * constants, so all the matrices live inside the object and no step of the
+ * filter allocates. The gain is solved with an LDLT factorization of the
+ * innovation covariance instead of inverting it.
+ *
+ * Override \e update_H for a measurement model that depends on the state.
+ */
+template<int N, int M>
+class KalmanSensorFixed {
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+	typedef Eigen::Matrix<double, N, 1> StateVector;
+	typedef Eigen::Matrix<double, N, N> StateMatrix;
+	typedef Eigen::Matrix<double, M, 1> MeasurementVector;
+	typedef Eigen::Matrix<double, M, M> MeasurementMatrix;
+	typedef Eigen::Matrix<double, M, N> MeasurementModel;
+	typedef Eigen::Matrix<double, N, M> GainMatrix;
+
+	/** \brief Latest measurement */
+	MeasurementVector z;
+	/** \brief The matrix (m*n) mapping Kalman state vector into this sensor's measurements vector */
+	MeasurementModel H;
+	/** \brief The matrix (n*m) containing Kalman gain (something between 0 and H^-1). */
+	GainMatrix K;
+	/** \brief The covariance matrix for the observation noise */
+	MeasurementMatrix R;
+
+	KalmanSensorFixed() {
+		z.setZero();
+		H.setZero();
+		K.setZero();
+		R.setZero();
+	}
+	virtual ~KalmanSensorFixed() {}
+	int get_n() { return N; }
+	int get_m() { return M; }
+	/** \brief Method for updating how the Kalman state vector is mapped into this sensor's measurements vector. */
+	virtual void update_H(const StateVector &x_pred) {}
+	/** \brief Method for updating the Kalman gain. */
+	virtual void update_K(const StateMatrix &P_pred) {
+		// K = P * trans(H) * inv(H*P*trans(H) + R)
+		// S and P are symmetric, so K is the transpose of S \ (H*P)
+		Eigen::Matrix<double, M, N> HP = H * P_pred;
+		MeasurementMatrix S = HP * H.transpose() + R;
+		K = S.ldlt().solve(HP).transpose();
+	}
+	/** \brief Method for updating the state estimate x */
+	virtual void update_x(const StateVector &x_pred, StateVector &x) {
+		// x = x_pred + K * (z - H*x_pred)
+		x = x_pred + K * (z - H * x_pred);
+	}
+	/** \brief Method for updating the error covariance matrix P */
+	virtual void update_P(const StateMatrix &P_pred, StateMatrix &P) {
+		//P = (I - K*H) * P_pred
+		P = P_pred - K * (H * P_pred);
+	}
+};
+
+/**
+ * \brief Fixed-size counterpart of \e Kalman
+ *
+ * Keeps the predict/update interface of \e Kalman (ticks in milliseconds,
+ * \e update_F hook for a time dependent transition) with the state held in
+ * fixed-size Eigen matrices. Hundreds of these can be stepped per frame
+ * without touching the heap.
+ *
+ * \code
+ *   KalmanFixed<4> kalman; // x, y, dx, dy
+ *   KalmanSensorFixed<4,2> sensor;
+ *   sensor.H(0,0) = 1; sensor.H(1,1) = 1;
+ *   ...
+ *   sensor.z << x, y;
+ *   kalman.predict_update(sensor, tick);
+ * \endcode
+ */
+template<int N>
+class KalmanFixed {
+protected:
+	unsigned long prev_tick;
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+	typedef Eigen::Matrix<double, N, 1> StateVector;
+	typedef Eigen::Matrix<double, N, N> StateMatrix;
+
+	/** \brief The Kalman state vector (n*1) */
+	StateVector x;
+	/** \brief The matrix (n*n) containing the transition model for the internal state. */
+	StateMatrix F;
+	/** \brief The error covariance matrix describing the accuracy of the state estimate */
+	StateMatrix P;
+	/** \brief The covariance matrix for the process noise */
+	StateMatrix Q;
+	/** \brief Predicted state */
+	StateVector x_pred;
+	/** \brief The predicted error covariance matrix */
+	StateMatrix P_pred;
+
+	KalmanFixed() {
+		prev_tick = 0;
+		x.setZero();
+		F.setIdentity();
+		P.setZero();
+		Q.setZero();
+		x_pred.setZero();
+		P_pred.setZero();
+	}
+	virtual ~KalmanFixed() {}
+	int get_n() { return N; }
+	/** \brief Method for updating the state transition matrix F. This is typically the only method you need to override. */
+	virtual void update_F(unsigned long tick) {}
+	/** \brief Predict the Kalman state vector for the given time step */
+	const StateVector &predict(unsigned long tick) {
+		update_F(tick);
+		// x_pred = F * x;
+		x_pred.noalias() = F * x;
+		// P_pred = F*P*trans(F) + Q
+		P_pred = F * P * F.transpose() + Q;
+		return x_pred;
+	}
+	/** \brief Predict the Kalman state vector for the given time step and update the state using the Kalman gain. */
+	template<int M>
+	const StateVector &predict_update(KalmanSensorFixed<N, M> &sensor, unsigned long tick) {
+		predict(tick);
+		sensor.update_H(x_pred);
+		sensor.update_K(P_pred);
+		sensor.update_x(x_pred, x);
+		sensor.update_P(P_pred, P);
+		prev_tick = tick;
+		return x;
+	}
+	/** \brief Helper method. */
+	double seconds_since_update(unsigned long tick) {
+		unsigned long tick_diff = (prev_tick ? tick-prev_tick : 0);
+		return ((double)tick_diff/1000.0);
+	}
+};
+
+} // namespace alvar
+
+#endif
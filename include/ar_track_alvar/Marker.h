@@ -36,6 +36,7 @@
 #include <algorithm>
 #include "Util.h"
 #include "Camera.h"
+#include "FrameArena.h"
 #include "Pose.h"
 #include "Bitset.h"
 #include <vector>
@@ -44,6 +45,59 @@
 
 namespace alvar {
 
+  /**
+   * \brief Marker geometry in marker coordinates.
+   *
+   * The sample points only depend on the edge length, resolution and margin,
+   * so each combination is built once by \e Get and then shared read-only by
+   * all markers of that size. Layouts are never freed.
+   */
+  struct ALVAR_EXPORT MarkerLayout
+  {
+    double edge_length;
+    int res;
+    double margin;
+    /** \brief Marker corners in marker coordinates */
+    std::vector<PointDouble> corners;
+    /** \brief Marker color points in marker coordinates */
+    std::vector<PointDouble> points;
+    /** \brief Samples to be used in figuring out min/max for thresholding */
+    std::vector<PointDouble> margin_w;
+    /** \brief Samples to be used in figuring out min/max for thresholding */
+    std::vector<PointDouble> margin_b;
+
+    /** \brief Returns the shared layout for the given (already defaulted) marker size */
+    static const MarkerLayout *Get(double _edge_length, int _res, double _margin);
+
+  private:
+    MarkerLayout(double _edge_length, int _res, double _margin);
+  };
+
+  /**
+   * \brief Compact result of a detected marker.
+   *
+   * \e MarkerDetector fills one of these for every marker it reports. It is
+   * plain data and much cheaper to copy and keep around than the \e Marker
+   * used during detection.
+   */
+  struct ALVAR_EXPORT MarkerDetection
+  {
+    unsigned long id;
+    /** \brief Image corners in the order given by the marker orientation */
+    CvPoint2D64f corners[4];
+    /** \brief Orientation quaternion (w, x, y, z) as in \e Pose */
+    double quaternion[4];
+    /** \brief Translation in the units of the marker edge length */
+    double translation[3];
+    double edge_length;
+    int res;
+    double margin_error;
+    double decode_error;
+    double track_error;
+    /** \brief True if the marker was found by tracking instead of decoding */
+    bool tracked;
+  };
+
   /**
    * \brief Basic 2D \e Marker functionality.
    *
@@ -55,7 +109,7 @@ namespace alvar {
     void VisualizeMarkerPose(IplImage *image, Camera *cam, double visualize2d_points[12][2], CvScalar color=CV_RGB(255,0,0)) const;
     virtual void VisualizeMarkerContent(IplImage *image, Camera *cam, double datatext_point[2], double content_point[2]) const;
     virtual void VisualizeMarkerError(IplImage *image, Camera *cam, double errortext_point[2]) const;
-    bool UpdateContentBasic(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no = 0);
+    bool UpdateContentBasic(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no = 0, FrameArena *arena = NULL);
 
   public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW  
@@ -72,11 +126,12 @@ namespace alvar {
      */
     void CompareContent(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam, int *orientation) const;
     /** \brief Updates the \e marker_content from the image using \e Homography
+     *  The temporaries are taken from \e arena when one is given.
      */
-    virtual bool UpdateContent(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no = 0);
+    virtual bool UpdateContent(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no = 0, FrameArena *arena = NULL);
     /** \brief Updates the markers \e pose estimation
      */
-    void UpdatePose(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, Camera *cam, int orientation, int frame_no = 0, bool update_pose = true);
+    void UpdatePose(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, Camera *cam, int orientation, int frame_no = 0, bool update_pose = true, FrameArena *arena = NULL);
     /** \brief Decodes the marker content. Please call \e UpdateContent before this. 
      *  This virtual method is meant to be implemented by heirs.
      */
@@ -100,6 +155,18 @@ namespace alvar {
     void SetMarkerSize(double _edge_length = 0, int _res = 0, double _margin = 0);
     /** \brief Get edge length (to support different size markers */
     double GetMarkerEdgeLength() const { return edge_length; }
+    /** \brief The shared geometry for the current marker size */
+    const MarkerLayout *GetLayout() const { return layout; }
+    /** \brief Marker corners in marker coordinates, formerly the \e marker_corners member */
+    const std::vector<PointDouble> &GetMarkerCorners() const { return layout->corners; }
+    /** \brief Marker color points in marker coordinates, formerly the \e marker_points member */
+    const std::vector<PointDouble> &GetMarkerPoints() const { return layout->points; }
+    /** \brief White margin samples in marker coordinates, formerly the \e marker_margin_w member */
+    const std::vector<PointDouble> &GetMarkerMarginWhite() const { return layout->margin_w; }
+    /** \brief Black margin samples in marker coordinates, formerly the \e marker_margin_b member */
+    const std::vector<PointDouble> &GetMarkerMarginBlack() const { return layout->margin_b; }
+    /** \brief Fills the compact detection result from the current state */
+    void GetDetection(MarkerDetection *detection, bool tracked = false) const;
     /** \brief Destructor  */
     ~Marker();
     /** \brief Default constructor 
@@ -110,6 +177,8 @@ namespace alvar {
     Marker(double _edge_length = 0, int _res = 0, double _margin = 0);
     /** \brief Copy constructor  */
     Marker(const Marker& m);
+    /** \brief Assignment operator  */
+    Marker &operator=(const Marker& m);
     /** \brief Get id for this marker
      * This is used e.g. in MarkerDetector to associate a marker id with
      * an appropriate edge length. This method should be overwritten
@@ -165,24 +234,29 @@ namespace alvar {
     double edge_length;
     int res;
     double margin;
+    const MarkerLayout *layout;
+    /** \brief Points either to \e marker_content_inline or to a matrix of its own for large markers */
     CvMat *marker_content;
+    CvMat marker_content_inline;
+    static const int MARKER_CONTENT_INLINE_SIZE = 16*16;
+    unsigned char marker_content_data[MARKER_CONTENT_INLINE_SIZE];
+
+    void CopyFrom(const Marker& m);
 
   public:
       
-    /** \brief Marker color points in marker coordinates */
-    std::vector<PointDouble> marker_points;
-    /** \brief Marker corners in marker coordinates */
-    std::vector<PointDouble> marker_corners;
     /** \brief Marker corners in image coordinates */
     std::vector<PointDouble> marker_corners_img;
-    /** \brief Marker points in image coordinates */
+    /** \brief Marker points in image coordinates
+     *
+     * Filled when the content is read. For tracked markers that is every frame
+     * only with \e MarkerDetector::SetTrackVerification interval 1 (the default).
+     */
     std::vector<PointDouble> ros_marker_points_img;
     ar_track_alvar::ARCloud ros_corners_3D;
     int ros_orientation;
-    /** \brief Samples to be used in figuring out min/max for thresholding */
-    std::vector<PointDouble> marker_margin_w;
-    /** \brief Samples to be used in figuring out min/max for thresholding */
-    std::vector<PointDouble> marker_margin_b;
+    /** \brief Number of tracked frames since the content was last read from the image */
+    int content_age;
 #ifdef VISUALIZE_MARKER_POINTS
     std::vector<PointDouble> marker_allpoints_img;
 #endif
@@ -223,11 +297,15 @@ namespace alvar {
   protected:
     virtual void VisualizeMarkerContent(IplImage *image, Camera *cam, double datatext_point[2], double content_point[2]) const;
     void DecodeOrientation(int *error, int *total, int *orientation);
-    int DecodeCode(int orientation, BitsetExt *bs, int *erroneous, int *total, unsigned char* content_type);
-    void Read6bitStr(BitsetExt *bs, char *s, size_t s_max_len);
+    int DecodeCode(int orientation, BitsetBuffer *bs, int *erroneous, int *total, unsigned char* content_type);
+    /** \brief Removes the header and Hamming coding from the code bits read by \e DecodeCode */
+    int DecodeHamming(BitsetBuffer *bs, int *erroneous, unsigned char* content_type);
+    /** \brief Fills \e data and \e decode_error from the decoded bits (\e err is the result of \e DecodeHamming) */
+    bool SetDecodedData(BitsetBuffer *bs, int err, int erroneous, int total);
+    void Read6bitStr(BitsetBuffer *bs, char *s, size_t s_max_len);
     void Add6bitStr(BitsetExt *bs, char *s);
     int UsableDataBits(int marker_res, int hamming);
-    bool DetectResolution(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam);
+    bool DetectResolution(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam, FrameArena *arena = NULL);
 
   public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW  
@@ -263,7 +341,7 @@ namespace alvar {
      * Compared to the basic implementation in \e Marker this will also detect the marker 
      * resolution automatically when the marker resolution is specified to be 0.
      */
-    virtual bool UpdateContent(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no = 0);
+    virtual bool UpdateContent(std::vector<Point<CvPoint2D64f> > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no = 0, FrameArena *arena = NULL);
     /** \brief \e DecodeContent should be called after \e UpdateContent to fill \e content_type, \e decode_error and \e data 
      */
     bool DecodeContent(int *orientation);
@@ -272,6 +350,115 @@ namespace alvar {
     void SetContent(MarkerContentType content_type, unsigned long id, const char *str, bool force_strong_hamming=false, bool verbose=false);
   };
 
+  /**
+   * \brief \e MarkerData with the content resolution fixed at compile time.
+   *
+   * The orientation and code cells are read straight from \e marker_content
+   * with the resolution and the orientation known at compile time, so the
+   * sampling loops have constant bounds and no per-cell orientation branches.
+   * Use it as the marker type of \e MarkerDetector when all the markers have
+   * the same resolution, e.g. \e MarkerDetector<MarkerDataRes<5> > together
+   * with \e SetMarkerSize(edge_length, 5). Markers that end up with another
+   * resolution are decoded by the generic \e MarkerData code.
+   * \param RES The marker content resolution (odd and at least 5, e.g. 5, 7, 9 or 11)
+   */
+  template<int RES>
+  class MarkerDataRes : public MarkerData
+  {
+    typedef char res_must_be_odd_and_at_least_5[((RES >= 5) && (RES % 2 == 1)) ? 1 : -1];
+
+  protected:
+    /** \brief Number of content cells carrying the code (all but the orientation cross) */
+    static const int CODE_CELLS = RES*RES - RES - 4;
+
+    /** \brief Content cell (\e j, \e i) of the marker read in orientation \e O */
+    template<int O>
+    static int Cell(const CvMat *content, int j, int i) {
+      int row = j, col = i;
+      if (O == 1) { row = RES-i-1; col = j; }
+      else if (O == 2) { row = RES-j-1; col = RES-i-1; }
+      else if (O == 3) { row = i; col = RES-j-1; }
+      return content->data.ptr[row*content->step + col];
+    }
+
+    void DecodeOrientationFixed(int *error, int *total, int *orientation) const {
+      const int h = RES/2;
+      int errors[4] = {0};
+      int color = 255;
+
+      // Resolution identification
+      for (int i=0; i<RES; i++) {
+        if (Cell<0>(marker_content, h, i) != color) errors[0]++;
+        if (Cell<0>(marker_content, i, h) != color) errors[1]++;
+        color ^= 255;
+      }
+      errors[2] = errors[0];
+      errors[3] = errors[1];
+      (*total) += RES;
+
+      // Orientation identification
+      for (int j=h-2; j<=h+2; j++) {
+        if (j == h) continue;
+        int expected = (j < h ? 0 : 255);
+        int vertical = Cell<0>(marker_content, j, h);
+        int horizontal = Cell<0>(marker_content, h, j);
+        if (vertical   != expected)     errors[0]++;
+        if (horizontal != expected)     errors[1]++;
+        if (vertical   != 255-expected) errors[2]++;
+        if (horizontal != 255-expected) errors[3]++;
+      }
+      (*total) += 4;
+
+      *orientation = int(std::min_element(errors, errors+4) - errors);
+      *error = errors[*orientation];
+    }
+
+    /** \brief Pushes the code bits in the same order as \e MarkerData::DecodeCode */
+    template<int O>
+    void ReadCodeBits(BitsetBuffer *bs) const {
+      const int h = RES/2;
+      for (int j=0; j<RES; j++) {
+        for (int i=0; i<RES; i++) {
+          if ((O == 0) || (O == 2)) {
+            if (j == h) continue;
+            if ((i == h) && (j >= h-2) && (j <= h+2)) continue;
+          } else {
+            if (i == h) continue;
+            if ((j == h) && (i >= h-2) && (i <= h+2)) continue;
+          }
+          bs->push_back(Cell<O>(marker_content, j, i) == 0);
+        }
+      }
+    }
+
+  public:
+    MarkerDataRes(double _edge_length = 0, int _res = 0, double _margin = 0) :
+      MarkerData(_edge_length, RES, _margin)
+      {
+      }
+
+    bool DecodeContent(int *orientation) {
+      if (res != RES) return MarkerData::DecodeContent(orientation);
+      *orientation = 0;
+
+      bool code_bits[CODE_CELLS];
+      BitsetBuffer bs(code_bits, CODE_CELLS);
+      int erroneous=0;
+      int total=0;
+
+      DecodeOrientationFixed(&erroneous, &total, orientation);
+      switch (*orientation) {
+        case 0: ReadCodeBits<0>(&bs); break;
+        case 1: ReadCodeBits<1>(&bs); break;
+        case 2: ReadCodeBits<2>(&bs); break;
+        default: ReadCodeBits<3>(&bs); break;
+      }
+      total += CODE_CELLS;
+      int err = DecodeHamming(&bs, &erroneous, &content_type);
+      return SetDecodedData(&bs, err, erroneous, total);
+    }
+  };
+
   /** \brief Iterator type for traversing templated Marker vector without the template.
    */
   class ALVAR_EXPORT MarkerIterator : public std::iterator<std::forward_iterator_tag, Marker*> {
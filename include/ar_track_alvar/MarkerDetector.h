@@ -36,6 +36,9 @@
 #include "Draw.h"
 #include "Camera.h"
 #include "Marker.h"
+#include "FrameArena.h"
+#include "Timer.h"
+#include "Tracker.h"
 #include "Rotation.h"
 #include "Line.h"
 #include <algorithm>
@@ -56,6 +59,7 @@ protected:
 	virtual Marker* new_M(double _edge_length = 0, int _res = 0, double _margin = 0) = 0;
 	virtual void _markers_clear() = 0;
 	virtual void _markers_push_back(Marker *mn) = 0;
+	virtual void _markers_trim() = 0;
 	virtual size_t _markers_size() = 0;
 	virtual void _track_markers_clear() = 0;
 	virtual void _track_markers_push_back(Marker *mn) = 0;
@@ -65,11 +69,77 @@ protected:
 
 	Labeling* labeling;
 
+	/** \brief Temporaries of one \e Detect call; reset at the start of every frame */
+	FrameArena arena;
+	/** \brief Shared images of the frame, or NULL */
+	FrameImageCache *image_cache;
+	/** \brief Predicts the motion of the tracked markers between frames, or NULL */
+	Tracker *motion_prior;
+	/** \brief Marker reused for testing every new blob instead of allocating one per blob */
+	Marker* candidate;
+	double candidate_edge_length;
+	int candidate_res;
+	double candidate_margin;
+	/** \brief A candidate for one \e SetMarkerSize setting, with the size it got from \e new_M */
+	struct CandidateSlot {
+		double edge_length;
+		int res;
+		double margin;
+		Marker *marker;
+		double marker_edge_length;
+		int marker_res;
+		double marker_margin;
+	};
+	/** \brief Candidates of the marker sizes used so far, so that switching
+	 * sizes with \e SetMarkerSize on every frame does not allocate
+	 */
+	std::vector<CandidateSlot> candidate_slots;
+	/** \brief Returns \e candidate restored to the default marker size and with cleared errors */
+	Marker* ResetCandidate();
+
+	/** \brief Compact results of the latest \e Detect and \e DetectAdditional calls */
+	std::vector<MarkerDetection> detections;
+	/** \brief Adds the marker to the marker table and to \e detections */
+	void PushMarker(Marker *mn, bool tracked);
+
 	std::map<unsigned long, double> map_edge_length;
+	/** \brief Resolutions detected for the marker ids when the resolution is detected automatically (\e res is 0) */
+	std::map<unsigned long, int> map_res;
+	/** \brief The distinct values of \e map_res, the most recently decoded first */
+	std::vector<int> known_res;
+	/** \brief How many of \e known_res are tried for one candidate */
+	static const size_t MAX_KNOWN_RES_TRIED = 2;
+	/** \brief Tries to decode the candidate with the resolutions already seen, before running the resolution detection.
+	 * Succeeds only when the decoded id has been seen with that same resolution.
+	 * Only the \e MAX_KNOWN_RES_TRIED most recent resolutions are tried, so a
+	 * blob that is not a marker costs at most that many full decodes on top of
+	 * the resolution detection.
+	 */
+	bool DecodeKnownResolution(Marker *mn, std::vector<PointDouble> &corners, IplImage *gray, Camera *cam, double max_error, int *orientation);
+	/** \brief Remembers the resolution of a marker decoded with automatic resolution detection */
+	void RememberResolution(Marker *mn);
 	double edge_length;
 	int res;
 	double margin;
 	bool detect_pose_grayscale;
+	int verify_interval;
+	double verify_track_error;
+	bool cascade_enabled;
+	int cascade_min_contrast;
+	double cascade_max_side_ratio;
+
+	/** \brief Time allowed for one \e Detect call in seconds, 0 for no limit */
+	double time_budget;
+	/** \brief Started at the beginning of every \e Detect call */
+	Timer budget_timer;
+	/** \brief Corners of the candidates left unprocessed by the latest \e Detect */
+	std::vector<std::vector<PointDouble> > skipped_candidates;
+	/** \brief Number of \e skipped_candidates filled by the current \e Detect; the entries after it are reused */
+	size_t skipped_count;
+	/** \brief Adds the corners to \e skipped_candidates */
+	void SkipCandidate(const std::vector<PointDouble> &corners);
+	/** \brief True when \e time_budget is set and has been used up */
+	bool BudgetExceeded();
 
 	MarkerDetectorImpl();
 	virtual ~MarkerDetectorImpl();
@@ -106,6 +176,61 @@ public:
 	*/
 	void SetOptions(bool _detect_pose_grayscale=false);
 
+	/** Set how often the content of tracked markers is read and decoded again.
+	* A tracked marker is identified by matching its corners with the previous frame, so
+	* reading its content every frame is not needed. The content is read and the id
+	* verified every \e _verify_interval frames, or earlier when the corners moved more than
+	* \e _verify_track_error (relative to the marker size, see \e Marker::CompareCorners).
+	* A marker whose id no longer matches is dropped from tracking and detected again as new.
+	* Between the reads \e Marker::ros_marker_points_img and the decoded content of a tracked
+	* marker are those of its last read, so users of the marker points (e.g. the point cloud
+	* pose of the Kinect nodes) should keep the default interval of 1.
+	* \param _verify_interval Frames between content reads, 1 reads every frame
+	* \param _verify_track_error Track error above which the content is always read
+	*/
+	void SetTrackVerification(int _verify_interval=1, double _verify_track_error=0.05);
+
+	/** Set the cache that provides the gray image of the frame.
+	* When the cache holds the image given to \e Detect, its gray image is thresholded
+	* instead of converting the image again. Call \e FrameImageCache::SetImage for every frame.
+	*/
+	void SetImageCache(FrameImageCache *_image_cache) { image_cache = _image_cache; }
+
+	/** Set a tracker that predicts how the image moved since the previous frame.
+	* When tracking, \e Detect calls \e Tracker::Track with the gray image of every frame
+	* and moves the previous corners of the tracked markers with \e Tracker::Compensate
+	* before matching them to the candidates. This keeps the markers tracked under fast
+	* camera motion; e.g. \e TrackerStat is a cheap choice.
+	* \param _motion_prior The tracker, or NULL to match against the previous corners as such
+	*/
+	void SetMotionPrior(Tracker *_motion_prior) { motion_prior = _motion_prior; }
+
+	/** Set the cheap checks that the square candidates must pass before their edges are fitted and content decoded.
+	* See \e Labeling::SetCascadeParams. The counters of the latest frame are returned by \e GetCascadeStats.
+	* \param _enabled When false every convex quad is fitted and decoded. Off by default, since the
+	* checks can change which markers are found; \e benchmark_detection compares both settings.
+	* \param _min_contrast Minimum gray level difference between the outside and the inside of the marker border
+	* \param _max_side_ratio Maximum ratio between the longest and the shortest side of a candidate
+	*/
+	void SetCandidateCascade(bool _enabled=false, int _min_contrast=10, double _max_side_ratio=8.0);
+
+	/** Set the time that one \e Detect call may spend.
+	* The budget is checked between candidates, so the labeling of the image is always
+	* completed. The tracked markers are handled first and the new candidates next, the
+	* largest first. The candidates that are left when the budget runs out are not read;
+	* their corners are returned by \e GetSkippedCandidates.
+	* \param _time_budget Time budget in seconds, 0 for no limit
+	*/
+	void SetTimeBudget(double _time_budget=0);
+
+	/** \brief Corners of the candidates that the latest \e Detect skipped because of the time budget */
+	const std::vector<std::vector<PointDouble> >& GetSkippedCandidates() const { return skipped_candidates; }
+
+	/** \brief Candidate rejection counters of the latest \e Detect */
+	Labeling::CascadeStats GetCascadeStats() const {
+		return labeling ? labeling->cascade_stats : Labeling::CascadeStats();
+	}
+
 	/**
 	 * \brief \e Detect \e Marker 's from \e image 
 	 *
@@ -129,6 +254,14 @@ public:
 			   bool update_pose=true);
 
 	int DetectAdditional(IplImage *image, Camera *cam, bool visualize=false, double max_track_error=0.2);
+
+	/** \brief Compact results of the markers found by the latest \e Detect (and \e DetectAdditional)
+	 *
+	 * There is one entry per marker in the marker table, in the same order.
+	 * Prefer these over copying the full markers when only the id, corners
+	 * and pose are needed.
+	 */
+	const std::vector<MarkerDetection>& GetDetections() const { return detections; }
 };
 
 /**
@@ -143,8 +276,21 @@ protected:
     return new M(_edge_length, _res, _margin);
   }
 
-  void _markers_clear() { markers->clear(); }
-  void _markers_push_back(Marker *mn) { markers->push_back(*((M*)mn)); }
+  /** \brief Number of \e markers filled by the current \e Detect; the entries after it are reused */
+  size_t markers_used;
+
+  // The marker table keeps its entries between frames and they are assigned
+  // to, so that the vectors inside the markers keep their memory
+  void _markers_clear() { markers_used = 0; }
+  void _markers_push_back(Marker *mn) {
+    if (markers_used < markers->size()) (*markers)[markers_used] = *((M*)mn);
+    else markers->push_back(*((M*)mn));
+    markers_used++;
+  }
+  void _markers_trim() {
+    if (markers_used < markers->size()) markers->erase(markers->begin() + markers_used, markers->end());
+    markers_used = markers->size();
+  }
   size_t _markers_size() { return markers->size(); }
   void _track_markers_clear() { track_markers->clear(); }
   void _track_markers_push_back(Marker *mn) { track_markers->push_back(*((M*)mn)); }
@@ -164,6 +310,7 @@ public:
 
 	/** Constructor */
   MarkerDetector() : MarkerDetectorImpl() {
+    markers_used = 0;
     markers = new std::vector<M, Eigen::aligned_allocator<M> >;
     track_markers = new std::vector<M, Eigen::aligned_allocator<M> >;
 	}
@@ -31,6 +31,7 @@
  */
 
 #include "EC.h"
+#include "FrameImageCache.h"
 
 namespace alvar {
 
@@ -67,15 +68,18 @@ public:
 			estimation_type = c.estimation_type;
 		}
 	};
+	/** \brief Features by id, stored contiguously in id order */
+	typedef ECMap<Feature> FeatureMap;
 	/** \brief The map of all tracked features */
-	std::map<int, Feature> container;
-	std::map<int, Feature> container_triangulated;
+	FeatureMap container;
+	FeatureMap container_triangulated;
 
 protected:
-	std::map<int, Feature> container_reset_point;
-	std::map<int, Feature> container_triangulated_reset_point;
+	FeatureMap container_reset_point;
+	FeatureMap container_triangulated_reset_point;
 
 	CameraEC cam;
+	FrameImageCache image_cache;
 	MarkerDetectorEC<MarkerData> marker_detector; 
 	TrackerFeaturesEC tf;
 	Pose pose;
@@ -87,10 +91,21 @@ protected:
 	double scale;
 	Pose pose_original;
 	Pose pose_difference;
+	int thread_count;
+	/** \brief Squared reprojection errors by container position, -1 for features left out of the average */
+	std::vector<float> reproj_dist_sq;
+
+	/** \brief Number of threads for the per-feature passes */
+	int ParallelThreads() const;
+	/** \brief \e CameraEC::Reproject for \e container , with the features projected in parallel */
+	float Reproject(Pose *pose, int type_id, bool needs_has_p2d, float average_outlier_limit);
 
 public:
 	/** \brief Constructor */
-	SimpleSfM() : tf(200, 200, 0.01, 20, 4, 6), pose_ok(false), update_tri(false), markers_found(false) {}
+	SimpleSfM() : tf(200, 200, 0.01, 20, 4, 6), pose_ok(false), update_tri(false), markers_found(false), thread_count(1) {
+		marker_detector.SetImageCache(&image_cache);
+		tf.SetImageCache(&image_cache);
+	}
 	/** \brief Reset the situation back to the point it was when \e SetResetPoint was called */
 	void Reset(bool reset_also_triangulated = true);
 	/** \brief Remember the current state and return here when the \e Reset is called */
@@ -99,6 +114,11 @@ public:
 	void Clear();
 	/** \brief Set the suitable scale to be used. This affects quite much how the tracking behaves (when features are triangulated etc.) */
 	void SetScale(double s) { scale = s; }
+	/** \brief Set the number of threads projecting, placing and triangulating the features in \e Update .
+	 *  Use 0 for one thread per core. The results do not depend on the thread count.
+	 *  Without OpenMP support the features are always handled in one thread.
+	 */
+	void SetThreadCount(int n) { thread_count = n; }
 	/** \brief Get the camera used internally. You need to use this to set correct camera calibration (see \e SamplePointcloud) */
 	CameraEC *GetCamera();
 	/** \brief Get the estimated pose */
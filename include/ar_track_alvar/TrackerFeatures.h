@@ -31,6 +31,8 @@
  */
 
 #include "Tracker.h"
+#include "FrameImageCache.h"
+#include <vector>
 
 namespace alvar {
 
@@ -56,6 +58,17 @@ protected:
 	int next_id;
 	int win_size;
 	int pyr_levels;
+	/** \brief \e pyramid holds the optical flow pyramid of \e gray */
+	bool pyramid_ready;
+	FrameImageCache *image_cache;
+	/** \brief Index from feature id to its position in \e features, updated where the features move.
+	 * Entries of ids that are no longer tracked are left behind and fail the check against \e ids.
+	 */
+	std::vector<int> id_slot;
+	/** \brief Records that feature \e id is at \e slot in \e features */
+	void SetIdSlot(int id, int slot);
+	/** \brief Spatial grid used by \e Purge */
+	std::vector<int> grid_head, grid_next;
 
 	/** \brief Reset track features on specified mask area */
 	double TrackHid(IplImage *img, IplImage *mask=NULL, bool add_features=true);
@@ -94,6 +107,10 @@ public:
 	bool DelFeature(int index);
 	/** \brief Stop tracking the identified feature (with feature id) */
 	bool DelFeatureId(int id);
+	/** \brief Index of the feature with the given id in \e features, or -1 if it is not tracked */
+	int FeatureIndex(int id);
+	/** \brief Sets the cache whose gray image is used when it holds the tracked image */
+	void SetImageCache(FrameImageCache *_image_cache) { image_cache = _image_cache; }
 	/** \brief Track features */
 	double Track(IplImage *img) { return Track(img, true); }
 	/** \brief Track features */
@@ -28,6 +28,8 @@
 #include "TrackerFeatures.h"
 #include "Pose.h"
 #include "Camera.h"
+#include <map>
+#include <vector>
 
 /**
  * \file TrackerOrientation.h
@@ -51,7 +53,6 @@ public:
 	{
 		_camera		  = 0;
 		_grsc		  = 0;
-		_object_model = 0;
 	}
 
 private:
@@ -92,7 +93,12 @@ private:
 	Pose				  _pose;
 	IplImage			 *_grsc;
 	Camera				 *_camera;
-	CvMat				 *_object_model;
+
+	// Buffers of UpdatePose, kept between frames
+	std::vector<double>	  _object_points;	// [x y z x y z ...]
+	std::vector<double>	  _observations;	// [u v u v ...]
+	std::vector<double>	  _projections;		// [u v u v ...]
+	std::vector<double>	  _jacobian;		// 2*count x 3, d(projection)/d(rodriques)
 
 public:
 	void SetCamera(Camera *camera) {
@@ -106,7 +112,10 @@ public:
 	double Track(IplImage *image);
 
 private:
-	static void Project(CvMat* state, CvMat* projection, void *param);
+	/** \brief Projects the first \e count object points with rotation \e rot (and no translation), optionally with the Jacobian */
+	void ProjectRotation(const double rot[3], int count, double *projections, double *jacobian=0);
+	/** \brief Robust Levenberg-Marquardt for the rotation, with Tukey weights and 3x3 normal equations */
+	double OptimizeRotation(double rot[3], int count, double stop, int max_iter);
 	bool UpdatePose(IplImage* image=0);
 	bool UpdateRotationOnly(IplImage *gray, IplImage *image=0);
 
@@ -69,6 +69,10 @@ class ALVAR_EXPORT TrackerPsaRot : public TrackerPsa {
 protected:
 	double *rot, *rotprev;
 	int *rot_count;
+	unsigned short *theta;
+	int theta_x_res, theta_y_res;
+	/** \brief Mean gray level per degree around the image center moved by (\e dx, \e dy) */
+	void AngleProfile(IplImage *img, int dx, int dy, double *profile);
 
 public:
 	/** \brief \e Track result rotation in degrees */
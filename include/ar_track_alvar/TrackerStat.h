@@ -27,6 +27,8 @@
 #include "Tracker.h"
 #include "TrackerFeatures.h"
 #include "Util.h"
+#include <vector>
+#include <utility>
 
 /**
  * \file TrackerStat.h
@@ -43,13 +45,26 @@ class ALVAR_EXPORT TrackerStat : public Tracker {
 protected:
 	TrackerFeatures f;
 	HistogramSubpixel hist;
+	/** \brief Index pairs (previous, current) of the features tracked into the latest frame */
+	std::vector<std::pair<int, int> > matches;
+	/** \brief Tracks the features and pairs them by id in time linear in the feature count */
+	void TrackMatches(IplImage *img);
+	/** \brief Votes the displacements of \e matches into \e hist and sets \e xd and \e yd */
+	double VoteTranslation();
 public:
 	/** \brief \e Track result x-translation in pixels */
 	double xd;
 	/** \brief \e Track result y-translation in pixels */
 	double yd;
-	/** \brief Constructor */
-	TrackerStat(int binsize=8);
+	/**
+	 * \brief Constructor
+	 * \param binsize Histogram bin size for the translation in pixels
+	 * \param max_features Maximum number of features tracked
+	 * \param min_features New features are searched when there are less than this
+	 */
+	TrackerStat(int binsize=8, int max_features=100, int min_features=90);
+	/** \brief Change the number of features tracked, see \e TrackerFeatures::ChangeSettings */
+	void SetFeatureBudget(int max_features=100, int min_features=90);
 	/** \brief Reset */
 	void Reset();
 	/**
@@ -68,8 +83,8 @@ class ALVAR_EXPORT TrackerStatRot : public TrackerStat {
 public:
 	/** \brief \e Track result rotation in degrees */
 	double rotd;
-	/** \brief Constructor */
-	TrackerStatRot(int binsize=8, int binsize_rot=3);
+	/** \brief Constructor, see \e TrackerStat::TrackerStat */
+	TrackerStatRot(int binsize=8, int binsize_rot=3, int max_features=100, int min_features=90);
 	/**
 	 * \brief Translation + rotation tracker
 	 */
@@ -0,0 +1,245 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+#ifndef __UNSCENTED_KALMAN_FIXED__
+#define __UNSCENTED_KALMAN_FIXED__
+
+#include "Alvar.h"
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+#include <Eigen/Eigenvalues>
+
+/**
+ * \file UnscentedKalmanFixed.h
+ *
+ * \brief This file implements a fixed-size unscented Kalman filter on Eigen.
+ */
+
+namespace alvar {
+
+  /**
+   * \brief Process model for \e UnscentedKalmanFixed.
+   */
+  template<int N>
+  class UnscentedProcessFixed {
+  public:
+    typedef Eigen::Matrix<double, N, 1> StateVector;
+    typedef Eigen::Matrix<double, N, N> StateMatrix;
+
+    virtual ~UnscentedProcessFixed() {}
+
+    /** \brief process model: state+1 = f(state) */
+    virtual void f(StateVector &state) = 0;
+
+    /** \brief Returns the process noise covariance; or NULL for no additional noise. */
+    virtual const StateMatrix *getProcessNoise() = 0;
+  };
+
+  /**
+   * \brief Observation model for \e UnscentedKalmanFixed.
+   */
+  template<int N, int M>
+  class UnscentedObservationFixed {
+  public:
+    typedef Eigen::Matrix<double, N, 1> StateVector;
+    typedef Eigen::Matrix<double, M, 1> ObservationVector;
+    typedef Eigen::Matrix<double, M, M> ObservationMatrix;
+
+    virtual ~UnscentedObservationFixed() {}
+
+    /** \brief observation model: z = h(state) */
+    virtual void h(ObservationVector &z, const StateVector &state) = 0;
+
+    /** \brief Returns the current measurement vector. */
+    virtual const ObservationVector &getObservation() = 0;
+
+    /** \brief Returns the observation noise covariance; or NULL for no additional noise. */
+    virtual const ObservationMatrix *getObservationNoise() = 0;
+  };
+
+  /**
+   * \brief Fixed-size counterpart of \e UnscentedKalman
+   *
+   * Same filter and interface as \e UnscentedKalman, with the state size \e N
+   * and observation size \e M fixed at compile time. All the sigma points and
+   * matrices are members, so stepping the filter does not allocate.
+   *
+   * The sigma points are spread along the columns of the Cholesky factor of
+   * the scaled state covariance instead of its SVD square root; both span the
+   * same covariance. If the covariance has lost positive definiteness the
+   * symmetric eigen-decomposition is used instead, with negative eigenvalues
+   * clamped to zero. The gain is solved with an LDLT factorization of the
+   * predicted observation covariance instead of inverting it.
+   *
+   * Unlike \e UnscentedKalman::update, the observation vector returned by
+   * the model is left untouched.
+   */
+  template<int N, int M>
+  class UnscentedKalmanFixed {
+  public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    typedef Eigen::Matrix<double, N, 1> StateVector;
+    typedef Eigen::Matrix<double, N, N> StateMatrix;
+    typedef Eigen::Matrix<double, M, 1> ObservationVector;
+    typedef Eigen::Matrix<double, M, M> ObservationMatrix;
+    typedef Eigen::Matrix<double, N, M> CrossMatrix;
+
+  private:
+    enum { sigma_n = 2 * N + 1 };
+    bool sigmasUpdated;
+    double lambda, lambda2;
+
+    StateVector state;
+    StateMatrix stateCovariance;
+    StateVector sigma_state[sigma_n];
+    ObservationVector sigma_predObs[sigma_n];
+
+  public:
+    /** \brief Initializes Unscented Kalman filter.
+     *
+     * \param alpha Spread of sigma points.
+     * \param beta Prior knowlegde about the distribution (2 for normal).
+     */
+    UnscentedKalmanFixed(double alpha = 0.001, double beta = 2.0) {
+      double L = N;
+      lambda = alpha*alpha * L - L;
+      lambda2 = 1 - alpha*alpha + beta;
+      state.setZero();
+      stateCovariance.setZero();
+      for (int i = 0; i < sigma_n; i++) {
+        sigma_state[i].setZero();
+        sigma_predObs[i].setZero();
+      }
+      sigmasUpdated = false;
+    }
+
+    /** \brief Accessor for state vector. */
+    StateVector &getState() { return state; }
+
+    /** \brief Accessor for state covariance matrix. */
+    StateMatrix &getStateCovariance() { return stateCovariance; }
+
+    /** \brief (Re-)initialize UKF internal state. */
+    void initialize() {
+      // 1. Square root of the scaled state co-variance: (L + lambda) * P = S * S'
+      double scale = N + lambda;
+      StateMatrix scaled = scale * stateCovariance;
+      Eigen::LLT<StateMatrix> llt(scaled);
+      StateMatrix sqrtStateCovariance;
+      if (llt.info() == Eigen::Success) {
+        sqrtStateCovariance = llt.matrixL();
+      } else {
+        Eigen::SelfAdjointEigenSolver<StateMatrix> eig(scaled);
+        StateVector d = eig.eigenvalues().cwiseMax(0.0).cwiseSqrt();
+        sqrtStateCovariance = eig.eigenvectors() * d.asDiagonal();
+      }
+
+      // 2. Form new sigma points.
+      int sigma_i = 0;
+      sigma_state[sigma_i++] = state;
+      for (int i = 0; i < N; i++) {
+        sigma_state[sigma_i++] = state + sqrtStateCovariance.col(i);
+        sigma_state[sigma_i++] = state - sqrtStateCovariance.col(i);
+      }
+
+      sigmasUpdated = true;
+    }
+
+    /** \brief Updated the state by predicting. */
+    void predict(UnscentedProcessFixed<N> *process_model) {
+      if (!sigmasUpdated) initialize();
+
+      // Map sigma points through the process model and compute new state mean.
+      double L = N;
+      double mean0 = lambda / (L + lambda);
+      double cov0 = mean0 + lambda2;
+      double rest = .5 / (L + lambda);
+      double meanTotal = mean0 + (sigma_n - 1) * rest;
+      double covTotal = cov0 + (sigma_n - 1) * rest;
+
+      state.setZero();
+      for (int i = 0; i < sigma_n; i++) {
+        process_model->f(sigma_state[i]);
+        state += ((i == 0 ? mean0 : rest) / meanTotal) * sigma_state[i];
+      }
+
+      // Compute new state co-variance.
+      stateCovariance.setZero();
+      for (int i = 0; i < sigma_n; i++) {
+        StateVector stateDiff = sigma_state[i] - state;
+        stateCovariance.noalias() += ((i == 0 ? cov0 : rest) / covTotal) *
+          (stateDiff * stateDiff.transpose());
+      }
+
+      // Add any additive noise.
+      const StateMatrix *noise = process_model->getProcessNoise();
+      if (noise) stateCovariance += *noise;
+
+      sigmasUpdated = false;
+    }
+
+    /** \brief Updates the state by an observation. */
+    void update(UnscentedObservationFixed<N, M> *obs) {
+      if (!sigmasUpdated) initialize();
+
+      // Map sigma points through the observation model and compute predicted mean.
+      // As in UnscentedKalman the centre point has no weight (state_k is 0).
+      double scale = .5 / (double)N;
+      ObservationVector predObs = ObservationVector::Zero();
+      for (int i = 0; i < sigma_n; i++) {
+        obs->h(sigma_predObs[i], sigma_state[i]);
+        if (i > 0) predObs += scale * sigma_predObs[i];
+      }
+
+      // Compute predicted observation co-variance.
+      ObservationMatrix predObsCovariance = ObservationMatrix::Zero();
+      CrossMatrix statePredObsCrossCorrelation = CrossMatrix::Zero();
+      for (int i = 1; i < sigma_n; i++) {
+        StateVector stateDiff = sigma_state[i] - state;
+        ObservationVector predObsDiff = sigma_predObs[i] - predObs;
+        predObsCovariance.noalias() += scale * (predObsDiff * predObsDiff.transpose());
+        statePredObsCrossCorrelation.noalias() += scale * (stateDiff * predObsDiff.transpose());
+      }
+
+      // Add any additive noise.
+      const ObservationMatrix *noise = obs->getObservationNoise();
+      if (noise) predObsCovariance += *noise;
+
+      // Update state mean and co-variance.
+      //  innovation: v = z - pz
+      //  gain: W = XZ * (R + Z)^-1
+      //  state: x = x + _W * v
+      //  co-var: P = P - W * (R + Z) * W^T = P - W * XZ^T
+      ObservationVector innovation = obs->getObservation() - predObs;
+      CrossMatrix kalmanGain = predObsCovariance.ldlt()
+        .solve(statePredObsCrossCorrelation.transpose()).transpose();
+      state += kalmanGain * innovation;
+      stateCovariance.noalias() -= kalmanGain * statePredObsCrossCorrelation.transpose();
+
+      sigmasUpdated = false;
+    }
+  };
+
+} // namespace alvar
+
+#endif // __UNSCENTED_KALMAN_FIXED__
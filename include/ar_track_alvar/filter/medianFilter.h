@@ -40,10 +40,16 @@
 #define AR_TRACK_ALVAR_MEDIAN_FILTER_H
 
 #include "ar_track_alvar/Pose.h"
+#include <vector>
 
 namespace ar_track_alvar
 {
 
+/**
+ * Returns the pose of the window that is closest to all the others. The
+ * squared distances between the window poses are kept up to date as poses
+ * are added, so each addPose() and getMedian() is linear in the window size.
+ */
 class MedianFilter
 {
  public:
@@ -53,9 +59,13 @@ class MedianFilter
 
  private:
   int median_n;  
-  alvar::Pose *median_poses;
+  std::vector<alvar::Pose> median_poses;
+  /** Squared distances between the window poses, median_n x median_n */
+  std::vector<double> median_dist;
+  /** Row sums of median_dist */
+  std::vector<double> median_total;
   int median_ind;
-  bool median_init;
+  int median_count;
 };
 
 
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Per-marker pose filters for the detection nodes
+ *
+ */
+
+#ifndef AR_TRACK_ALVAR_POSE_FILTER_BANK_H
+#define AR_TRACK_ALVAR_POSE_FILTER_BANK_H
+
+#include "ar_track_alvar/KalmanFixed.h"
+#include <ros/node_handle.h>
+#include <Eigen/StdVector>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ar_track_alvar
+{
+
+/** How the poses of a marker are smoothed over time */
+enum PoseFilterType
+{
+  /** Poses are passed through as measured */
+  POSE_FILTER_NONE = 0,
+  /** Per-component median of the last window poses */
+  POSE_FILTER_MEDIAN = 1,
+  /** Exponential smoothing, spherical interpolation for the orientation */
+  POSE_FILTER_EXPONENTIAL = 2,
+  /** Constant-velocity Kalman filter on the translation and the quaternion */
+  POSE_FILTER_KALMAN = 3
+};
+
+/** Parses "none", "median", "exponential" or "kalman"; false if unknown */
+bool parsePoseFilterType(const std::string &name, PoseFilterType &type);
+
+struct PoseFilterOptions
+{
+  PoseFilterOptions();
+
+  /**
+   * Reads the pose_filter and pose_filter_* parameters of the node, with
+   * the defaults of the constructor for the ones that are not set
+   */
+  static PoseFilterOptions fromParams(const ros::NodeHandle &pn);
+
+  PoseFilterType type;
+  /** Window length of the median filter */
+  int window;
+  /** Weight of the new pose in exponential smoothing, in (0, 1] */
+  double alpha;
+  /** Kalman acceleration variance of the translation, per second^2 */
+  double translation_process_noise;
+  /** Kalman measurement variance of the translation */
+  double translation_measurement_noise;
+  /** Kalman acceleration variance of the quaternion components, per second^2 */
+  double rotation_process_noise;
+  /** Kalman measurement variance of the quaternion components */
+  double rotation_measurement_noise;
+  /** A marker not seen for this many seconds restarts from its next pose */
+  double reset_timeout;
+};
+
+/** Constant-velocity Kalman filter of a D-dimensional position */
+template<int D>
+class PoseFilterBankKalman : public alvar::KalmanFixed<2*D>
+{
+ public:
+  typedef alvar::KalmanFixed<2*D> Base;
+  /** Time step of the next predict, in seconds */
+  double dt;
+  double process_noise;
+
+  PoseFilterBankKalman() : dt(0), process_noise(0) {}
+
+  /** Positions are the first D states, velocities the last D */
+  virtual void update_F(unsigned long tick)
+  {
+    // Piecewise constant white acceleration
+    double dt2 = dt*dt;
+    this->F.setIdentity();
+    this->Q.setZero();
+    for (int i = 0; i < D; i++)
+    {
+      this->F(i, D+i) = dt;
+      this->Q(i, i) = process_noise * dt2*dt2 / 4;
+      this->Q(i, D+i) = this->Q(D+i, i) = process_noise * dt2*dt / 2;
+      this->Q(D+i, D+i) = process_noise * dt2;
+    }
+  }
+};
+
+/**
+ * Bank of pose filters keyed by marker id, meant as the last stage before
+ * the poses are published.
+ *
+ * The state of a marker is sized when the marker is first seen, after that
+ * filtering a pose does not allocate. The median is kept with sorted
+ * per-component windows that are patched as poses come and go, and the
+ * Kalman filters use the fixed-size \e alvar::KalmanFixed.
+ *
+ * Translations are in whatever units the caller uses and the noise options
+ * have to match. Quaternions are sign-aligned with the current estimate
+ * before filtering, so q and -q count as the same orientation.
+ */
+class PoseFilterBank
+{
+ public:
+  PoseFilterBank(const PoseFilterOptions &options = PoseFilterOptions());
+
+  /** Changes the options; the filter states are dropped */
+  void setOptions(const PoseFilterOptions &options);
+  const PoseFilterOptions &getOptions() const { return options_; }
+  bool enabled() const { return options_.type != POSE_FILTER_NONE; }
+
+  /**
+   * Filters the pose of the marker id measured at stamp (seconds) in place.
+   * The quaternion is normalized on output.
+   */
+  void filter(int id, double stamp, double translation[3], double quaternion[4]);
+
+  /** Drops the state of one marker */
+  void forget(int id);
+  /** Drops the state of all markers */
+  void clear();
+
+ private:
+  struct MarkerState
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    double stamp;
+    /** Current estimate */
+    double translation[3];
+    double quaternion[4];
+    /** Median window: ring of the last poses and the same values sorted, per component */
+    std::vector<double> ring[7];
+    std::vector<double> sorted[7];
+    int ring_head;
+    int ring_count;
+    PoseFilterBankKalman<3> translation_kalman;
+    PoseFilterBankKalman<4> rotation_kalman;
+    alvar::KalmanSensorFixed<6,3> translation_sensor;
+    alvar::KalmanSensorFixed<8,4> rotation_sensor;
+  };
+  typedef std::map<int, MarkerState, std::less<int>,
+                   Eigen::aligned_allocator<std::pair<const int, MarkerState> > > StateMap;
+
+  void reset(MarkerState &state, double stamp, const double translation[3], const double quaternion[4]);
+  void filterMedian(MarkerState &state, double translation[3], double quaternion[4]);
+  void filterExponential(MarkerState &state, double translation[3], double quaternion[4]);
+  void filterKalman(MarkerState &state, double dt, double translation[3], double quaternion[4]);
+
+  PoseFilterOptions options_;
+  StateMap states_;
+};
+
+} // namespace
+
+#endif // include guard
@@ -53,6 +53,14 @@
 #include "ar_track_alvar/GetPositionAndOrientation.h"
 #include "ar_track_alvar/SetCamTopic.h"
 #include "ar_track_alvar/standard_service.h"
+#include <ar_track_alvar/FrameScheduler.h>
+#include <ar_track_alvar/filter/poseFilterBank.h>
+#include <std_msgs/Float64.h>
+#include <ros/callback_queue.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
 
 using namespace alvar;
 using namespace std;
@@ -61,13 +69,30 @@ using namespace std;
 #define VISIBLE_MARKER 2
 #define GHOST_MARKER 3
 
+// How long a GetPositionAndOrientation call waits for a frame while detection is disabled
+#define SNAPSHOT_TIMEOUT 1.0
+
+/**
+ * Immutable result of the latest processed frame. The image callback builds a new
+ * one for every frame and swaps it in; the service only reads it, so it never
+ * touches the detector nor triggers a detection of its own.
+ */
+struct DetectionSnapshot
+{
+  std_msgs::Header header;
+  std::vector<visualization_msgs::Marker> main_markers;
+};
+typedef boost::shared_ptr<const DetectionSnapshot> DetectionSnapshotConstPtr;
+
 Camera *cam;
-cv_bridge::CvImagePtr cv_ptr_;
 image_transport::Subscriber cam_sub_;
 ros::Publisher rvizMarkerPub_;
+ros::Publisher frameAgePub_;
 tf::TransformListener *tf_listener;
 tf::TransformBroadcaster *tf_broadcaster;
 MarkerDetector<MarkerData> marker_detector;
+ar_track_alvar::FrameScheduler frame_scheduler;
+ar_track_alvar::PoseFilterBank pose_filters;
 MultiMarkerBundle **multi_marker_bundles=NULL;
 Pose *bundlePoses;
 int *master_id;
@@ -80,6 +105,7 @@ double max_frequency;
 double marker_size;
 double max_new_marker_error;
 double max_track_error;
+bool rectified = false;
 int display_unknown_objects;
 std::string cam_image_topic;
 std::string cam_info_topic;
@@ -90,6 +116,11 @@ std::map<int, std::string> config;
 bool use_ref = false;
 ros::ServiceClient ref_client;
 
+boost::mutex snapshot_mutex;
+boost::condition_variable snapshot_cond;
+DetectionSnapshotConstPtr latest_snapshot;
+bool snapshot_requested = false;
+
 bool FindMarker(ar_track_alvar::GetPositionAndOrientation::Request  &req, ar_track_alvar::GetPositionAndOrientation::Response &res);
 void configCallback(ar_track_alvar::ParamsConfig &config, uint32_t level);
 void enableCallback(const std_msgs::BoolConstPtr& msg);
@@ -101,7 +132,7 @@ void makeMarkerMsgs(int type, int id, Pose &p, sensor_msgs::ImageConstPtr image_
 // Updates the bundlePoses of the multi_marker_bundles by detecting markers and using all markers in a bundle to infer the master tag's position
 void GetMultiMarkerPoses(IplImage *image) {
 
-  if (marker_detector.Detect(image, cam, true, false, max_new_marker_error, max_track_error, CVSEQ, true)){
+  if (marker_detector.Detect(image, cam, true, false, max_new_marker_error, max_track_error, RUNLENGTH, true)){
     for(int i=0; i<n_bundles; i++)
     {
       marker_detector.SetMarkerSize(multi_marker_bundles[i]->getTagSize());
@@ -222,16 +253,48 @@ void makeMarkerMsgs(int type, int id, Pose &p, sensor_msgs::ImageConstPtr image_
 }
 
 
+// Makes the given snapshot the one answered by the GetPositionAndOrientation service
+void publishSnapshot(const DetectionSnapshotConstPtr &snapshot)
+{
+  {
+    boost::mutex::scoped_lock lock(snapshot_mutex);
+    latest_snapshot = snapshot;
+    snapshot_requested = false;
+  }
+  snapshot_cond.notify_all();
+}
+
 //Callback to handle getting video frames and processing them
 void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
 {
-  cv_ptr_ = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::BGR8);
-
 bool allow_pub = true;
 
-if (enabled) {
+// While disabled, a frame is only processed when a service call is waiting for one
+bool is_enabled, detect;
+{
+  boost::mutex::scoped_lock lock(snapshot_mutex);
+  is_enabled = enabled;
+  detect = enabled || snapshot_requested;
+}
+
+if (detect) {
+  // Answered with an empty snapshot when the frame cannot be processed,
+  // so that a waiting service call returns right away
+  DetectionSnapshot *snapshot = new DetectionSnapshot;
+  snapshot->header = image_msg->header;
+  DetectionSnapshotConstPtr snapshot_ptr(snapshot);
+
   //If we've already gotten the cam info, then go ahead
   if(cam->getCamInfo_){
+    // Frames requested by the service are never skipped
+    if (!frame_scheduler.startFrame(image_msg->header.stamp) && is_enabled)
+      return;
+
+    // Frame age at processing start, to monitor the scheduling latency
+    std_msgs::Float64 frame_age;
+    frame_age.data = frame_scheduler.getFrameAge();
+    frameAgePub_.publish(frame_age);
+
     try{
       //Get the transformation from the Camera to the output frame for this image capture
       tf::StampedTransform CamToOutput;
@@ -247,13 +310,13 @@ if (enabled) {
       visualization_msgs::Marker rvizMarker;
 
       //Convert the image
-      cv_ptr_ = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::BGR8);
+      cv_bridge::CvImagePtr cv_ptr = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::BGR8);
       //Get the estimated pose of the main markers by using all the markers in each bundle
 
       // GetMultiMarkersPoses expects an IplImage*, but as of ros groovy, cv_bridge gives
       // us a cv::Mat. I'm too lazy to change to cv::Mat throughout right now, so I
       // do this conversion here -jbinney
-      IplImage ipl_image = cv_ptr_->image;
+      IplImage ipl_image = cv_ptr->image;
       GetMultiMarkerPoses(&ipl_image);
 
       //Draw the observed markers that are visible and note which bundles have at least 1 marker seen
@@ -286,7 +349,11 @@ if (enabled) {
           {
             Pose p = (*(marker_detector.markers))[i].pose;
             if(display_unknown_objects==1)
+            {
+              if(pose_filters.enabled())
+                pose_filters.filter(id, image_msg->header.stamp.toSec(), p.translation, p.quaternion);
               makeMarkerMsgs(VISIBLE_MARKER, id, p, image_msg, CamToOutput, &rvizMarker);
+            }
 
             if(rvizMarker.header.frame_id != "" && allow_pub)
               rvizMarkerPub_.publish (rvizMarker);
@@ -298,16 +365,29 @@ if (enabled) {
       for(int i=0; i<n_bundles; i++)
     	{
     	  if(bundles_seen[i] == true && allow_pub){
-    	    makeMarkerMsgs(MAIN_MARKER, master_id[i], bundlePoses[i], image_msg, CamToOutput, &rvizMarker);
+    	    // Filter a copy, bundlePoses also seeds the tracking of the next frame
+    	    Pose p = bundlePoses[i];
+    	    if(pose_filters.enabled())
+    	      pose_filters.filter(master_id[i], image_msg->header.stamp.toSec(), p.translation, p.quaternion);
+    	    makeMarkerMsgs(MAIN_MARKER, master_id[i], p, image_msg, CamToOutput, &rvizMarker);
     	    rvizMarkerPub_.publish (rvizMarker);
+    	    snapshot->main_markers.push_back(rvizMarker);
     	  }
     	}
 
+      publishSnapshot(snapshot_ptr);
     }
     catch (cv_bridge::Exception& e){
       ROS_ERROR ("Could not convert from '%s' to 'rgb8'.", image_msg->encoding.c_str ());
+      publishSnapshot(snapshot_ptr);
     }
+    frame_scheduler.finishFrame();
+    ROS_DEBUG_THROTTLE(5.0, "Processed %lu frames, skipped %lu; processing time %.1f ms, frame period %.1f ms",
+                       frame_scheduler.processed_count, frame_scheduler.skipped_count,
+                       frame_scheduler.getProcessingTime() * 1000, frame_scheduler.getFramePeriod() * 1000);
   }
+  else
+    publishSnapshot(snapshot_ptr);
   }
 }
 
@@ -316,6 +396,7 @@ bool ChangeCam(ar_track_alvar::SetCamTopic::Request  &req, ar_track_alvar::SetCa
     ROS_INFO ("Subscribing to new image topic");
     delete cam;
     cam = new Camera(n, req.cam_info_topic);
+    cam->SetRectified(rectified);
 
     cam_sub_.shutdown();
     cam_sub_=it_.subscribe(req.cam_topic, 1, &getCapCallback);
@@ -326,100 +407,32 @@ bool ChangeCam(ar_track_alvar::SetCamTopic::Request  &req, ar_track_alvar::SetCa
 
 bool FindMarker(ar_track_alvar::GetPositionAndOrientation::Request  &req, ar_track_alvar::GetPositionAndOrientation::Response &res)
 {
-    sensor_msgs::ImagePtr image_msg =cv_ptr_->toImageMsg();
-
-    bool allow_pub = true;
-
-    //If we've already gotten the cam info, then go ahead
-        if(cam->getCamInfo_)
+    DetectionSnapshotConstPtr snapshot;
+    {
+        boost::mutex::scoped_lock lock(snapshot_mutex);
+        if (!enabled)
         {
-            try
+            // Detection is idle: ask the image callback to process its next frame once.
+            // Concurrent callers all wait for that same frame instead of adding detections.
+            DetectionSnapshotConstPtr previous = latest_snapshot;
+            snapshot_requested = true;
+            boost::system_time deadline = boost::get_system_time() +
+                boost::posix_time::milliseconds(long(SNAPSHOT_TIMEOUT * 1000));
+            while (latest_snapshot == previous)
             {
-                //Get the transformation from the Camera to the output frame for this image capture
-                tf::StampedTransform CamToOutput;
-                try
+                if (!snapshot_cond.timed_wait(lock, deadline))
                 {
-                    tf_listener->waitForTransform(output_frame, image_msg->header.frame_id, image_msg->header.stamp, ros::Duration(1.0));
-                    tf_listener->lookupTransform(output_frame, image_msg->header.frame_id, image_msg->header.stamp, CamToOutput);
+                    ROS_WARN("GetPositionAndOrientation: no frame processed within %.1f s", SNAPSHOT_TIMEOUT);
+                    break;
                 }
-                catch (tf::TransformException ex)
-                {
-                    ROS_ERROR("%s",ex.what());
-                    allow_pub = false;
-                }
-                visualization_msgs::Marker rvizMarker;
-
-                //Convert the image
-                //cv_ptr_ = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::BGR8);
-                //Get the estimated pose of the main markers by using all the markers in each bundle
-
-                // GetMultiMarkersPoses expects an IplImage*, but as of ros groovy, cv_bridge gives
-                // us a cv::Mat. I'm too lazy to change to cv::Mat throughout right now, so I
-                // do this conversion here -jbinney
-                IplImage ipl_image = cv_ptr_->image;
-                GetMultiMarkerPoses(&ipl_image);
-                //Draw the observed markers that are visible and note which bundles have at least 1 marker seen
-                for(int i=0; i<n_bundles; i++)
-                    bundles_seen[i] = false;
-
-                for (size_t i=0; i<marker_detector.markers->size(); i++)
-                {
-                    int id = (*(marker_detector.markers))[i].GetId();
-
-                    // Draw if id is valid
-                    if(id >= 0)
-                    {
-
-                        //Mark the bundle that marker belongs to as "seen"
-                        for(int j=0; j<n_bundles; j++)
-                        {
-                            for(int k=0; k<bundle_indices[j].size(); k++)
-                            {
-                                if(bundle_indices[j][k] == id)
-                                {
-                                    bundles_seen[j] = true;
-                                    break;
-                                }
-                            }
-                        }
-
-                        // Don't draw if it is a master tag...we do this later, a bit differently
-                        bool should_draw = true;
-                        for(int k=0; k<n_bundles; k++)
-                        {
-                            if(id == master_id[k]) should_draw = false;
-                        }
-                        if(should_draw)
-                        {
-                            Pose p = (*(marker_detector.markers))[i].pose;
-                            if(display_unknown_objects==1 && allow_pub)
-                            {
-                                makeMarkerMsgs(VISIBLE_MARKER, id, p, image_msg, CamToOutput, &rvizMarker);
-                                rvizMarkerPub_.publish (rvizMarker);
-                            }
-                        }
-                    }
-                }
-                //Draw the main markers, whether they are visible or not -- but only if at least 1 marker from their bundle is currently seen
-                for(int i=0; i<n_bundles; i++)
-                {
-                    if(bundles_seen[i] == true && allow_pub)
-                    {
-                        makeMarkerMsgs(MAIN_MARKER, master_id[i], bundlePoses[i], image_msg, CamToOutput, &rvizMarker);
-                        rvizMarkerPub_.publish (rvizMarker);
-                        res.marker.push_back(rvizMarker);
-                    }
-                }
-
-            }
-            catch (cv_bridge::Exception& e)
-            {
-                //ROS_ERROR ("Could not convert from '%s' to 'rgb8'.", BuffImage.encoding.c_str ());
-                ROS_ERROR ("Could not convert from '%s' to 'rgb8'.", image_msg->encoding.c_str ());
-
             }
         }
-return true;
+        snapshot = latest_snapshot;
+    }
+
+    if (snapshot)
+        res.marker = snapshot->main_markers;
+    return true;
 }
 
 
@@ -476,12 +489,14 @@ void ReadConfig (std::map<int,std::string> & config, int* masters_id, int nb_bun
 
 void configCallback(ar_track_alvar::ParamsConfig &config, uint32_t level)
 {
-  ROS_INFO("AR tracker reconfigured: %s %.2f %.2f %.2f %.2f", config.enabled ? "ENABLED" : "DISABLED",
+  ROS_INFO("AR tracker reconfigured: %s %d %.2f %.2f %.2f %.2f", config.enabled ? "ENABLED" : "DISABLED", config.frame_policy,
            config.max_frequency, config.marker_size, config.max_new_marker_error, config.max_track_error);
 
   //enableSwitched = enabled != config.enabled;  //Useless if we begin with enabled=0;
   //enabled = config.enabled;
   max_frequency = config.max_frequency;
+  frame_scheduler.setPolicy(ar_track_alvar::FramePolicy(config.frame_policy));
+  frame_scheduler.setMaxFrequency(max_frequency);
   marker_size = config.marker_size;
   max_new_marker_error = config.max_new_marker_error;
   max_track_error = config.max_track_error;
@@ -490,6 +505,8 @@ void configCallback(ar_track_alvar::ParamsConfig &config, uint32_t level)
 
 void enableCallback(const std_msgs::BoolConstPtr& msg)
 {
+    // Also read by the service thread
+    boost::mutex::scoped_lock lock(snapshot_mutex);
     enabled = msg->data;
 }
 
@@ -523,8 +540,12 @@ int main(int argc, char *argv[])
   pn.setParam("marker_size", marker_size);
   pn.setParam("max_new_marker_error", max_new_marker_error);
   pn.setParam("max_track_error", max_track_error);
+  pn.setParam("max_frequency", max_frequency);
+  frame_scheduler.setMaxFrequency(max_frequency);
 
   marker_detector.SetMarkerSize(marker_size);
+  // Only the poses are used, so tracked markers are read again every 10 frames
+  marker_detector.SetTrackVerification(10);
   multi_marker_bundles = new MultiMarkerBundle*[n_bundles];
   bundlePoses = new Pose[n_bundles];
   master_id = new int[n_bundles];
@@ -569,10 +590,17 @@ int main(int argc, char *argv[])
   server.setCallback(f);
 
   // Set up camera, listeners, and broadcasters
+  // With image_rect topics the point distortion is skipped
+  pn.param("rectified", rectified, false);
+
+  // Optional smoothing of the marker poses before they are published
+  pose_filters.setOptions(ar_track_alvar::PoseFilterOptions::fromParams(pn));
   cam = new Camera(n, cam_info_topic);
+  cam->SetRectified(rectified);
   tf_listener = new tf::TransformListener(n);
   tf_broadcaster = new tf::TransformBroadcaster();
   rvizMarkerPub_ = n.advertise < visualization_msgs::Marker > ("ar_visualization_marker", 0);
+  frameAgePub_ = pn.advertise < std_msgs::Float64 > ("frame_age", 1);
 
   //Give tf a chance to catch up before the camera callback starts asking for transforms
   ros::Duration(1.0).sleep();
@@ -584,16 +612,18 @@ int main(int argc, char *argv[])
   cam_sub_ = it_.subscribe(cam_image_topic, 1, &getCapCallback);
 
 
-  // Run at the configured rate, discarding pointcloud msgs if necessary
-  ros::Rate rate(max_frequency);
-
   /// Subscriber for enable-topic so that a user can turn off the detection if it is not used without
   /// having to use the reconfigure where he has to know all parameters
   ROS_INFO("Subscribing to enable_detection. Don't forget to publish on this topic if you want ar_track to publish the poses !");
   ros::Subscriber enable_sub_ = pn.subscribe("enable_detection", 1, &enableCallback);
 
       //Service for marker detection so that a user can turn the detection for a single picture
+      //It has its own queue and spinner so that it can be answered while a frame is being processed
+  ros::CallbackQueue service_queue;
+  n2.setCallbackQueue(&service_queue);
   ros::ServiceServer service = n2.advertiseService("GetPositionAndOrientation", FindMarker);
+  ros::AsyncSpinner service_spinner(1, &service_queue);
+  service_spinner.start();
   ROS_INFO("Ready To Get Position And Orientation");
 
       //Service for changing the xam topic during runtime
@@ -602,19 +632,9 @@ int main(int argc, char *argv[])
   ROS_INFO("Ready To Set Cam Topic");
 
 
-  while (ros::ok())
-  {
-      ros::spinOnce();
-      rate.sleep();
-
-      if (std::abs((rate.expectedCycleTime() - ros::Duration(1.0 / max_frequency)).toSec()) > 0.001)
-      {
-          // Change rate dynamically; if must be above 0, as 0 will provoke a segfault on next spinOnce
-          ROS_DEBUG("Changing frequency from %.2f to %.2f", 1.0 / rate.expectedCycleTime().toSec(), max_frequency);
-          rate = ros::Rate(max_frequency);
-      }
-
-  }
+  // Frames are processed as soon as they arrive; the frame scheduler decides
+  // which ones to skip according to the configured policy and max_frequency
+  ros::spin();
 
   return 0;
 }
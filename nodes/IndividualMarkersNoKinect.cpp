@@ -45,6 +45,10 @@
 #include <sensor_msgs/image_encodings.h>
 #include <dynamic_reconfigure/server.h>
 #include <ar_track_alvar/ParamsConfig.h>
+#include <ar_track_alvar/FrameScheduler.h>
+#include <ar_track_alvar/filter/poseFilterBank.h>
+#include <std_msgs/Float64.h>
+#include <ros/callback_queue.h>
 
 using namespace alvar;
 using namespace std;
@@ -54,10 +58,13 @@ Camera *cam;
 cv_bridge::CvImagePtr cv_ptr_;
 image_transport::Subscriber cam_sub_;
 ros::Publisher rvizMarkerPub_;
+ros::Publisher frameAgePub_;
 visualization_msgs::Marker rvizMarker_;
 tf::TransformListener *tf_listener;
 tf::TransformBroadcaster *tf_broadcaster;
-MarkerDetector<MarkerData> marker_detector;
+MarkerDetector<MarkerDataRes<5> > marker_detector;
+ar_track_alvar::FrameScheduler frame_scheduler;
+ar_track_alvar::PoseFilterBank pose_filters;
 
 bool enableSwitched = false;
 bool enabled = true;
@@ -65,6 +72,7 @@ double max_frequency;
 double marker_size;
 double max_new_marker_error;
 double max_track_error;
+bool rectified = false;
 std::string cam_image_topic;
 std::string cam_info_topic;
 std::string output_frame;
@@ -76,6 +84,14 @@ void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
 {
     //If we've already gotten the cam info, then go ahead
 	if(cam->getCamInfo_){
+		if (!frame_scheduler.startFrame(image_msg->header.stamp))
+			return;
+
+		// Frame age at processing start, to monitor the scheduling latency
+		std_msgs::Float64 frame_age;
+		frame_age.data = frame_scheduler.getFrameAge();
+		frameAgePub_.publish(frame_age);
+
 		try{
 			tf::StampedTransform CamToOutput;
     			try{
@@ -97,27 +113,17 @@ void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
             // do this conversion here -jbinney
             IplImage ipl_image = cv_ptr_->image;
 
-            marker_detector.Detect(&ipl_image, cam, true, false, max_new_marker_error, max_track_error, CVSEQ, true);
-			for (size_t i=0; i<marker_detector.markers->size(); i++)
+            marker_detector.Detect(&ipl_image, cam, true, false, max_new_marker_error, max_track_error, RUNLENGTH, true);
+			const std::vector<MarkerDetection> &detections = marker_detector.GetDetections();
+			for (size_t i=0; i<detections.size(); i++)
 			{
 				//Get the pose relative to the camera
-        		int id = (*(marker_detector.markers))[i].GetId();
-				Pose p = (*(marker_detector.markers))[i].pose;
-				double px = p.translation[0]/100.0;
-				double py = p.translation[1]/100.0;
-				double pz = p.translation[2]/100.0;
-				double qx = p.quaternion[1];
-				double qy = p.quaternion[2];
-				double qz = p.quaternion[3];
-				double qw = p.quaternion[0];
-
-                tf::Quaternion rotation (qx,qy,qz,qw);
-                tf::Vector3 origin (px,py,pz);
-                tf::Transform t (rotation, origin);
-                tf::Vector3 markerOrigin (0, 0, 0);
-                tf::Transform m (tf::Quaternion::getIdentity (), markerOrigin);
-                tf::Transform markerPose = t * m; // marker pose in the camera frame
+				const MarkerDetection &d = detections[i];
+				int id = d.id;
+				double translation[3] = { d.translation[0], d.translation[1], d.translation[2] };
+				double quaternion[4] = { d.quaternion[0], d.quaternion[1], d.quaternion[2], d.quaternion[3] };
 
+                tf::Quaternion rotation (quaternion[1], quaternion[2], quaternion[3], quaternion[0]);
                 tf::Vector3 z_axis_cam = tf::Transform(rotation, tf::Vector3(0,0,0)) * tf::Vector3(0, 0, 1);
 //                ROS_INFO("%02i Z in cam frame: %f %f %f",id, z_axis_cam.x(), z_axis_cam.y(), z_axis_cam.z());
                 /// as we can't see through markers, this one is false positive detection
@@ -126,6 +132,22 @@ void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
                     continue;
                 }
 
+				// Optional smoothing of the published pose, false positives are kept out of it
+				if (pose_filters.enabled())
+				{
+					pose_filters.filter(id, image_msg->header.stamp.toSec(), translation, quaternion);
+					rotation = tf::Quaternion(quaternion[1], quaternion[2], quaternion[3], quaternion[0]);
+				}
+				double px = translation[0]/100.0;
+				double py = translation[1]/100.0;
+				double pz = translation[2]/100.0;
+
+                tf::Vector3 origin (px,py,pz);
+                tf::Transform t (rotation, origin);
+                tf::Vector3 markerOrigin (0, 0, 0);
+                tf::Transform m (tf::Quaternion::getIdentity (), markerOrigin);
+                tf::Transform markerPose = t * m; // marker pose in the camera frame
+
 				//Publish the transform from the camera to the marker
 				std::string markerFrame = "ar_marker_";
 				std::stringstream out;
@@ -196,18 +218,24 @@ void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg)
         catch (cv_bridge::Exception& e){
       		ROS_ERROR ("Could not convert from '%s' to 'rgb8'.", image_msg->encoding.c_str ());
     	}
+		frame_scheduler.finishFrame();
+		ROS_DEBUG_THROTTLE(5.0, "Processed %lu frames, skipped %lu; processing time %.1f ms, frame period %.1f ms",
+		                   frame_scheduler.processed_count, frame_scheduler.skipped_count,
+		                   frame_scheduler.getProcessingTime() * 1000, frame_scheduler.getFramePeriod() * 1000);
 	}
 }
 
 void configCallback(ar_track_alvar::ParamsConfig &config, uint32_t level)
 {
-  ROS_INFO("AR tracker reconfigured: %s %.2f %.2f %.2f %.2f", config.enabled ? "ENABLED" : "DISABLED",
+  ROS_INFO("AR tracker reconfigured: %s %d %.2f %.2f %.2f %.2f", config.enabled ? "ENABLED" : "DISABLED", config.frame_policy,
            config.max_frequency, config.marker_size, config.max_new_marker_error, config.max_track_error);
 
   enableSwitched = enabled != config.enabled;
 
   enabled = config.enabled;
   max_frequency = config.max_frequency;
+  frame_scheduler.setPolicy(ar_track_alvar::FramePolicy(config.frame_policy));
+  frame_scheduler.setMaxFrequency(max_frequency);
   marker_size = config.marker_size;
   max_new_marker_error = config.max_new_marker_error;
   max_track_error = config.max_track_error;
@@ -241,6 +269,8 @@ int main(int argc, char *argv[])
 	cam_info_topic = argv[5];
     output_frame = argv[6];
 	marker_detector.SetMarkerSize(marker_size);
+	// Only the poses are used, so tracked markers are read again every 10 frames
+	marker_detector.SetTrackVerification(10);
 
   if (argc > 7)
     max_frequency = atof(argv[7]);
@@ -251,12 +281,22 @@ int main(int argc, char *argv[])
   pn.setParam("max_track_error", max_track_error);
 
   if (argc > 7)
+  {
     pn.setParam("max_frequency", max_frequency);
+    frame_scheduler.setMaxFrequency(max_frequency);
+  }
 
+	// With image_rect topics the point distortion is skipped
+	pn.param("rectified", rectified, false);
+
+	// Optional smoothing of the marker poses before they are published
+	pose_filters.setOptions(ar_track_alvar::PoseFilterOptions::fromParams(pn));
 	cam = new Camera(n, cam_info_topic);
+	cam->SetRectified(rectified);
 	tf_listener = new tf::TransformListener(n);
 	tf_broadcaster = new tf::TransformBroadcaster();
 	rvizMarkerPub_ = n.advertise < visualization_msgs::Marker > ("ar_visualization_marker", 0);
+	frameAgePub_ = pn.advertise < std_msgs::Float64 > ("frame_age", 1);
 
   // Prepare dynamic reconfiguration
   dynamic_reconfigure::Server < ar_track_alvar::ParamsConfig > server;
@@ -272,25 +312,16 @@ int main(int argc, char *argv[])
 
 	image_transport::ImageTransport it_(n);
 
-  // Run at the configured rate, discarding pointcloud msgs if necessary
-  ros::Rate rate(max_frequency);
-
   /// Subscriber for enable-topic so that a user can turn off the detection if it is not used without
   /// having to use the reconfigure where he has to know all parameters
   ros::Subscriber enable_sub_ = pn.subscribe("enable_detection", 1, &enableCallback);
 
+  // Frames are processed as soon as they arrive; the frame scheduler decides
+  // which ones to skip according to the configured policy and max_frequency
   enableSwitched = true;
   while (ros::ok())
   {
-    ros::spinOnce();
-    rate.sleep();
-
-    if (std::abs((rate.expectedCycleTime() - ros::Duration(1.0 / max_frequency)).toSec()) > 0.001)
-    {
-      // Change rate dynamically; if must be above 0, as 0 will provoke a segfault on next spinOnce
-      ROS_DEBUG("Changing frequency from %.2f to %.2f", 1.0 / rate.expectedCycleTime().toSec(), max_frequency);
-      rate = ros::Rate(max_frequency);
-    }
+    ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(0.1));
 
     if (enableSwitched)
     {
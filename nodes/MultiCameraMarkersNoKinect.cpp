@@ -0,0 +1,406 @@
+/*
+ Software License Agreement (BSD License)
+
+ Copyright (c) 2012, Scott Niekum
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions
+ are met:
+
+  * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above
+    copyright notice, this list of conditions and the following
+    disclaimer in the documentation and/or other materials provided
+    with the distribution.
+  * Neither the name of the Willow Garage nor the names of its
+    contributors may be used to endorse or promote products derived
+    from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "ar_track_alvar/MarkerDetector.h"
+#include "ar_track_alvar/FrameScheduler.h"
+#include <cv_bridge/cv_bridge.h>
+#include <tf/transform_broadcaster.h>
+#include <sensor_msgs/image_encodings.h>
+#include <dynamic_reconfigure/server.h>
+#include <ar_track_alvar/ParamsConfig.h>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <ros/callback_queue.h>
+
+using namespace alvar;
+using namespace std;
+
+/**
+ * Per-camera state: its calibration, its own detector (and thus its own
+ * tracking state) and the latest frame waiting to be processed. A channel is
+ * processed by at most one worker at a time, and only that worker touches
+ * the camera and the detector.
+ */
+struct CameraChannel
+{
+  int index;
+  std::string cam_image_topic;
+  std::string cam_info_topic;
+  Camera *cam;
+  MarkerDetector<MarkerDataRes<5> > marker_detector;
+  image_transport::Subscriber cam_sub_;
+  ros::Subscriber cam_info_sub_;
+
+  // Guards the frame scheduler and the latest camera info
+  boost::mutex mutex;
+  ar_track_alvar::FrameScheduler frame_scheduler;
+  sensor_msgs::CameraInfoConstPtr cam_info;
+
+  // The camera info and marker size the worker has applied to cam and marker_detector
+  sensor_msgs::CameraInfoConstPtr applied_cam_info;
+  double applied_marker_size;
+
+  sensor_msgs::ImageConstPtr pending;
+  bool busy;
+  unsigned long dropped;
+
+  CameraChannel() : index(0), cam(NULL), applied_marker_size(0), busy(false), dropped(0) {}
+};
+
+std::vector<CameraChannel*> channels;
+ros::Publisher rvizMarkerPub_;
+tf::TransformBroadcaster *tf_broadcaster;
+
+// Guards the pending frames, the busy flags and the detection settings below
+boost::mutex pool_mutex;
+boost::condition_variable pool_cond;
+bool shutting_down = false;
+
+bool enableSwitched = false;
+bool enabled = true;
+double max_frequency;
+double marker_size;
+double max_new_marker_error;
+double max_track_error;
+
+// Detection settings of one frame, copied under pool_mutex when the frame is taken
+struct DetectionSettings
+{
+  double marker_size;
+  double max_new_marker_error;
+  double max_track_error;
+};
+
+// The camera info is kept as it arrived and applied by the worker processing
+// the channel, so the calibration never changes under a running detection
+void camInfoCallback (const sensor_msgs::CameraInfoConstPtr & cam_info, CameraChannel *channel)
+{
+  boost::mutex::scoped_lock lock(channel->mutex);
+  channel->cam_info = cam_info;
+}
+
+void getCapCallback (const sensor_msgs::ImageConstPtr & image_msg, CameraChannel *channel)
+{
+  {
+    boost::mutex::scoped_lock lock(pool_mutex);
+    // Only the newest frame of each camera is kept
+    if (channel->pending)
+      channel->dropped++;
+    channel->pending = image_msg;
+  }
+  pool_cond.notify_one();
+}
+
+// Picks the idle camera whose pending frame is the oldest, i.e. the one
+// closest to missing its deadline. Must be called with pool_mutex held.
+CameraChannel *nextChannel()
+{
+  CameraChannel *next = NULL;
+  for (size_t i=0; i<channels.size(); i++)
+  {
+    CameraChannel *channel = channels[i];
+    if (channel->busy || !channel->pending)
+      continue;
+    if (!next || channel->pending->header.stamp < next->pending->header.stamp)
+      next = channel;
+  }
+  return next;
+}
+
+void setMarkerColor(int id, visualization_msgs::Marker &rvizMarker)
+{
+  rvizMarker.color.a = 1.0;
+  switch (id)
+  {
+    case 0:  rvizMarker.color.r = 0.0f; rvizMarker.color.g = 0.0f; rvizMarker.color.b = 1.0f; break;
+    case 1:  rvizMarker.color.r = 1.0f; rvizMarker.color.g = 0.0f; rvizMarker.color.b = 0.0f; break;
+    case 2:  rvizMarker.color.r = 0.0f; rvizMarker.color.g = 1.0f; rvizMarker.color.b = 0.0f; break;
+    case 3:  rvizMarker.color.r = 0.0f; rvizMarker.color.g = 0.5f; rvizMarker.color.b = 0.5f; break;
+    case 4:  rvizMarker.color.r = 0.5f; rvizMarker.color.g = 0.5f; rvizMarker.color.b = 0.0f; break;
+    default: rvizMarker.color.r = 0.5f; rvizMarker.color.g = 0.0f; rvizMarker.color.b = 0.5f; break;
+  }
+}
+
+void processFrame (CameraChannel *channel, const sensor_msgs::ImageConstPtr & image_msg, const DetectionSettings &settings)
+{
+  try{
+    cv_bridge::CvImagePtr cv_ptr = cv_bridge::toCvCopy(image_msg, sensor_msgs::image_encodings::BGR8);
+    IplImage ipl_image = cv_ptr->image;
+
+    MarkerDetector<MarkerDataRes<5> > &marker_detector = channel->marker_detector;
+    marker_detector.Detect(&ipl_image, channel->cam, true, false, settings.max_new_marker_error, settings.max_track_error, RUNLENGTH, true);
+    const std::vector<MarkerDetection> &detections = marker_detector.GetDetections();
+    for (size_t i=0; i<detections.size(); i++)
+    {
+      //Get the pose relative to the camera
+      const MarkerDetection &d = detections[i];
+      int id = d.id;
+      tf::Quaternion rotation (d.quaternion[1], d.quaternion[2], d.quaternion[3], d.quaternion[0]);
+      tf::Vector3 origin (d.translation[0]/100.0, d.translation[1]/100.0, d.translation[2]/100.0);
+      tf::Transform t (rotation, origin);
+
+      /// as we can't see through markers, this one is false positive detection
+      tf::Vector3 z_axis_cam = tf::Transform(rotation, tf::Vector3(0,0,0)) * tf::Vector3(0, 0, 1);
+      if (z_axis_cam.z() > 0)
+        continue;
+
+      //Publish the transform from the camera to the marker
+      std::stringstream markerFrame;
+      markerFrame << "ar_marker_" << id;
+      tf_broadcaster->sendTransform(tf::StampedTransform(t, image_msg->header.stamp, image_msg->header.frame_id, markerFrame.str()));
+
+      //Create the rviz visualization messages, one namespace per camera
+      visualization_msgs::Marker rvizMarker;
+      tf::poseTFToMsg (t, rvizMarker.pose);
+      rvizMarker.header.frame_id = image_msg->header.frame_id;
+      rvizMarker.header.stamp = image_msg->header.stamp;
+      rvizMarker.id = id;
+      rvizMarker.scale.x = 1.0 * settings.marker_size/100.0;
+      rvizMarker.scale.y = 1.0 * settings.marker_size/100.0;
+      rvizMarker.scale.z = 0.2 * settings.marker_size/100.0;
+      std::stringstream ns;
+      ns << "camera_" << channel->index;
+      rvizMarker.ns = ns.str();
+      rvizMarker.type = visualization_msgs::Marker::CUBE;
+      rvizMarker.action = visualization_msgs::Marker::ADD;
+      setMarkerColor(id, rvizMarker);
+      rvizMarker.lifetime = ros::Duration (1.0);
+      rvizMarkerPub_.publish (rvizMarker);
+    }
+  }
+  catch (cv_bridge::Exception& e){
+    ROS_ERROR ("Could not convert from '%s' to 'rgb8'.", image_msg->encoding.c_str ());
+  }
+}
+
+void workerLoop()
+{
+  boost::mutex::scoped_lock lock(pool_mutex);
+  while (!shutting_down)
+  {
+    CameraChannel *channel = nextChannel();
+    if (!channel)
+    {
+      pool_cond.wait(lock);
+      continue;
+    }
+    sensor_msgs::ImageConstPtr image_msg = channel->pending;
+    channel->pending.reset();
+    channel->busy = true;
+    unsigned long dropped = channel->dropped;
+    DetectionSettings settings;
+    settings.marker_size = marker_size;
+    settings.max_new_marker_error = max_new_marker_error;
+    settings.max_track_error = max_track_error;
+    lock.unlock();
+
+    sensor_msgs::CameraInfoConstPtr cam_info;
+    bool process;
+    {
+      boost::mutex::scoped_lock channel_lock(channel->mutex);
+      cam_info = channel->cam_info;
+      process = cam_info && channel->frame_scheduler.startFrame(image_msg->header.stamp);
+    }
+
+    if (process)
+    {
+      if (cam_info != channel->applied_cam_info)
+      {
+        channel->cam->SetCameraInfo(*cam_info);
+        channel->applied_cam_info = cam_info;
+      }
+      if (settings.marker_size != channel->applied_marker_size)
+      {
+        channel->marker_detector.SetMarkerSize(settings.marker_size);
+        channel->applied_marker_size = settings.marker_size;
+      }
+      processFrame(channel, image_msg, settings);
+
+      boost::mutex::scoped_lock channel_lock(channel->mutex);
+      channel->frame_scheduler.finishFrame();
+      ROS_DEBUG_THROTTLE(5.0, "%s: processed %lu frames, skipped %lu, dropped %lu; processing time %.1f ms, frame age %.1f ms",
+                         channel->cam_image_topic.c_str(), channel->frame_scheduler.processed_count,
+                         channel->frame_scheduler.skipped_count, dropped,
+                         channel->frame_scheduler.getProcessingTime() * 1000, channel->frame_scheduler.getFrameAge() * 1000);
+    }
+
+    lock.lock();
+    channel->busy = false;
+    // A frame of this camera may have arrived meanwhile
+    if (channel->pending)
+      pool_cond.notify_one();
+  }
+}
+
+void configCallback(ar_track_alvar::ParamsConfig &config, uint32_t level)
+{
+  ROS_INFO("AR tracker reconfigured: %s %d %.2f %.2f %.2f %.2f", config.enabled ? "ENABLED" : "DISABLED", config.frame_policy,
+           config.max_frequency, config.marker_size, config.max_new_marker_error, config.max_track_error);
+
+  enableSwitched = enabled != config.enabled;
+  enabled = config.enabled;
+
+  {
+    // The workers pick the new marker size up with their next frame
+    boost::mutex::scoped_lock lock(pool_mutex);
+    max_frequency = config.max_frequency;
+    marker_size = config.marker_size;
+    max_new_marker_error = config.max_new_marker_error;
+    max_track_error = config.max_track_error;
+  }
+  for (size_t i=0; i<channels.size(); i++)
+  {
+    boost::mutex::scoped_lock channel_lock(channels[i]->mutex);
+    channels[i]->frame_scheduler.setPolicy(ar_track_alvar::FramePolicy(config.frame_policy));
+    channels[i]->frame_scheduler.setMaxFrequency(config.max_frequency);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  ros::init (argc, argv, "marker_detect");
+  ros::NodeHandle n, pn("~");
+
+  if(argc < 8 || (argc - 6) % 2 != 0){
+    std::cout << std::endl;
+    cout << "Not enough arguments provided." << endl;
+    cout << "Usage: ./multiCameraMarkersNoKinect <marker size in cm> <max new marker error> "
+         << "<max track error> <max frequency> <worker threads> "
+         << "<cam image topic> <cam info topic> [ <cam image topic> <cam info topic> ... ]";
+    std::cout << std::endl;
+    return 0;
+  }
+
+  // Get params from command line
+  marker_size = atof(argv[1]);
+  max_new_marker_error = atof(argv[2]);
+  max_track_error = atof(argv[3]);
+  max_frequency = atof(argv[4]);
+  int n_threads = atoi(argv[5]);
+  if (n_threads <= 0)
+    n_threads = std::max(1, int(boost::thread::hardware_concurrency()));
+  int n_args_before_list = 6;
+
+  // Set dynamically configurable parameters so they don't get replaced by default values
+  pn.setParam("marker_size", marker_size);
+  pn.setParam("max_new_marker_error", max_new_marker_error);
+  pn.setParam("max_track_error", max_track_error);
+  pn.setParam("max_frequency", max_frequency);
+
+  // With image_rect topics the point distortion is skipped
+  bool rectified;
+  pn.param("rectified", rectified, false);
+
+  for (int i = n_args_before_list; i+1 < argc; i += 2)
+  {
+    CameraChannel *channel = new CameraChannel;
+    channel->index = (int)channels.size();
+    channel->cam_image_topic = argv[i];
+    channel->cam_info_topic = argv[i+1];
+    channel->cam = new Camera();
+    channel->cam->SetRectified(rectified);
+    channel->marker_detector.SetMarkerSize(marker_size);
+    // Only the poses are used, so tracked markers are read again every 10 frames
+    channel->marker_detector.SetTrackVerification(10);
+    channel->applied_marker_size = marker_size;
+    channel->frame_scheduler.setMaxFrequency(max_frequency);
+    channels.push_back(channel);
+  }
+  ROS_INFO("Detecting markers from %d cameras with %d worker threads", (int)channels.size(), n_threads);
+
+  tf_broadcaster = new tf::TransformBroadcaster();
+  rvizMarkerPub_ = n.advertise < visualization_msgs::Marker > ("ar_visualization_marker", 0);
+
+  // Prepare dynamic reconfiguration
+  dynamic_reconfigure::Server < ar_track_alvar::ParamsConfig > server;
+  dynamic_reconfigure::Server<ar_track_alvar::ParamsConfig>::CallbackType f;
+
+  f = boost::bind(&configCallback, _1, _2);
+  server.setCallback(f);
+
+  // The image callbacks only hand the newest frame of each camera over to the
+  // shared worker pool, which does the detection
+  boost::thread_group workers;
+  for (int i = 0; i < n_threads; i++)
+    workers.create_thread(&workerLoop);
+
+  image_transport::ImageTransport it_(n);
+  for (size_t i = 0; i < channels.size(); i++)
+    channels[i]->cam_info_sub_ = n.subscribe<sensor_msgs::CameraInfo>(channels[i]->cam_info_topic, 1,
+                                                                       boost::bind(&camInfoCallback, _1, channels[i]));
+
+  enableSwitched = true;
+  while (ros::ok())
+  {
+    ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(0.1));
+
+    if (enableSwitched)
+    {
+      // Enable/disable switch: subscribe/unsubscribe to the images of all cameras
+      for (size_t i = 0; i < channels.size(); i++)
+      {
+        if (enabled)
+          channels[i]->cam_sub_ = it_.subscribe(channels[i]->cam_image_topic, 1, boost::bind(&getCapCallback, _1, channels[i]));
+        else
+          channels[i]->cam_sub_.shutdown();
+      }
+      if (!enabled)
+      {
+        boost::mutex::scoped_lock lock(pool_mutex);
+        for (size_t i = 0; i < channels.size(); i++)
+          channels[i]->pending.reset();
+      }
+      enableSwitched = false;
+    }
+  }
+
+  {
+    boost::mutex::scoped_lock lock(pool_mutex);
+    shutting_down = true;
+  }
+  pool_cond.notify_all();
+  workers.join_all();
+
+  for (size_t i = 0; i < channels.size(); i++)
+  {
+    channels[i]->cam_sub_.shutdown();
+    channels[i]->cam_info_sub_.shutdown();
+    delete channels[i]->cam;
+    delete channels[i];
+  }
+  delete tf_broadcaster;
+  return 0;
+}
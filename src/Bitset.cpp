@@ -22,6 +22,7 @@
  */
 
 #include "ar_track_alvar/Bitset.h"
+#include <climits>
 
 using namespace std;
 
@@ -327,4 +328,80 @@ int BitsetExt::hamming_dec(int block_len) {
 	return error_count;
 }
 
+BitsetBuffer::BitsetBuffer(bool *storage, int _capacity)
+	: bits(storage), capacity(_capacity), first(0), length(0)
+{
+}
+
+// As BitsetExt::hamming_dec_block, but the parity bits are dropped by moving
+// the data bits of the block from 'read' down to 'write'
+int BitsetBuffer::hamming_dec_block(unsigned long block_len, int &read, int &write) {
+	bool *b = bits + first;
+	bool potentially_double_error = false;
+	unsigned long total_parity=0;
+	unsigned long parity=0;
+	unsigned long next_parity=1;
+	for (unsigned long i=1; i<=block_len; i++) {
+		if (read == length) {
+			block_len = i; // Same as in BitsetExt::hamming_dec_block
+			break;
+		}
+		bool bit = b[read++];
+		if (bit) {
+			parity = parity ^ i;
+			total_parity = total_parity ^ 1;
+		}
+		if (i == next_parity) next_parity <<= 1;
+		else b[write++] = bit;
+	}
+	if (block_len < 3) return 0;
+	if (block_len == (next_parity >> 1)) {
+		parity = parity & ~(next_parity >> 1);
+		if (total_parity == 0) {
+			potentially_double_error = true;
+		}
+	}
+	if (parity) {
+		if (potentially_double_error) return -1;
+		int steps=0;
+		next_parity = 1;
+		for (unsigned long i=1; i<=block_len; i++) {
+			if (i == next_parity) {
+				next_parity <<= 1;
+				if (i == parity) return 1; // Only parity bit was erroneous
+			} else if (i >= parity) {
+				steps++;
+			}
+		}
+		// BitsetExt would step outside its bits for some truncated blocks
+		int pos = write - steps;
+		if (pos >= 0 && pos < write) b[pos] = !b[pos];
+		return 1;
+	}
+	return 0;
+}
+
+// Returns number of corrected errors (or -1 if there were unrecoverable error)
+int BitsetBuffer::hamming_dec(int block_len) {
+	int error_count=0;
+	int read=0, write=0;
+	while (read < length) {
+		int error=hamming_dec_block(block_len, read, write);
+		if ((error == -1) || (error_count == -1)) error_count=-1;
+		else error_count += error;
+	}
+	length = write;
+	return error_count;
+}
+
+unsigned long BitsetBuffer::ulong() const
+{
+	unsigned long v = 0;
+	for (int i = 0; i < length; i++) {
+		if (v > (ULONG_MAX >> 1)) return ULONG_MAX;
+		v = (v << 1) | (bits[first+i] ? 1 : 0);
+	}
+	return v;
+}
+
 } // namespace alvar
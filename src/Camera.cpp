@@ -25,6 +25,8 @@
 #include "ar_track_alvar/Camera.h"
 #include "ar_track_alvar/FileFormatUtils.h"
 #include <memory>
+#include <algorithm>
+#include <cfloat>
 
 using namespace std;
 
@@ -117,6 +119,7 @@ Camera::Camera() {
 	calib_y_res = 480;
 	x_res = 640;
 	y_res = 480;
+	rectified = false;
 }
 
 
@@ -135,6 +138,7 @@ Camera::Camera(ros::NodeHandle & n, std::string cam_info_topic):n_(n)
 	calib_y_res = 480;
 	x_res = 640;
 	y_res = 480;
+	rectified = false;
 	cameraInfoTopic_ = cam_info_topic;
 	ROS_INFO ("Subscribing to info topic");
     sub_ = n_.subscribe (cameraInfoTopic_, 1, &Camera::camInfoCallback, this);
@@ -244,6 +248,19 @@ void Camera::SetCameraInfo(const sensor_msgs::CameraInfo &camInfo)
     cvmSet(&calib_K, 2, 1, cam_info_.K[7]);
     cvmSet(&calib_K, 2, 2, cam_info_.K[8]);
 
+    if (rectified) {
+        // The rectified images are described by the projection matrix P
+        cvmSet(&calib_K, 0, 0, cam_info_.P[0]);
+        cvmSet(&calib_K, 0, 1, cam_info_.P[1]);
+        cvmSet(&calib_K, 0, 2, cam_info_.P[2]);
+        cvmSet(&calib_K, 1, 0, cam_info_.P[4]);
+        cvmSet(&calib_K, 1, 1, cam_info_.P[5]);
+        cvmSet(&calib_K, 1, 2, cam_info_.P[6]);
+        cvmSet(&calib_K, 2, 0, cam_info_.P[8]);
+        cvmSet(&calib_K, 2, 1, cam_info_.P[9]);
+        cvmSet(&calib_K, 2, 2, cam_info_.P[10]);
+    }
+
     if (cam_info_.D.size() >= 4) {
         cvmSet(&calib_D, 0, 0, cam_info_.D[0]);
         cvmSet(&calib_D, 1, 0, cam_info_.D[1]);
@@ -426,6 +443,8 @@ void Camera::SetOpenglProjectionMatrix(double proj_matrix[16], const int width,
 
 void Camera::Undistort(PointDouble &point)
 {
+	if (!IsDistorted()) return;
+
 	// focal length
 	double ifx = 1./cvmGet(&calib_K, 0, 0);
 	double ify = 1./cvmGet(&calib_K, 1, 1);
@@ -454,6 +473,13 @@ void Camera::Undistort(PointDouble &point)
 
 void Camera::Undistort(vector<PointDouble >& points)
 {
+	if (!points.empty()) Undistort(&points[0], points.size());
+}
+
+void Camera::Undistort(PointDouble *points, size_t count)
+{
+	if (!IsDistorted()) return;
+
 	// focal length
 	double ifx = 1./cvmGet(&calib_K, 0, 0);
 	double ify = 1./cvmGet(&calib_K, 1, 1);
@@ -465,7 +491,7 @@ void Camera::Undistort(vector<PointDouble >& points)
 	// distortion coeffs
 	double* k = calib_D.data.db;
 
-	for(unsigned int i = 0; i < points.size(); i++)
+	for(size_t i = 0; i < count; i++)
 	{
 		// compensate distortion iteratively
 		double x = (points[i].x - cx)*ifx, y = (points[i].y - cy)*ify, x0 = x, y0 = y;
@@ -485,6 +511,8 @@ void Camera::Undistort(vector<PointDouble >& points)
 
 void Camera::Undistort(CvPoint2D32f& point)
 {
+	if (!IsDistorted()) return;
+
 	// focal length
 	double ifx = 1./cvmGet(&calib_K, 0, 0);
 	double ify = 1./cvmGet(&calib_K, 1, 1);
@@ -512,6 +540,40 @@ void Camera::Undistort(CvPoint2D32f& point)
 	point.y = float(y/ify + cy);
 }
 
+void Camera::Undistort(float *x, float *y, size_t count)
+{
+	if (!IsDistorted()) return;
+
+	// focal length
+	float fx = (float)cvmGet(&calib_K, 0, 0), fy = (float)cvmGet(&calib_K, 1, 1);
+	float ifx = 1.f/fx, ify = 1.f/fy;
+
+	// principal point
+	float cx = (float)cvmGet(&calib_K, 0, 2);
+	float cy = (float)cvmGet(&calib_K, 1, 2);
+
+	// distortion coeffs
+	float k0 = (float)calib_D_data[0], k1 = (float)calib_D_data[1];
+	float k2 = (float)calib_D_data[2], k3 = (float)calib_D_data[3];
+
+	for(size_t i = 0; i < count; i++)
+	{
+		// compensate distortion iteratively
+		float x0 = (x[i] - cx)*ifx, y0 = (y[i] - cy)*ify, xi = x0, yi = y0;
+		for(int j = 0; j < 5; j++){
+			float r2 = xi*xi + yi*yi;
+			float icdist = 1.f/(1 + k0*r2 + k1*r2*r2);
+			float delta_x = 2*k2*xi*yi + k3*(r2 + 2*xi*xi);
+			float delta_y = k2*(r2 + 2*yi*yi) + 2*k3*xi*yi;
+			xi = (x0 - delta_x)*icdist;
+			yi = (y0 - delta_y)*icdist;
+		}
+		// apply compensation
+		x[i] = xi*fx + cx;
+		y[i] = yi*fy + cy;
+	}
+}
+
 /*
 	template<class PointType>
 	void Undistort(PointType& point) {
@@ -544,6 +606,13 @@ void Camera::Undistort(CvPoint2D32f& point)
 
 void Camera::Distort(vector<PointDouble>& points)
 {
+	if (!points.empty()) Distort(&points[0], points.size());
+}
+
+void Camera::Distort(PointDouble *points, size_t count)
+{
+	if (!IsDistorted()) return;
+
 	double u0 = cvmGet(&calib_K, 0, 2), v0 = cvmGet(&calib_K, 1, 2); // cx, cy
 	double fx = cvmGet(&calib_K, 0, 0), fy = cvmGet(&calib_K, 1, 1);
 	double _fx = 1./fx, _fy = 1./fy;
@@ -552,7 +621,7 @@ void Camera::Distort(vector<PointDouble>& points)
 	double k1 = k[0], k2 = k[1];
 	double p1 = k[2], p2 = k[3];
 
-	for(unsigned int i = 0; i < points.size(); i++)
+	for(size_t i = 0; i < count; i++)
 	{
 		// Distort
 		double y = (points[i].y - v0)*_fy;
@@ -571,8 +640,36 @@ void Camera::Distort(vector<PointDouble>& points)
 	}
 }
 
+void Camera::Distort(float *x, float *y, size_t count)
+{
+	if (!IsDistorted()) return;
+
+	float u0 = (float)cvmGet(&calib_K, 0, 2), v0 = (float)cvmGet(&calib_K, 1, 2); // cx, cy
+	float fx = (float)cvmGet(&calib_K, 0, 0), fy = (float)cvmGet(&calib_K, 1, 1);
+	float _fx = 1.f/fx, _fy = 1.f/fy;
+
+	float k1 = (float)calib_D_data[0], k2 = (float)calib_D_data[1];
+	float p1 = (float)calib_D_data[2], p2 = (float)calib_D_data[3];
+
+	for(size_t i = 0; i < count; i++)
+	{
+		// Distort
+		float yn = (y[i] - v0)*_fy;
+		float y2 = yn*yn;
+		float xn = (x[i] - u0)*_fx;
+		float x2 = xn*xn;
+		float r2 = x2 + y2;
+		float d = 1 + (k1 + k2*r2)*r2;
+
+		x[i] = fx*(xn*(d + 2*p1*yn) + p2*y2 + (3*p2)*x2) + u0;
+		y[i] = fy*(yn*(d + (2*p2)*xn) + 3*p1*y2 + p1*x2) + v0;
+	}
+}
+
 void Camera::Distort(PointDouble & point)
 {
+	if (!IsDistorted()) return;
+
 	double u0 = cvmGet(&calib_K, 0, 2), v0 = cvmGet(&calib_K, 1, 2); // cx, cy
 	double fx = cvmGet(&calib_K, 0, 0), fy = cvmGet(&calib_K, 1, 1);
 	double _fx = 1./fx, _fy = 1./fy;
@@ -599,6 +696,8 @@ void Camera::Distort(PointDouble & point)
 
 void Camera::Distort(CvPoint2D32f & point)
 {
+	if (!IsDistorted()) return;
+
 	double u0 = cvmGet(&calib_K, 0, 2), v0 = cvmGet(&calib_K, 1, 2); // cx, cy
 	double fx = cvmGet(&calib_K, 0, 0), fy = cvmGet(&calib_K, 1, 1);
 	double _fx = 1./fx, _fy = 1./fy;
@@ -647,15 +746,270 @@ void Camera::CalcExteriorOrientation(vector<CvPoint3D64f>& pw, vector<CvPoint2D6
 	cvReleaseMat(&image_points);
 }
 
+// Rotation matrix (row-major) of the rotation vector r
+static void RotationVectorToMatrix(const double r[3], double R[9])
+{
+	double theta = sqrt(r[0]*r[0] + r[1]*r[1] + r[2]*r[2]);
+	if (theta < DBL_EPSILON) {
+		for (int i = 0; i < 9; i++) R[i] = (i%4 == 0 ? 1 : 0);
+		return;
+	}
+	double x = r[0]/theta, y = r[1]/theta, z = r[2]/theta;
+	double c = cos(theta), s = sin(theta), c1 = 1 - c;
+	R[0] = c + c1*x*x;   R[1] = c1*x*y - s*z; R[2] = c1*x*z + s*y;
+	R[3] = c1*x*y + s*z; R[4] = c + c1*y*y;   R[5] = c1*y*z - s*x;
+	R[6] = c1*x*z - s*y; R[7] = c1*y*z + s*x; R[8] = c + c1*z*z;
+}
+
+// Rotation vector of the orthonormal rotation matrix R, as cvRodrigues2
+static void RotationMatrixToVector(const double R[9], double r[3])
+{
+	double rx = R[7] - R[5];
+	double ry = R[2] - R[6];
+	double rz = R[3] - R[1];
+	double s = sqrt((rx*rx + ry*ry + rz*rz)*0.25);
+	double c = (R[0] + R[4] + R[8] - 1)*0.5;
+	c = (c > 1. ? 1. : (c < -1. ? -1. : c));
+	double theta = acos(c);
+	if (s < 1e-5) {
+		if (c > 0) {
+			rx = ry = rz = 0;
+		} else {
+			rx = sqrt(max((R[0] + 1)*0.5, 0.));
+			ry = sqrt(max((R[4] + 1)*0.5, 0.))*(R[1] < 0 ? -1. : 1.);
+			rz = sqrt(max((R[8] + 1)*0.5, 0.))*(R[2] < 0 ? -1. : 1.);
+			if ((fabs(rx) < fabs(ry)) && (fabs(rx) < fabs(rz)) && ((R[5] > 0) != (ry*rz > 0)))
+				rz = -rz;
+			theta /= sqrt(rx*rx + ry*ry + rz*rz);
+			rx *= theta; ry *= theta; rz *= theta;
+		}
+	} else {
+		double vth = theta/(2*s);
+		rx *= vth; ry *= vth; rz *= vth;
+	}
+	r[0] = rx; r[1] = ry; r[2] = rz;
+}
+
+// Solves A*x = b for a symmetric positive definite n x n A (row-major) using
+// Cholesky. A is overwritten with the factor and b with the solution.
+static bool SolveCholesky(double *A, double *b, int n)
+{
+	for (int j = 0; j < n; j++) {
+		double d = A[j*n+j];
+		for (int k = 0; k < j; k++) d -= A[j*n+k]*A[j*n+k];
+		if (!(d > 0)) return false;
+		d = sqrt(d);
+		A[j*n+j] = d;
+		for (int i = j+1; i < n; i++) {
+			double sum = A[i*n+j];
+			for (int k = 0; k < j; k++) sum -= A[i*n+k]*A[j*n+k];
+			A[i*n+j] = sum/d;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		double sum = b[i];
+		for (int k = 0; k < i; k++) sum -= A[i*n+k]*b[k];
+		b[i] = sum/A[i*n+i];
+	}
+	for (int i = n-1; i >= 0; i--) {
+		double sum = b[i];
+		for (int k = i+1; k < n; k++) sum -= A[k*n+i]*b[k];
+		b[i] = sum/A[i*n+i];
+	}
+	return true;
+}
+
+// Projects the point (X, Y, 0) with the pose R, t like cvProjectPoints2 (fx, fy,
+// cx, cy and the distortion k1, k2, p1, p2). When J is given, the 2x6 Jacobian
+// (row-major) of the image point with respect to a small rotation applied on
+// the left of R and to t is written in it.
+static void ProjectPlanarPoint(const double K[3][3], const double k[4], const double R[9], const double t[3],
+                               double X, double Y, double *u, double *v, double *J)
+{
+	double q[3] = { R[0]*X + R[1]*Y, R[3]*X + R[4]*Y, R[6]*X + R[7]*Y };
+	double iz = 1./(q[2] + t[2]);
+	double x = (q[0] + t[0])*iz, y = (q[1] + t[1])*iz;
+	double r2 = x*x + y*y;
+	double d = 1 + (k[0] + k[1]*r2)*r2;
+	double xd = x*d + 2*k[2]*x*y + k[3]*(r2 + 2*x*x);
+	double yd = y*d + k[2]*(r2 + 2*y*y) + 2*k[3]*x*y;
+	*u = K[0][0]*xd + K[0][2];
+	*v = K[1][1]*yd + K[1][2];
+	if (!J) return;
+
+	// Image point with respect to the camera coordinates
+	double dd = 2*(k[0] + 2*k[1]*r2);
+	double dxd_dx = d + dd*x*x + 2*k[2]*y + 6*k[3]*x;
+	double dxd_dy = dd*x*y + 2*k[2]*x + 2*k[3]*y;
+	double dyd_dx = dd*x*y + 2*k[2]*x + 2*k[3]*y;
+	double dyd_dy = d + dd*y*y + 6*k[2]*y + 2*k[3]*x;
+	double A[2][3] = {
+		{ K[0][0]*dxd_dx*iz, K[0][0]*dxd_dy*iz, -K[0][0]*(dxd_dx*x + dxd_dy*y)*iz },
+		{ K[1][1]*dyd_dx*iz, K[1][1]*dyd_dy*iz, -K[1][1]*(dyd_dx*x + dyd_dy*y)*iz }
+	};
+	// The camera coordinates move by w x q for a small rotation w, and by the step of t
+	for (int m = 0; m < 2; m++) {
+		double *j = J + 6*m;
+		j[0] = A[m][2]*q[1] - A[m][1]*q[2];
+		j[1] = A[m][0]*q[2] - A[m][2]*q[0];
+		j[2] = A[m][1]*q[0] - A[m][0]*q[1];
+		j[3] = A[m][0];
+		j[4] = A[m][1];
+		j[5] = A[m][2];
+	}
+}
+
+// Sum of the squared reprojection errors of the points pw (z = 0) against pi.
+// When JtJ is given, the normal equations J'J and J'e of a pose step are
+// accumulated into JtJ and Jte.
+static double PlanarReprojectionError(const double K[3][3], const double k[4], const PointDouble *pw, const PointDouble *pi,
+                                      int n, const double R[9], const double t[3], double JtJ[36], double Jte[6])
+{
+	if (JtJ) {
+		for (int i = 0; i < 36; i++) JtJ[i] = 0;
+		for (int i = 0; i < 6; i++) Jte[i] = 0;
+	}
+	double error = 0;
+	for (int i = 0; i < n; i++) {
+		double u, v, J[12];
+		ProjectPlanarPoint(K, k, R, t, pw[i].x, pw[i].y, &u, &v, JtJ ? J : NULL);
+		double e[2] = { pi[i].x - u, pi[i].y - v };
+		error += e[0]*e[0] + e[1]*e[1];
+		if (!JtJ) continue;
+		for (int m = 0; m < 2; m++) {
+			const double *j = J + 6*m;
+			for (int r = 0; r < 6; r++) {
+				Jte[r] += j[r]*e[m];
+				for (int c = 0; c < 6; c++) JtJ[r*6+c] += j[r]*j[c];
+			}
+		}
+	}
+	return error;
+}
+
+// Pose of the four points pw on the plane z = 0 seen at pi, found the way
+// cvFindExtrinsicCameraParams2 does it for a planar object: an initial pose
+// from the homography of the undistorted normalized image points, refined by
+// Levenberg-Marquardt on the reprojection error (at most 20 iterations, lambda
+// scaling the diagonal). Everything is on the stack. Returns false when the
+// homography gives no usable pose.
+static bool FindPlanarPose(const double K[3][3], const double k[4], const PointDouble *pw, const PointDouble *pi,
+                           double R[9], double t[3])
+{
+	const int n = 4;
+
+	// Undistorted normalized image points, as cvUndistortPoints
+	PointDouble mn[n], centered[n];
+	double mx = 0, my = 0;
+	for (int i = 0; i < n; i++) {
+		double x0 = (pi[i].x - K[0][2])/K[0][0], y0 = (pi[i].y - K[1][2])/K[1][1];
+		double x = x0, y = y0;
+		for (int j = 0; j < 5; j++) {
+			double r2 = x*x + y*y;
+			double icdist = 1./(1 + k[0]*r2 + k[1]*r2*r2);
+			double delta_x = 2*k[2]*x*y + k[3]*(r2 + 2*x*x);
+			double delta_y = k[2]*(r2 + 2*y*y) + 2*k[3]*x*y;
+			x = (x0 - delta_x)*icdist;
+			y = (y0 - delta_y)*icdist;
+		}
+		mn[i].x = x;
+		mn[i].y = y;
+		mx += pw[i].x;
+		my += pw[i].y;
+	}
+	mx /= n;
+	my /= n;
+	for (int i = 0; i < n; i++) {
+		centered[i].x = pw[i].x - mx;
+		centered[i].y = pw[i].y - my;
+	}
+
+	// The homography columns are the first two rotation columns and the
+	// translation, up to scale
+	Homography H;
+	H.Find(centered, mn, n);
+	double h1[3] = { H.H_data[0][0], H.H_data[1][0], H.H_data[2][0] };
+	double h2[3] = { H.H_data[0][1], H.H_data[1][1], H.H_data[2][1] };
+	double n1 = sqrt(h1[0]*h1[0] + h1[1]*h1[1] + h1[2]*h1[2]);
+	double n2 = sqrt(h2[0]*h2[0] + h2[1]*h2[1] + h2[2]*h2[2]);
+	if (!(n1 > 0) || !(n2 > 0)) return false;
+	double scale = sqrt(n1*n2);
+	double tc[3] = { H.H_data[0][2]/scale, H.H_data[1][2]/scale, H.H_data[2][2]/scale };
+	if (!(tc[2] > 0)) return false;
+
+	// The orthonormal pair nearest to the normalized columns
+	double a[3], b[3];
+	for (int j = 0; j < 3; j++) {
+		a[j] = h1[j]/n1 + h2[j]/n2;
+		b[j] = h1[j]/n1 - h2[j]/n2;
+	}
+	double na = sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
+	double nb = sqrt(b[0]*b[0] + b[1]*b[1] + b[2]*b[2]);
+	if (!(na > 0) || !(nb > 0)) return false;
+	double r1[3], r2[3];
+	for (int j = 0; j < 3; j++) {
+		r1[j] = (a[j]/na + b[j]/nb)/sqrt(2.0);
+		r2[j] = (a[j]/na - b[j]/nb)/sqrt(2.0);
+	}
+	R[0] = r1[0]; R[1] = r2[0]; R[2] = r1[1]*r2[2] - r1[2]*r2[1];
+	R[3] = r1[1]; R[4] = r2[1]; R[5] = r1[2]*r2[0] - r1[0]*r2[2];
+	R[6] = r1[2]; R[7] = r2[2]; R[8] = r1[0]*r2[1] - r1[1]*r2[0];
+	for (int j = 0; j < 3; j++) t[j] = tc[j] - (R[j*3+0]*mx + R[j*3+1]*my);
+
+	// Levenberg-Marquardt; the rotation is updated by a small rotation on the left
+	double JtJ[36], Jte[6];
+	double lambda = 1e-3;
+	double error = PlanarReprojectionError(K, k, pw, pi, n, R, t, JtJ, Jte);
+	for (int iter = 0; iter < 20; iter++) {
+		double delta[6], R_new[9], t_new[3];
+		bool improved = false;
+		for (; lambda <= 1e16; lambda *= 10) {
+			double A[36];
+			for (int i = 0; i < 36; i++) A[i] = JtJ[i];
+			for (int i = 0; i < 6; i++) {
+				A[i*7] *= 1 + lambda;
+				delta[i] = Jte[i];
+			}
+			if (!SolveCholesky(A, delta, 6)) continue;
+			double dR[9];
+			RotationVectorToMatrix(delta, dR);
+			for (int r = 0; r < 3; r++) {
+				for (int c = 0; c < 3; c++) {
+					R_new[r*3+c] = dR[r*3+0]*R[0*3+c] + dR[r*3+1]*R[1*3+c] + dR[r*3+2]*R[2*3+c];
+				}
+				t_new[r] = t[r] + delta[3+r];
+			}
+			if (PlanarReprojectionError(K, k, pw, pi, n, R_new, t_new, NULL, NULL) <= error) {
+				improved = true;
+				break;
+			}
+		}
+		if (!improved) break;
+		lambda = max(lambda/10, 1e-16);
+		for (int i = 0; i < 9; i++) R[i] = R_new[i];
+		for (int i = 0; i < 3; i++) t[i] = t_new[i];
+
+		double step = 0, size = 0;
+		for (int i = 0; i < 6; i++) step += delta[i]*delta[i];
+		double c = (R[0] + R[4] + R[8] - 1)*0.5;
+		double angle = acos(c > 1. ? 1. : (c < -1. ? -1. : c));
+		size = angle*angle + t[0]*t[0] + t[1]*t[1] + t[2]*t[2];
+		if (step < FLT_EPSILON*FLT_EPSILON*size) break;
+		error = PlanarReprojectionError(K, k, pw, pi, n, R, t, JtJ, Jte);
+	}
+	return true;
+}
+
 void Camera::CalcExteriorOrientation(vector<CvPoint3D64f>& pw, vector<PointDouble >& pi,
-					CvMat *rodriques, CvMat *tra)
+					CvMat *rodriques, CvMat *tra, FrameArena *arena)
 {
 	//assert(pw.size() == pi.size());
 
 	int size = (int)pi.size();
 
-	CvPoint3D64f *world_pts = new CvPoint3D64f[size];
-	CvPoint2D64f *image_pts = new CvPoint2D64f[size];
+	FrameArenaScope scope(arena);
+	CvPoint3D64f *world_pts = scope.Allocate<CvPoint3D64f>(size);
+	CvPoint2D64f *image_pts = scope.Allocate<CvPoint2D64f>(size);
 
 	for(int i = 0; i < size; i++){
 		world_pts[i].x = pw[i].x;
@@ -676,42 +1030,63 @@ void Camera::CalcExteriorOrientation(vector<CvPoint3D64f>& pw, vector<PointDoubl
 
 	cvZero(tra);
 	//cvmodFindExtrinsicCameraParams2(&world_mat, &image_mat, &calib_K, &calib_D, rodriques, tra, error);
-	cvFindExtrinsicCameraParams2(&world_mat, &image_mat, &calib_K, &calib_D, rodriques, tra);
-
-	delete[] world_pts;
-	delete[] image_pts;
+	cvFindExtrinsicCameraParams2(&world_mat, &image_mat, &calib_K, Distortion(), rodriques, tra);
 }
 
-void Camera::CalcExteriorOrientation(vector<PointDouble >& pw, vector<PointDouble >& pi,
-					CvMat *rodriques, CvMat *tra)
+void Camera::CalcExteriorOrientation(const vector<PointDouble >& pw, const vector<PointDouble >& pi,
+					CvMat *rodriques, CvMat *tra, FrameArena *arena)
 {
 	//assert(pw.size() == pi.size());
 	int size = (int)pi.size();
 
-	vector<CvPoint3D64f> pw3;
-	pw3.resize(size);
+	// The four corners of a marker are solved here, since
+	// cvFindExtrinsicCameraParams2 allocates its work matrices on every call
+	if (size == 4) {
+		static const double no_distortion[4] = { 0, 0, 0, 0 };
+		double R[9], t[3], r[3];
+		if (FindPlanarPose(calib_K_data, IsDistorted() ? calib_D_data : no_distortion, &pw[0], &pi[0], R, t)) {
+			RotationMatrixToVector(R, r);
+			for (int i=0; i<3; i++) {
+				cvSetReal1D(rodriques, i, r[i]);
+				cvSetReal1D(tra, i, t[i]);
+			}
+			return;
+		}
+	}
+
+	FrameArenaScope scope(arena);
+	CvPoint3D64f *world_pts = scope.Allocate<CvPoint3D64f>(size);
+	CvPoint2D64f *image_pts = scope.Allocate<CvPoint2D64f>(size);
+
 	for (int i=0; i<size; i++) {
-		pw3[i].x = pw[i].x;
-		pw3[i].y = pw[i].y;
-		pw3[i].z = 0;
+		world_pts[i].x = pw[i].x;
+		world_pts[i].y = pw[i].y;
+		world_pts[i].z = 0;
+		image_pts[i].x = pi[i].x;
+		image_pts[i].y = pi[i].y;
 	}
 
-	CalcExteriorOrientation(pw3, pi, rodriques, tra);
+	CvMat world_mat, image_mat;
+	cvInitMatHeader(&world_mat, size, 1, CV_64FC3, world_pts);
+	cvInitMatHeader(&image_mat, size, 1, CV_64FC2, image_pts);
+
+	cvZero(tra);
+	cvFindExtrinsicCameraParams2(&world_mat, &image_mat, &calib_K, Distortion(), rodriques, tra);
 }
 
-void Camera::CalcExteriorOrientation(vector<PointDouble>& pw, vector<PointDouble >& pi, Pose *pose)
+void Camera::CalcExteriorOrientation(const vector<PointDouble>& pw, const vector<PointDouble >& pi, Pose *pose, FrameArena *arena)
 {
 	double ext_rodriques[3];
 	double ext_translate[3];
 	CvMat ext_rodriques_mat = cvMat(3, 1, CV_64F, ext_rodriques);
 	CvMat ext_translate_mat = cvMat(3, 1, CV_64F, ext_translate);
-	CalcExteriorOrientation(pw, pi, &ext_rodriques_mat, &ext_translate_mat);
+	CalcExteriorOrientation(pw, pi, &ext_rodriques_mat, &ext_translate_mat, arena);
 	pose->SetRodriques(&ext_rodriques_mat);
 	pose->SetTranslation(&ext_translate_mat);
 }
 
 bool Camera::CalcExteriorOrientation(const CvMat* object_points, CvMat* image_points, CvMat *rodriques, CvMat *tra) {
-	cvFindExtrinsicCameraParams2(object_points, image_points, &calib_K, &calib_D, rodriques, tra);
+	cvFindExtrinsicCameraParams2(object_points, image_points, &calib_K, Distortion(), rodriques, tra);
 	return true;
 }
 
@@ -740,7 +1115,7 @@ void Camera::ProjectPoints(vector<CvPoint3D64f>& pw, Pose *pose, vector<CvPoint2
 		object_points->data.fl[i*3+1] = (float)pw[i].y;
 		object_points->data.fl[i*3+2] = (float)pw[i].z;
 	}
-	cvProjectPoints2(object_points, &ext_rodriques_mat, &ext_translate_mat, &calib_K, &calib_D, image_points);
+	cvProjectPoints2(object_points, &ext_rodriques_mat, &ext_translate_mat, &calib_K, Distortion(), image_points);
 	for (size_t i=0; i<pw.size(); i++) {
 		pi[i].x = image_points->data.fl[i*2+0];
 		pi[i].y = image_points->data.fl[i*2+1];
@@ -753,7 +1128,7 @@ void Camera::ProjectPoints(const CvMat* object_points, const CvMat* rotation_vec
 				   const CvMat* translation_vector, CvMat* image_points) const
 {
 	// Project points
-	cvProjectPoints2(object_points, rotation_vector, translation_vector, &calib_K, &calib_D, image_points);
+	cvProjectPoints2(object_points, rotation_vector, translation_vector, &calib_K, Distortion(), image_points);
 }
 
 void Camera::ProjectPoints(const CvMat* object_points, const Pose* pose, CvMat* image_points) const
@@ -764,7 +1139,7 @@ void Camera::ProjectPoints(const CvMat* object_points, const Pose* pose, CvMat*
 	CvMat ext_translate_mat = cvMat(3, 1, CV_64F, ext_translate);
 	pose->GetRodriques(&ext_rodriques_mat);
 	pose->GetTranslation(&ext_translate_mat);
-	cvProjectPoints2(object_points, &ext_rodriques_mat, &ext_translate_mat, &calib_K, &calib_D, image_points);
+	cvProjectPoints2(object_points, &ext_rodriques_mat, &ext_translate_mat, &calib_K, Distortion(), image_points);
 }
 
 void Camera::ProjectPoints(const CvMat* object_points, double gl[16], CvMat* image_points) const
@@ -825,10 +1200,104 @@ Homography::Homography() {
 void Homography::Find(const vector<PointDouble  >& pw, const vector<PointDouble  >& pi)
 {
 	assert(pw.size() == pi.size());
-	int size = (int)pi.size();
+	if (pi.empty()) return;
+	Find(&pw[0], &pi[0], (int)pi.size());
+}
+
+// Normalizes the points to zero mean and unit average distance and returns
+// the similarity transform that was applied
+static void NormalizePoints(const PointDouble *p, double (*np)[2], int size, double T[3][3])
+{
+	double cx = 0, cy = 0, dist = 0;
+	for (int i = 0; i < size; ++i) {
+		cx += p[i].x;
+		cy += p[i].y;
+	}
+	cx /= size;
+	cy /= size;
+	for (int i = 0; i < size; ++i) {
+		dist += sqrt((p[i].x-cx)*(p[i].x-cx) + (p[i].y-cy)*(p[i].y-cy));
+	}
+	dist /= size;
+	double scale = (dist > 0 ? sqrt(2.0)/dist : 1.0);
+	for (int i = 0; i < size; ++i) {
+		np[i][0] = (p[i].x-cx)*scale;
+		np[i][1] = (p[i].y-cy)*scale;
+	}
+	T[0][0] = scale; T[0][1] = 0;     T[0][2] = -cx*scale;
+	T[1][0] = 0;     T[1][1] = scale; T[1][2] = -cy*scale;
+	T[2][0] = 0;     T[2][1] = 0;     T[2][2] = 1;
+}
 
-	CvPoint2D64f *srcp = new CvPoint2D64f[size];
-	CvPoint2D64f *dstp = new CvPoint2D64f[size];
+void Homography::Find(const PointDouble *pw, const PointDouble *pi, int size)
+{
+	if (size == 4) {
+		// The four point case has an exact solution: solve the 8x8 linear
+		// system of the normalized correspondences with h33 fixed to one
+		double src[4][2], dst[4][2], Ts[3][3], Td[3][3];
+		NormalizePoints(pw, src, 4, Ts);
+		NormalizePoints(pi, dst, 4, Td);
+		double A[8][9];
+		for (int i = 0; i < 4; ++i) {
+			double x = src[i][0], y = src[i][1], u = dst[i][0], v = dst[i][1];
+			double r0[9] = { x, y, 1, 0, 0, 0, -u*x, -u*y, u };
+			double r1[9] = { 0, 0, 0, x, y, 1, -v*x, -v*y, v };
+			for (int k = 0; k < 9; ++k) {
+				A[2*i][k] = r0[k];
+				A[2*i+1][k] = r1[k];
+			}
+		}
+		// Gaussian elimination with partial pivoting
+		bool singular = false;
+		for (int c = 0; c < 8; ++c) {
+			int pivot = c;
+			for (int r = c+1; r < 8; ++r) {
+				if (fabs(A[r][c]) > fabs(A[pivot][c])) pivot = r;
+			}
+			if (fabs(A[pivot][c]) < 1e-12) { singular = true; break; }
+			if (pivot != c) {
+				for (int k = c; k < 9; ++k) std::swap(A[c][k], A[pivot][k]);
+			}
+			for (int r = c+1; r < 8; ++r) {
+				double f = A[r][c]/A[c][c];
+				for (int k = c; k < 9; ++k) A[r][k] -= f*A[c][k];
+			}
+		}
+		if (!singular) {
+			double h[9];
+			h[8] = 1;
+			for (int r = 7; r >= 0; --r) {
+				double sum = A[r][8];
+				for (int k = r+1; k < 8; ++k) sum -= A[r][k]*h[k];
+				h[r] = sum/A[r][r];
+			}
+			// H = inv(Td) * Hn * Ts
+			double Hn[3][3] = { { h[0], h[1], h[2] }, { h[3], h[4], h[5] }, { h[6], h[7], h[8] } };
+			double HTs[3][3];
+			for (int r = 0; r < 3; ++r) {
+				for (int c = 0; c < 3; ++c) {
+					HTs[r][c] = Hn[r][0]*Ts[0][c] + Hn[r][1]*Ts[1][c] + Hn[r][2]*Ts[2][c];
+				}
+			}
+			double iTd[3][3] = { { 1/Td[0][0], 0, -Td[0][2]/Td[0][0] },
+			                     { 0, 1/Td[1][1], -Td[1][2]/Td[1][1] },
+			                     { 0, 0, 1 } };
+			for (int r = 0; r < 3; ++r) {
+				for (int c = 0; c < 3; ++c) {
+					H_data[r][c] = iTd[r][0]*HTs[0][c] + iTd[r][1]*HTs[1][c] + iTd[r][2]*HTs[2][c];
+				}
+			}
+			double scale = 1.0/H_data[2][2];
+			for (int r = 0; r < 3; ++r) {
+				for (int c = 0; c < 3; ++c) H_data[r][c] *= scale;
+			}
+			return;
+		}
+	}
+
+	FrameArenaScope scope(NULL);
+	CvPoint2D64f *srcp = scope.Allocate<CvPoint2D64f>(size);
+	CvPoint2D64f *dstp = scope.Allocate<CvPoint2D64f>(size);
 
 	for(int i = 0; i < size; ++i){
 		srcp[i].x = pw[i].x;
@@ -847,43 +1316,36 @@ void Homography::Find(const vector<PointDouble  >& pw, const vector<PointDouble
 #else
 	cvFindHomography(&src_pts, &dst_pts, &H);
 #endif
-
-	delete[] srcp;
-	delete[] dstp;
 }
 
 void Homography::ProjectPoints(const vector<PointDouble>& from, vector<PointDouble>& to)
 {
-	int size = (int)from.size();
-
-	CvPoint3D64f *srcp = new CvPoint3D64f[size];
+	to.resize(from.size());
+	if (!from.empty()) ProjectPoints(&from[0], &to[0], from.size());
+}
 
-	for(int i = 0; i < size; ++i){
-		srcp[i].x = from[i].x;
-		srcp[i].y = from[i].y;
-		srcp[i].z = 1;
+void Homography::ProjectPoints(const PointDouble *from, PointDouble *to, size_t count)
+{
+	for(size_t i = 0; i < count; ++i)
+	{
+		double x = H_data[0][0]*from[i].x + H_data[0][1]*from[i].y + H_data[0][2];
+		double y = H_data[1][0]*from[i].x + H_data[1][1]*from[i].y + H_data[1][2];
+		double z = H_data[2][0]*from[i].x + H_data[2][1]*from[i].y + H_data[2][2];
+		to[i].x = x / z;
+		to[i].y = y / z;
 	}
+}
 
-	CvPoint3D64f *dstp = new CvPoint3D64f[size];
-
-	CvMat src_pts, dst_pts;
-	cvInitMatHeader(&src_pts, 1, size, CV_64FC3, srcp);
-	cvInitMatHeader(&dst_pts, 1, size, CV_64FC3, dstp);
-
-	cvTransform(&src_pts, &dst_pts, &H);
-
-	to.clear();
-	for(int i = 0; i < size; ++i)
+void Homography::ProjectPoints(const PointDouble *from, float *to_x, float *to_y, size_t count)
+{
+	for(size_t i = 0; i < count; ++i)
 	{
-		PointDouble pt;
-		pt.x = dstp[i].x / dstp[i].z;
-		pt.y = dstp[i].y / dstp[i].z;
-
-		to.push_back(pt);
+		double x = H_data[0][0]*from[i].x + H_data[0][1]*from[i].y + H_data[0][2];
+		double y = H_data[1][0]*from[i].x + H_data[1][1]*from[i].y + H_data[1][2];
+		double z = H_data[2][0]*from[i].x + H_data[2][1]*from[i].y + H_data[2][2];
+		to_x[i] = float(x / z);
+		to_y[i] = float(y / z);
 	}
-
-	delete[] srcp;
-	delete[] dstp;
 }
 
 } // namespace alvar
@@ -24,6 +24,8 @@
 #include "ar_track_alvar/ConnectedComponents.h"
 #include "ar_track_alvar/Draw.h"
 #include <cassert>
+#include <algorithm>
+#include <cstring>
 
 using namespace std;
 
@@ -35,13 +37,20 @@ Labeling::Labeling()
 	gray = 0;
 	bw	 = 0;
 	cam  = 0;
+	arena = 0;
+	image_cache = 0;
+	gray_shared = false;
 	thresh_param1 = 31;
 	thresh_param2 = 5;
+	source = 0;
+	converted_rows = 0;
+	thresholded_rows = 0;
+	SetCascadeParams();
 }
 
 Labeling::~Labeling()
 {
-	if(gray)
+	if(gray && !gray_shared)
 		cvReleaseImage(&gray);
 	if(bw)
 		cvReleaseImage(&bw);
@@ -58,117 +67,466 @@ bool Labeling::CheckBorder(CvSeq* contour, int width, int height)
 	return ret;
 }
 
-LabelingCvSeq::LabelingCvSeq() : _n_blobs(0), _min_edge(20), _min_area(25)
+// Gray level at the nearest pixel, clamped to the image
+static inline int SampleGray(const IplImage *gray, double x, double y)
 {
-	SetOptions();
-	storage = cvCreateMemStorage(0);
+	int xi = int(x+0.5), yi = int(y+0.5);
+	if (xi < 0) xi = 0; else if (xi >= gray->width) xi = gray->width-1;
+	if (yi < 0) yi = 0; else if (yi >= gray->height) yi = gray->height-1;
+	return ((const unsigned char *)(gray->imageData + yi*gray->widthStep))[xi];
 }
 
-LabelingCvSeq::~LabelingCvSeq()
+bool Labeling::CheckShape(const CvPoint *quad) const
 {
-	if(storage)
-		cvReleaseMemStorage(&storage);
+	double side[4];
+	for (int j = 0; j < 4; ++j) {
+		double dx = quad[(j+1)%4].x - quad[j].x;
+		double dy = quad[(j+1)%4].y - quad[j].y;
+		side[j] = sqrt(dx*dx + dy*dy);
+		if (side[j] < 1.0) return false;
+	}
+	double shortest = *min_element(side, side+4);
+	double longest = *max_element(side, side+4);
+	if (longest > shortest*cascade_max_side_ratio) return false;
+
+	// Interior angles between 15 and 165 degrees
+	const double max_cos = 0.966;
+	for (int j = 0; j < 4; ++j) {
+		const CvPoint &prev = quad[(j+3)%4];
+		const CvPoint &next = quad[(j+1)%4];
+		double ax = prev.x - quad[j].x, ay = prev.y - quad[j].y;
+		double bx = next.x - quad[j].x, by = next.y - quad[j].y;
+		double c = (ax*bx + ay*by) / (side[(j+3)%4]*side[j]);
+		if (fabs(c) > max_cos) return false;
+	}
+	return true;
 }
 
-void LabelingCvSeq::SetOptions(bool _detect_pose_grayscale) {
-    detect_pose_grayscale = _detect_pose_grayscale;
+bool Labeling::CheckEdgeContrast(const CvPoint *quad, double *outside_mean) const
+{
+	double cx = 0, cy = 0;
+	for (int j = 0; j < 4; ++j) { cx += quad[j].x; cy += quad[j].y; }
+	cx /= 4; cy /= 4;
+
+	int passed = 0;
+	int outside_sum = 0;
+	for (int j = 0; j < 4; ++j) {
+		const CvPoint &p0 = quad[j];
+		const CvPoint &p1 = quad[(j+1)%4];
+		double ex = p1.x - p0.x, ey = p1.y - p0.y;
+		double len = sqrt(ex*ex + ey*ey);
+		// Outward unit normal of the edge
+		double nx = -ey/len, ny = ex/len;
+		if (nx*((p0.x+p1.x)/2.0-cx) + ny*((p0.y+p1.y)/2.0-cy) < 0) { nx = -nx; ny = -ny; }
+		double d = max(1.5, len*0.04);
+
+		// Three samples along the edge on both sides
+		int inside = 0, outside = 0;
+		for (int t = 1; t <= 3; ++t) {
+			double x = p0.x + ex*t/4.0, y = p0.y + ey*t/4.0;
+			inside += SampleGray(gray, x - nx*d, y - ny*d);
+			outside += SampleGray(gray, x + nx*d, y + ny*d);
+		}
+		if (outside - inside >= 3*cascade_min_contrast) passed++;
+		outside_sum += outside;
+	}
+	*outside_mean = outside_sum / 12.0;
+	return passed >= 3;
 }
 
-void LabelingCvSeq::LabelSquares(IplImage* image, bool visualize)
+bool Labeling::CheckBorderDarkness(const CvPoint *quad, double outside_mean) const
+{
+	double cx = 0, cy = 0;
+	for (int j = 0; j < 4; ++j) { cx += quad[j].x; cy += quad[j].y; }
+	cx /= 4; cy /= 4;
+
+	// The corners of the border, a little towards the center from the vertices
+	int corner_sum = 0;
+	for (int j = 0; j < 4; ++j) {
+		corner_sum += SampleGray(gray, quad[j].x + (cx-quad[j].x)*0.05,
+		                               quad[j].y + (cy-quad[j].y)*0.05);
+	}
+	return corner_sum/4.0 + cascade_min_contrast <= outside_mean;
+}
+
+// Douglas-Peucker split of the contour arc from..to (indices wrap around). The
+// vertices found are appended to 'vertices' in contour order; fails when more
+// than four vertices would be needed.
+static bool SplitArc(const CvPoint *points, int count, int from, int to, double eps, int *vertices, int &n)
+{
+	const CvPoint &a = points[from];
+	double ex = points[to].x - a.x, ey = points[to].y - a.y;
+	double len = sqrt(ex*ex + ey*ey);
+	int arc = (to - from + count) % count;
+	int best = -1;
+	double best_dist = eps;
+	for (int k = 1; k < arc; ++k) {
+		int i = (from + k) % count;
+		double px = points[i].x - a.x, py = points[i].y - a.y;
+		double dist = (len > 0 ? fabs(ex*py - ey*px)/len : sqrt(px*px + py*py));
+		if (dist > best_dist) {
+			best_dist = dist;
+			best = i;
+		}
+	}
+	if (best < 0) return true;
+	if (!SplitArc(points, count, from, best, eps, vertices, n)) return false;
+	if (n >= 4) return false;
+	vertices[n++] = best;
+	return SplitArc(points, count, best, to, eps, vertices, n);
+}
+
+// Index of the point farthest from 'p'
+static int FarthestPoint(const CvPoint *points, int count, const CvPoint &p)
+{
+	int best = 0, best_dist = -1;
+	for (int i = 0; i < count; ++i) {
+		int dx = points[i].x - p.x, dy = points[i].y - p.y;
+		if (dx*dx + dy*dy > best_dist) {
+			best_dist = dx*dx + dy*dy;
+			best = i;
+		}
+	}
+	return best;
+}
+
+bool Labeling::ApproxQuad(const CvPoint *points, int count, double eps, int corners[4]) const
 {
+	// The farthest points of a convex polygon are vertices
+	int a = FarthestPoint(points, count, points[0]);
+	int b = FarthestPoint(points, count, points[a]);
+	if (a == b) return false;
+
+	int n = 0;
+	corners[n++] = a;
+	if (!SplitArc(points, count, a, b, eps, corners, n)) return false;
+	if (n >= 4) return false;
+	corners[n++] = b;
+	if (!SplitArc(points, count, b, a, eps, corners, n)) return false;
+	return (n == 4);
+}
 
-    if (gray && ((gray->width != image->width) || (gray->height != image->height))) {
-        cvReleaseImage(&gray); gray=NULL;
-        if (bw) cvReleaseImage(&bw); bw=NULL;
+bool Labeling::AddQuadCandidate(size_t first, double perimeter, double min_area)
+{
+	QuadCandidate candidate;
+	candidate.first = (int)first;
+	candidate.count = (int)(contour_points.size() - first);
+	const CvPoint *points = &contour_points[first];
+
+	CvPoint quad[4];
+	bool ok = ApproxQuad(points, candidate.count, perimeter*0.035, candidate.corners); // TODO: Parameters?
+	if (ok) {
+		double area = 0;
+		int turns_left = 0, turns_right = 0;
+		for (int j = 0; j < 4; ++j) quad[j] = points[candidate.corners[j]];
+		for (int j = 0; j < 4; ++j) {
+			const CvPoint &p0 = quad[j], &p1 = quad[(j+1)%4], &p2 = quad[(j+2)%4];
+			if ((p0.x <= 1) || (p0.x >= gray->width-2) || (p0.y <= 1) || (p0.y >= gray->height-2)) ok = false;
+			area += p0.x*p1.y - p1.x*p0.y;
+			int turn = (p1.x-p0.x)*(p2.y-p1.y) - (p1.y-p0.y)*(p2.x-p1.x);
+			if (turn > 0) turns_left++;
+			if (turn < 0) turns_right++;
+		}
+		if (fabs(area/2) <= min_area) ok = false; // TODO check limits
+		if (turns_left && turns_right) ok = false;
+	}
+
+	if (ok) {
+		// Cheap checks in the order of their cost; only the survivors are fitted and decoded
+		cascade_stats.quads++;
+		double outside_mean = 0;
+		if (cascade_enabled && !CheckShape(quad)) {
+			cascade_stats.rejected_shape++;
+			ok = false;
+		} else if (cascade_enabled && !CheckEdgeContrast(quad, &outside_mean)) {
+			cascade_stats.rejected_contrast++;
+			ok = false;
+		} else if (cascade_enabled && !CheckBorderDarkness(quad, outside_mean)) {
+			cascade_stats.rejected_border++;
+			ok = false;
+		} else {
+			cascade_stats.accepted++;
+		}
+	}
+
+	if (!ok) {
+		contour_points.resize(first);
+		return false;
+	}
+	quads.push_back(candidate);
+	return true;
+}
+
+void Labeling::ThresholdImage(IplImage* image)
+{
+    BeginThreshold(image);
+    ThresholdRows(image->height);
+}
+
+void Labeling::BeginThreshold(IplImage* image)
+{
+    // The gray image is taken from the cache when it holds this frame
+    IplImage *cached_gray = NULL;
+    if (image_cache && (image_cache->GetImage() == image)) {
+        cached_gray = image_cache->GetGray();
     }
-    if (gray == NULL) {
+    if (gray_shared) {
+        gray = NULL; gray_shared = false;
+    }
+    if (bw && ((bw->width != image->width) || (bw->height != image->height))) {
+        if (gray) cvReleaseImage(&gray); gray=NULL;
+        cvReleaseImage(&bw); bw=NULL;
+    }
+    if (cached_gray) {
+        if (gray) cvReleaseImage(&gray);
+        gray = cached_gray;
+        gray_shared = true;
+    } else if (gray == NULL) {
         gray = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
         gray->origin = image->origin;
+    }
+    if (bw == NULL) {
         bw = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
         bw->origin = image->origin;
     }
+    if ((image->nChannels != 4) && (image->nChannels != 3) && (image->nChannels != 1)) {
+        cerr<<"Unsupported image format"<<endl;
+    }
+    source = image;
+    converted_rows = (gray_shared ? image->height : 0);
+    thresholded_rows = 0;
+}
 
-    // Convert grayscale and threshold
+// Converts rows [y0, y1) of 'image' to 'gray'
+static void ConvertRows(IplImage *image, IplImage *gray, int y0, int y1)
+{
+    CvMat src_rows, gray_rows;
+    cvGetRows(image, &src_rows, y0, y1);
+    cvGetRows(gray, &gray_rows, y0, y1);
     if(image->nChannels == 4)
-        cvCvtColor(image, gray, CV_RGBA2GRAY);
+        cvCvtColor(&src_rows, &gray_rows, CV_RGBA2GRAY);
     else if(image->nChannels == 3)
-        cvCvtColor(image, gray, CV_RGB2GRAY);
+        cvCvtColor(&src_rows, &gray_rows, CV_RGB2GRAY);
     else if(image->nChannels == 1)
-        cvCopy(image, gray);
-    else {
-        cerr<<"Unsupported image format"<<endl;
-    }
+        cvCopy(&src_rows, &gray_rows);
+}
 
-    cvAdaptiveThreshold(gray, bw, 255, CV_ADAPTIVE_THRESH_MEAN_C, CV_THRESH_BINARY_INV, thresh_param1, thresh_param2);
-    //cvThreshold(gray, bw, 127, 255, CV_THRESH_BINARY_INV);
+void Labeling::ThresholdRows(int y_end)
+{
+    const int width = bw->width, height = bw->height;
+    const int band = 16;
+    const int r = thresh_param1/2;
+    const int area = thresh_param1*thresh_param1;
+    const int half = (area-1)/2;
+    const int delta = thresh_param2;
+    if (y_end > height) y_end = height;
+
+    column_sums.resize(width);
+    prefix_sums.resize(width + 2*r + 1);
+    for (int y = thresholded_rows; y < y_end; ++y)
+    {
+        // Gray rows are converted a band ahead of the window
+        int needed = min(y + r + 1, height);
+        if (converted_rows < needed) {
+            int y1 = min(needed + band, height);
+            ConvertRows(source, gray, converted_rows, y1);
+            converted_rows = y1;
+        }
 
-    CvSeq* contours;
-    CvSeq* squares = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSeq), storage);
-    CvSeq* square_contours = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSeq), storage);
+        // Column sums over rows y-r ... y+r, the border rows replicated
+        if (y == 0) {
+            fill(column_sums.begin(), column_sums.end(), 0);
+            for (int k = -r; k <= r; ++k) {
+                const unsigned char *row = (const unsigned char *)gray->imageData + min(max(k, 0), height-1)*gray->widthStep;
+                for (int x = 0; x < width; ++x) column_sums[x] += row[x];
+            }
+        } else {
+            const unsigned char *add = (const unsigned char *)gray->imageData + min(y+r, height-1)*gray->widthStep;
+            const unsigned char *sub = (const unsigned char *)gray->imageData + max(y-r-1, 0)*gray->widthStep;
+            for (int x = 0; x < width; ++x) column_sums[x] += add[x] - sub[x];
+        }
 
-    cvFindContours(bw, storage, &contours, sizeof(CvContour),
-        CV_RETR_LIST, CV_CHAIN_APPROX_NONE, cvPoint(0,0));
+        // Box sums along the row from prefix sums, the border columns replicated
+        int *prefix = &prefix_sums[0];
+        int acc = 0;
+        prefix[0] = 0;
+        for (int j = 0; j < r; ++j) prefix[j+1] = (acc += column_sums[0]);
+        for (int x = 0; x < width; ++x) prefix[r+x+1] = (acc += column_sums[x]);
+        for (int j = 0; j < r; ++j) prefix[r+width+j+1] = (acc += column_sums[width-1]);
+
+        // Object where gray <= round(mean) - delta, compared without dividing
+        const unsigned char *g = (const unsigned char *)gray->imageData + y*gray->widthStep;
+        unsigned char *b = (unsigned char *)bw->imageData + y*bw->widthStep;
+        const int window = 2*r+1;
+        for (int x = 0; x < width; ++x) {
+            b[x] = ((g[x] + delta)*area <= prefix[x+window] - prefix[x] + half) ? 255 : 0;
+        }
 
-    while(contours)
-    {
-        if(contours->total < _min_edge)
-        {
-            contours = contours->h_next;
-            continue;
+        // No object pixels on the frame, like in cvFindContours
+        if ((y == 0) || (y == height-1)) {
+            memset(b, 0, width);
+        } else {
+            b[0] = 0;
+            b[width-1] = 0;
         }
+    }
+    thresholded_rows = max(thresholded_rows, y_end);
+}
 
-        CvSeq* result = cvApproxPoly(contours, sizeof(CvContour), storage,
-                                     CV_POLY_APPROX_DP, cvContourPerimeter(contours)*0.035, 0 ); // TODO: Parameters?
+// Values of the binary image during border following
+static const unsigned char BORDER_NEW = 255;          // Object pixel not on a followed border yet
+static const unsigned char BORDER_VISITED = 2;        // Followed border pixel
+static const unsigned char BORDER_VISITED_RIGHT = 3;  // Followed border pixel with background on its right
 
-        if( result->total == 4 && CheckBorder(result, image->width, image->height) && 
-            fabs(cvContourArea(result,CV_WHOLE_SEQ)) > _min_area && // TODO check limits
-            cvCheckContourConvexity(result) ) // ttehop: Changed to 'contours' instead of 'result'
-        {
-                cvSeqPush(squares, result);
-                cvSeqPush(square_contours, contours);
+// Most points recorded for a border whose bounding box extents (max - min) sum to box
+static inline int MaxConvexBorderPoints(int box)
+{
+    return (12*box + 80)/5;
+}
+
+bool Labeling::TraceBorder(int x, int y, bool hole, double *perimeter)
+{
+    // The 8 neighbours counter-clockwise starting from the right, twice for wrapping around
+    const int step = bw->widthStep;
+    const int deltas[16] = { 1, -step+1, -step, -step-1, -1, step-1, step, step+1,
+                             1, -step+1, -step, -step-1, -1, step-1, step, step+1 };
+    static const int dx[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+    static const int dy[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+
+    unsigned char *i0 = (unsigned char *)bw->imageData + y*step + x;
+    unsigned char *i1, *i3, *i4;
+
+    // Clockwise from the background pixel for the first border pixel
+    int s, s_end;
+    s_end = s = (hole ? 0 : 4);
+    do {
+        s = (s - 1) & 7;
+        i1 = i0 + deltas[s];
+        if (*i1 != 0) break;
+    } while (s != s_end);
+    if (s == s_end) {
+        // Single pixel
+        *i0 = BORDER_VISITED_RIGHT;
+        return false;
+    }
+
+    bool record = !hole;
+    const size_t first = contour_points.size();
+    const int max_points = 2*(bw->width + bw->height);
+    int min_x = x, max_x = x, min_y = y, max_y = y;
+    int n = 0, diagonal = 0;
+
+    i3 = i0;
+    for (;;) {
+        // Counter-clockwise from the previous border pixel for the next one
+        s_end = s;
+        for (;;) {
+            i4 = i3 + deltas[++s];
+            if (*i4 != 0) break;
         }
-        contours = contours->h_next;
+        s &= 7;
+
+        if ((unsigned)(s - 1) < (unsigned)s_end) *i3 = BORDER_VISITED_RIGHT;
+        else if (*i3 == BORDER_NEW) *i3 = BORDER_VISITED;
+
+        if (record) {
+            contour_points.push_back(cvPoint(x, y));
+            n++;
+            diagonal += (s & 1);
+            if (x < min_x) min_x = x; else if (x > max_x) max_x = x;
+            if (y < min_y) min_y = y; else if (y > max_y) max_y = y;
+            // A convex border is not much longer than twice the sides of its bounding box
+            int box = (max_x - min_x) + (max_y - min_y);
+            if ((n > max_points) || (n > MaxConvexBorderPoints(box))) {
+                record = false;
+                contour_points.resize(first);
+            }
+        }
+
+        if (i4 == i0 && i3 == i1) break;
+
+        i3 = i4;
+        x += dx[s];
+        y += dy[s];
+        s = (s + 4) & 7;
     }
 
-    _n_blobs = squares->total;
-    blob_corners.resize(_n_blobs);
+    if (record) *perimeter = (n - diagonal) + diagonal*sqrt(2.0);
+    return record;
+}
+
+// Adds the moments of points [begin, end) for a least squares line fit
+static void AccumulateLineMoments(const float *x, const float *y, int begin, int end, double m[6])
+{
+    double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+    for (int i = begin; i < end; ++i) {
+        sx += x[i];
+        sy += y[i];
+        sxx += x[i]*x[i];
+        syy += y[i]*y[i];
+        sxy += x[i]*y[i];
+    }
+    m[0] += end - begin;
+    m[1] += sx; m[2] += sy;
+    m[3] += sxx; m[4] += syy; m[5] += sxy;
+}
+
+// The line minimizing the squared distances of the points, as cvFitLine with CV_DIST_L2
+static void FitLineMoments(const double m[6], float params[4])
+{
+    double n = m[0];
+    double x = m[1]/n, y = m[2]/n;
+    double dxx = m[3]/n - x*x, dyy = m[4]/n - y*y, dxy = m[5]/n - x*y;
+    float t = (float)atan2(2*dxy, dxx - dyy) / 2;
+    params[0] = (float)cos(t);
+    params[1] = (float)sin(t);
+    params[2] = (float)x;
+    params[3] = (float)y;
+}
+
+void Labeling::FitQuadCorners(IplImage* image, bool visualize)
+{
+    int n_quads = (int)quads.size();
+    // Keep the surplus corner vectors (and their memory) for later frames
+    if ((int)blob_corners.size() < n_quads) blob_corners.resize(n_quads);
+    for(size_t i = n_quads; i < blob_corners.size(); ++i) blob_corners[i].clear();
+
+    FrameArenaScope scope(arena);
 
     // For every detected 4-corner blob
-    for(int i = 0; i < _n_blobs; ++i)
+    for(int i = 0; i < n_quads; ++i)
     {
-        vector<Line> fitted_lines(4);
+        Line fitted_lines[4];
         blob_corners[i].resize(4);
-        CvSeq* sq = (CvSeq*)cvGetSeqElem(squares, i);
-        CvSeq* square_contour = (CvSeq*)cvGetSeqElem(square_contours, i);
+        const QuadCandidate &quad = quads[i];
+        const CvPoint *square_contour = &contour_points[quad.first];
+
+        // The contour in single precision coordinate arrays, undistorted at once
+        FrameArenaScope contour_scope(scope.Get());
+        float *xs = contour_scope.Allocate<float>(quad.count);
+        float *ys = contour_scope.Allocate<float>(quad.count);
+        for (int k = 0; k < quad.count; ++k) {
+            xs[k] = float(square_contour[k].x);
+            ys[k] = float(square_contour[k].y);
+        }
+        if(cam)
+            cam->Undistort(xs, ys, quad.count);
         
         for(int j = 0; j < 4; ++j)
         {
-            CvPoint* pt0 = (CvPoint*)cvGetSeqElem(sq, j);
-            CvPoint* pt1 = (CvPoint*)cvGetSeqElem(sq, (j+1)%4);
-            int k0=-1, k1=-1;
-            for (int k = 0; k<square_contour->total; k++) {
-                CvPoint* pt2 = (CvPoint*)cvGetSeqElem(square_contour, k);
-                if ((pt0->x == pt2->x) && (pt0->y == pt2->y)) k0=k;
-                if ((pt1->x == pt2->x) && (pt1->y == pt2->y)) k1=k;
+            // The edge is between the polygon vertices, neither k0 nor k1 are included
+            int k0 = quad.corners[j];
+            int k1 = quad.corners[(j+1)%4];
+            double moments[6] = {0};
+            if (k1 > k0+1) {
+                AccumulateLineMoments(xs, ys, k0+1, k1, moments);
+            } else if (k1 < k0) {
+                AccumulateLineMoments(xs, ys, k0+1, quad.count, moments);
+                AccumulateLineMoments(xs, ys, 0, k1, moments);
             }
-            int len;
-            if (k1 >= k0) len = k1-k0-1; // neither k0 nor k1 are included
-            else len = square_contour->total-k0+k1-1;
-            if (len == 0) len = 1;
-
-            CvMat* line_data = cvCreateMat(1, len, CV_32FC2);
-            for (int l=0; l<len; l++) {
-                int ll = (k0+l+1)%square_contour->total;
-                CvPoint* p = (CvPoint*)cvGetSeqElem(square_contour, ll);
-                CvPoint2D32f pp;
-                pp.x = float(p->x);
-                pp.y = float(p->y);
-
-                // Undistort
-                if(cam)
-                    cam->Undistort(pp);
-
-                CV_MAT_ELEM(*line_data, CvPoint2D32f, 0, l) = pp;
+            if (moments[0] == 0) {
+                int k = (k0+1)%quad.count;
+                AccumulateLineMoments(xs, ys, k, k+1, moments);
             }
 
             // Fit edge and put to vector of edges
@@ -185,15 +543,13 @@ void LabelingCvSeq::LabelSquares(IplImage* image, bool visualize)
                 FitLineGray(line_data, params, gray);
             }
             */
-            cvFitLine(line_data, CV_DIST_L2, 0, 0.01, 0.01, params);
+            FitLineMoments(moments, params);
 
             //cvFitLine(line_data, CV_DIST_L2, 0, 0.01, 0.01, params);
             ////cvFitLine(line_data, CV_DIST_HUBER, 0, 0.01, 0.01, params);
             Line line = Line(params);
             if(visualize) DrawLine(image, line);
             fitted_lines[j] = line;
-
-            cvReleaseMat(&line_data);
         }
 
         // Calculated four intersection points
@@ -232,13 +588,73 @@ void LabelingCvSeq::LabelSquares(IplImage* image, bool visualize)
             }
         }
     }
+}
+
+LabelingCvSeq::LabelingCvSeq() : _n_blobs(0), _min_edge(20), _min_area(25)
+{
+	SetOptions();
+	storage = cvCreateMemStorage(0);
+}
+
+LabelingCvSeq::~LabelingCvSeq()
+{
+	if(storage)
+		cvReleaseMemStorage(&storage);
+}
+
+void LabelingCvSeq::SetOptions(bool _detect_pose_grayscale) {
+    detect_pose_grayscale = _detect_pose_grayscale;
+}
+
+void LabelingCvSeq::LabelSquares(IplImage* image, bool visualize)
+{
+    ThresholdImage(image);
+
+    // Border following like in cvFindContours, but only the outer borders
+    // that can be quads are recorded; the rest are only marked
+    unsigned char *data = (unsigned char *)bw->imageData;
+    int step = bw->widthStep;
+
+    contour_points.clear();
+    quads.clear();
+    cascade_stats = CascadeStats();
+    for (int y = 1; y < bw->height-1; ++y)
+    {
+        unsigned char *row = data + y*step;
+        for (int x = 1; x < bw->width-1; ++x)
+        {
+            double perimeter;
+            if (row[x] == BORDER_NEW && row[x-1] == 0)
+            {
+                size_t first = contour_points.size();
+                if (TraceBorder(x, y, false, &perimeter))
+                {
+                    if ((int)(contour_points.size() - first) < _min_edge) {
+                        contour_points.resize(first);
+                    } else {
+                        cascade_stats.contours++;
+                        AddQuadCandidate(first, perimeter, _min_area);
+                    }
+                }
+            }
+            if ((row[x] == BORDER_NEW || row[x] == BORDER_VISITED) && row[x+1] == 0)
+            {
+                TraceBorder(x, y, true, &perimeter);
+            }
+        }
+    }
 
-    cvClearMemStorage(storage);
+    _n_blobs = (int)quads.size();
+    FitQuadCorners(image, visualize);
 }
 
 CvSeq* LabelingCvSeq::LabelImage(IplImage* image, int min_size, bool approx)
 {
 	assert(image->origin == 0); // Currently only top-left origin supported
+	if (gray_shared) {
+		gray = NULL; gray_shared = false;
+		if (bw) cvReleaseImage(&bw); bw=NULL;
+	}
 	if (gray && ((gray->width != image->width) || (gray->height != image->height))) {
 		cvReleaseImage(&gray); gray=NULL;
 		if (bw) cvReleaseImage(&bw); bw=NULL;
@@ -302,6 +718,131 @@ CvSeq* LabelingCvSeq::LabelImage(IplImage* image, int min_size, bool approx)
 	return squares;
 }
 
+LabelingRunLength::LabelingRunLength() : _min_edge(20), _min_area(25)
+{
+}
+
+int LabelingRunLength::FindRoot(int i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+void LabelingRunLength::Union(int a, int b)
+{
+    a = FindRoot(a);
+    b = FindRoot(b);
+    // The earlier run stays the root, so roots are the first runs of their blobs
+    if (a < b) parent[b] = a;
+    else if (b < a) parent[a] = b;
+}
+
+void LabelingRunLength::LabelSquares(IplImage* image, bool visualize)
+{
+    BeginThreshold(image);
+
+    const unsigned char *data = (const unsigned char *)bw->imageData;
+    const int step = bw->widthStep;
+
+    // Runs of object pixels, merged with the 8-connected runs of the previous row.
+    // Every row is thresholded just before its runs are collected, so the gray and
+    // binary rows are still in cache. The run ends of a row are collected without
+    // branches; the frame is background.
+    FrameArenaScope scope(arena);
+    int *ends = scope.Allocate<int>(bw->width+1);
+    runs.clear();
+    parent.clear();
+    row_begin.resize(bw->height+1);
+    row_begin[0] = 0;
+    for (int y = 0; y < bw->height; ++y)
+    {
+        ThresholdRows(y+1);
+        row_begin[y+1] = row_begin[y];
+        if ((y == 0) || (y == bw->height-1)) continue;
+
+        const unsigned char *row = data + y*step;
+        int n_ends = 0;
+        int inside = 0;
+        for (int x = 1; x < bw->width; ++x) {
+            int object = (row[x] != 0);
+            ends[n_ends] = x;
+            n_ends += object ^ inside;
+            inside = object;
+        }
+
+        int prev = row_begin[y-1], prev_end = row_begin[y];
+        for (int k = 0; k < n_ends; k += 2)
+        {
+            Run run;
+            run.y = y;
+            run.x0 = ends[k];
+            run.x1 = ends[k+1];
+
+            int r = (int)runs.size();
+            runs.push_back(run);
+            parent.push_back(r);
+            while ((prev < prev_end) && (runs[prev].x1 < run.x0)) ++prev;
+            for (int q = prev; (q < prev_end) && (runs[q].x0 <= run.x1); ++q) Union(r, q);
+        }
+        row_begin[y+1] = (int)runs.size();
+    }
+
+    // Blobs in the order of their first runs. A parent is always an earlier run of
+    // the same blob, so one pass in run order labels every run with its blob.
+    blobs.clear();
+    int *blob_of_run = scope.Allocate<int>(runs.size());
+    for (int i = 0; i < (int)runs.size(); ++i)
+    {
+        const Run &run = runs[i];
+        if (parent[i] == i) {
+            Blob blob;
+            blob.first_run = i;
+            blob.min_x = run.x0; blob.max_x = run.x1-1;
+            blob.min_y = blob.max_y = run.y;
+            blob.area = 0;
+            blob_of_run[i] = (int)blobs.size();
+            blobs.push_back(blob);
+        } else {
+            blob_of_run[i] = blob_of_run[parent[i]];
+        }
+        Blob &blob = blobs[blob_of_run[i]];
+        if (run.x0 < blob.min_x) blob.min_x = run.x0;
+        if (run.x1-1 > blob.max_x) blob.max_x = run.x1-1;
+        blob.max_y = run.y;
+        blob.area += run.x1 - run.x0;
+    }
+
+    // Outer borders of the blobs that can hold a large enough quad
+    contour_points.clear();
+    quads.clear();
+    cascade_stats = CascadeStats();
+    for (size_t i = 0; i < blobs.size(); ++i)
+    {
+        const Blob &blob = blobs[i];
+        int w = blob.max_x - blob.min_x + 1;
+        int h = blob.max_y - blob.min_y + 1;
+        // Skip the blobs that could only give too short borders or too small quads
+        if (MaxConvexBorderPoints(w+h-2) < _min_edge) continue;
+        if ((w-1)*(h-1) <= _min_area) continue;
+
+        const Run &first = runs[blob.first_run];
+        size_t first_point = contour_points.size();
+        double perimeter;
+        if (!TraceBorder(first.x0, first.y, false, &perimeter)) continue;
+        if ((int)(contour_points.size() - first_point) < _min_edge) {
+            contour_points.resize(first_point);
+            continue;
+        }
+        cascade_stats.contours++;
+        AddQuadCandidate(first_point, perimeter, _min_area);
+    }
+
+    FitQuadCorners(image, visualize);
+}
+
 inline int round(double x) {
 	return (x)>=0?(int)((x)+0.5):(int)((x)-0.5);
 }
@@ -21,8 +21,8 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "EC.h"
-#include "Optimization.h"
+#include "ar_track_alvar/EC.h"
+#include "ar_track_alvar/Optimization.h"
 
 namespace alvar {
 
@@ -42,7 +42,7 @@ static void ProjectRot(CvMat* state, CvMat* projection, void* x)
 	double zeros[3] = {0};
 	CvMat zero_tra = cvMat(3, 1, CV_64F, zeros);
 	cvReshape(projection, projection, 2, 1);
-	cvProjectPoints2(object_model, &rot_mat, &zero_tra, &(camera->calib_K), &(camera->calib_D), projection);
+	cvProjectPoints2(object_model, &rot_mat, &zero_tra, &(camera->calib_K), camera->Distortion(), projection);
 	cvReshape(projection, projection, 1, count);
 }
 
@@ -56,7 +56,7 @@ static void Project(CvMat* state, CvMat* projection, void* x)
 	CvMat rot_mat = cvMat(3, 1, CV_64F, &(state->data.db[0+0]));
 	CvMat tra_mat = cvMat(3, 1, CV_64F, &(state->data.db[0+3]));
 	cvReshape(projection, projection, 2, 1);
-	cvProjectPoints2(object_model, &rot_mat, &tra_mat, &(camera->calib_K), &(camera->calib_D), projection);
+	cvProjectPoints2(object_model, &rot_mat, &tra_mat, &(camera->calib_K), camera->Distortion(), projection);
 	cvReshape(projection, projection, 1, count);
 }
 
@@ -87,7 +87,7 @@ bool CameraEC::UpdatePose(const CvMat* object_points, CvMat* image_points, CvMat
 	pparams.object_model  = object_points;
 
 	alvar::Optimization *opt = new alvar::Optimization(6, image_points->height);
-	double tmp = opt->Optimize(par, image_points, 0.0005, 2, Project, &pparams, alvar::Optimization::TUKEY_LM, 0, 0, weights);
+	opt->Optimize(par, image_points, 0.0005, 2, Project, &pparams, alvar::Optimization::TUKEY_LM, 0, 0, weights);
 
 	memcpy(rot->data.db, &(par->data.db[0+0]), 3*sizeof(double));
 	memcpy(tra->data.db, &(par->data.db[0+3]), 3*sizeof(double));
@@ -118,7 +118,7 @@ bool CameraEC::UpdateRotation(const CvMat* object_points, CvMat* image_points, C
 	pparams.camera = this;
 	pparams.object_model  = object_points;
 	alvar::Optimization *opt = new alvar::Optimization(3, image_points->height);
-	double tmp = opt->Optimize(par, image_points, 0.0005, 2, ProjectRot, &pparams, alvar::Optimization::TUKEY_LM);
+	opt->Optimize(par, image_points, 0.0005, 2, ProjectRot, &pparams, alvar::Optimization::TUKEY_LM);
 	memcpy(rot->data.db, &(par->data.db[0+0]), 3*sizeof(double));
 	delete opt;
 	cvReleaseMat(&par);
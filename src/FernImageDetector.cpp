@@ -21,7 +21,10 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "FernImageDetector.h"
+#include "ar_track_alvar/FernImageDetector.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace alvar
 {
@@ -186,6 +189,7 @@ FernImageDetector::FernImageDetector(const bool visualize)
     , mCorrespondences()
     , mHomography()
     , mInlierRatio(0)
+    , mThreadCount(1)
 {
 	//mHomography.eye(3, 3, CV_64F);
 	mClassifier.resize(1);
@@ -299,15 +303,30 @@ void FernImageDetector::findFeatures(Mat &object, bool planeAssumption)
 	int n = keypoints.size();
     vector<int> bestMatches(m, -1);
     vector<float> maxLogProb(m, -FLT_MAX);
-    vector<float> signature;
 	vector<int> pairs;
 
-	for(size_t i = 0; i < keypoints.size(); ++i) {
-		Point2f pt = keypoints[i].pt;
-		//int oct = keypoints[i].octave; std::cout<<"oct "<<oct<<std::endl;
-		int k = mClassifier[0](object /*objpyr[oct]*/, pt, signature);
-		if(k >= 0 && (bestMatches[k] < 0 || signature[k] > maxLogProb[k])) {
-			maxLogProb[k] = signature[k];
+	// Classify the keypoints in parallel, each thread with its own signature
+	// buffer. The best match per class is picked afterwards in keypoint order,
+	// so the result does not depend on the thread count.
+	vector<int> classes(n, -1);
+	vector<float> logProbs(n, -FLT_MAX);
+	#pragma omp parallel num_threads(parallelThreads())
+	{
+		vector<float> signature;
+		#pragma omp for schedule(dynamic, 16)
+		for(int i = 0; i < n; ++i) {
+			Point2f pt = keypoints[i].pt;
+			//int oct = keypoints[i].octave; std::cout<<"oct "<<oct<<std::endl;
+			int k = mClassifier[0](object /*objpyr[oct]*/, pt, signature);
+			classes[i] = k;
+			if(k >= 0) logProbs[i] = signature[k];
+		}
+	}
+
+	for(int i = 0; i < n; ++i) {
+		int k = classes[i];
+		if(k >= 0 && (bestMatches[k] < 0 || logProbs[i] > maxLogProb[k])) {
+			maxLogProb[k] = logProbs[i];
 			bestMatches[k] = i;
 		}
 	}
@@ -318,16 +337,6 @@ void FernImageDetector::findFeatures(Mat &object, bool planeAssumption)
 			pairs.push_back(bestMatches[i]);
     }
 
-        mCorrespondences = Mat(mObjects[0].rows + object.rows, std::max( mObjects[0].cols, object.cols), CV_8UC3);
-		mCorrespondences = Scalar(0.);
-        Mat part(mCorrespondences, Rect(0, 0, mObjects[0].cols, mObjects[0].rows));
-        cvtColor(mObjects[0], part, CV_GRAY2BGR);
-		part = Mat(mCorrespondences, Rect(0, mObjects[0].rows, object.cols, object.rows));
-		cvtColor(object, part, CV_GRAY2BGR);
-
-		for(int i = 0; i < (int)keypoints.size(); ++i)
-			circle(object, keypoints[i].pt, int(keypoints[i].size/5), CV_RGB(64,64,64));
-
 		vector<Point2f> fromPt, toPt;
 		vector<uchar> mask;
 		for(int i = 0; i < m; ++i)
@@ -341,10 +350,12 @@ void FernImageDetector::findFeatures(Mat &object, bool planeAssumption)
 			mModelPoints.clear();
 			mImagePoints.clear();
 			int n_inliers = 0;
+			bool useMask = false;
 
 			if(planeAssumption && fromPt.size() > 8) {
 				cv::Mat H = cv::findHomography(Mat(fromPt), Mat(toPt), mask, RANSAC/*CV_LMEDS*/, 20);
 				mHomography = H;
+				useMask = true;
 				//CompareModelAndObservation();
 
 				for(size_t i = 0, j = 0; i < (int)pairs.size(); i += 2, ++j) {
@@ -353,9 +364,6 @@ void FernImageDetector::findFeatures(Mat &object, bool planeAssumption)
 						cv::Point2f pw(mKeyPoints[pairs[i]].pt);
 						mModelPoints.push_back(pw);
 						mImagePoints.push_back(pi);
-						line(mCorrespondences, mKeyPoints[pairs[i]].pt,
-							keypoints[pairs[i+1]].pt + Point2f(0.0,(float)mObjects[0].rows),
-							Scalar(i*i%244,100-i*100%30,i*i-50*i));
 						n_inliers++;
 					}
 				}
@@ -365,9 +373,6 @@ void FernImageDetector::findFeatures(Mat &object, bool planeAssumption)
 					cv::Point2f pw(mKeyPoints[pairs[i]].pt);
 					mModelPoints.push_back(pw);
 					mImagePoints.push_back(pi);
-					line(mCorrespondences, mKeyPoints[pairs[i]].pt,
-						keypoints[pairs[i+1]].pt + Point2f(0.0,(float)mObjects[0].rows),
-						Scalar(i*i%244,100-i*100%30,i*i-50*i));
 				}
 			}
 			
@@ -380,12 +385,40 @@ void FernImageDetector::findFeatures(Mat &object, bool planeAssumption)
 			mInlierRatio = val;
 
     if (mVisualize) {
+        // The correspondence image is only needed for the window
+        mCorrespondences = Mat(mObjects[0].rows + object.rows, std::max( mObjects[0].cols, object.cols), CV_8UC3);
+		mCorrespondences = Scalar(0.);
+        Mat part(mCorrespondences, Rect(0, 0, mObjects[0].cols, mObjects[0].rows));
+        cvtColor(mObjects[0], part, CV_GRAY2BGR);
+		part = Mat(mCorrespondences, Rect(0, mObjects[0].rows, object.cols, object.rows));
+		cvtColor(object, part, CV_GRAY2BGR);
+
+		for(int i = 0; i < (int)keypoints.size(); ++i)
+			circle(object, keypoints[i].pt, int(keypoints[i].size/5), CV_RGB(64,64,64));
+
+		for(size_t i = 0, j = 0; i < (int)pairs.size(); i += 2, ++j) {
+			if(useMask && !mask[j]) continue;
+			line(mCorrespondences, mKeyPoints[pairs[i]].pt,
+				keypoints[pairs[i+1]].pt + Point2f(0.0,(float)mObjects[0].rows),
+				Scalar(i*i%244,100-i*100%30,i*i-50*i));
+		}
+
         cvNamedWindow("Matches", 1);
         imshow("Matches", mCorrespondences);
         cv::waitKey(1);
     }
 }
 
+int FernImageDetector::parallelThreads() const
+{
+#ifdef _OPENMP
+	if (mThreadCount > 0) return mThreadCount;
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
 bool FernImageDetector::read(const std::string &filename, const bool binary)
 {
     if (binary) {
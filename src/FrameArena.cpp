@@ -0,0 +1,133 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+#include "ar_track_alvar/FrameArena.h"
+#include <algorithm>
+
+namespace alvar {
+
+FrameArena::FrameArena(size_t _block_size)
+    : block_size(_block_size)
+    , current(0)
+    , offset(0)
+{
+}
+
+FrameArena::~FrameArena()
+{
+    for (size_t i = 0; i < blocks.size(); i++) {
+        delete [] blocks[i].data;
+    }
+}
+
+void *FrameArena::Allocate(size_t bytes, size_t alignment)
+{
+    if (bytes == 0) bytes = 1;
+    // Try the current block first and then the following ones that were
+    // left unused since the last reset
+    for (size_t b = current; b < blocks.size(); b++) {
+        size_t start = (b == current ? offset : 0);
+        size_t address = size_t(blocks[b].data) + start;
+        size_t aligned = (address + alignment - 1) & ~(alignment - 1);
+        if (aligned + bytes <= size_t(blocks[b].data) + blocks[b].size) {
+            current = b;
+            offset = aligned - size_t(blocks[b].data) + bytes;
+            return reinterpret_cast<void *>(aligned);
+        }
+    }
+
+    // Nothing fits, so the arena grows by one block
+    Block block;
+    block.size = std::max(block_size, bytes + alignment);
+    block.data = new char[block.size];
+    blocks.push_back(block);
+    current = blocks.size() - 1;
+    size_t address = size_t(block.data);
+    size_t aligned = (address + alignment - 1) & ~(alignment - 1);
+    offset = aligned - address + bytes;
+    return reinterpret_cast<void *>(aligned);
+}
+
+FrameArena::Mark FrameArena::GetMark() const
+{
+    Mark mark;
+    mark.block = current;
+    mark.offset = offset;
+    return mark;
+}
+
+void FrameArena::Release(const Mark &mark)
+{
+    current = mark.block;
+    offset = mark.offset;
+}
+
+void FrameArena::Reset()
+{
+    current = 0;
+    offset = 0;
+}
+
+size_t FrameArena::Capacity() const
+{
+    size_t capacity = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        capacity += blocks[i].size;
+    }
+    return capacity;
+}
+
+FrameArenaScope::FrameArenaScope(FrameArena *_arena)
+    : owned(NULL)
+    , arena(_arena)
+    , local_offset(0)
+{
+    mark.block = 0;
+    mark.offset = 0;
+    if (arena) mark = arena->GetMark();
+}
+
+FrameArenaScope::~FrameArenaScope()
+{
+    if (arena) arena->Release(mark);
+    delete owned;
+}
+
+void *FrameArenaScope::Allocate(size_t bytes, size_t alignment)
+{
+    if (!arena) {
+        size_t address = size_t(local) + local_offset;
+        size_t aligned = (address + alignment - 1) & ~(alignment - 1);
+        if (aligned + bytes <= size_t(local) + sizeof(local)) {
+            local_offset = aligned - size_t(local) + bytes;
+            return reinterpret_cast<void *>(aligned);
+        }
+        // The local buffer is used up, so the rest goes to a private arena
+        owned = new FrameArena(LOCAL_SIZE);
+        arena = owned;
+        mark = arena->GetMark();
+    }
+    return arena->Allocate(bytes, alignment);
+}
+
+} // namespace alvar
@@ -0,0 +1,70 @@
+/*
+ * This file is part of ALVAR, A Library for Virtual and Augmented Reality.
+ *
+ * Copyright 2007-2012 VTT Technical Research Centre of Finland
+ *
+ * Contact: VTT Augmented Reality Team <alvar.info@vtt.fi>
+ *          <http://www.vtt.fi/multimedia/alvar.html>
+ *
+ * ALVAR is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ALVAR; if not, see
+ * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
+ */
+
+#include "ar_track_alvar/FrameImageCache.h"
+#include <cv.h>
+
+namespace alvar {
+
+FrameImageCache::FrameImageCache()
+    : image(0)
+    , frame_count(0)
+    , gray(0)
+    , gray_ready(false)
+{
+}
+
+FrameImageCache::~FrameImageCache()
+{
+    if (gray) cvReleaseImage(&gray);
+}
+
+void FrameImageCache::SetImage(IplImage *_image)
+{
+    image = _image;
+    frame_count++;
+    gray_ready = false;
+
+    // Drop the buffer of another size
+    if (gray && ((gray->width != image->width) || (gray->height != image->height))) {
+        cvReleaseImage(&gray);
+    }
+}
+
+IplImage *FrameImageCache::GetGray()
+{
+    if (!image) return 0;
+    if ((image->nChannels == 1) && (image->depth == IPL_DEPTH_8U)) return image;
+    if (!gray_ready) {
+        if (!gray) {
+            gray = cvCreateImage(cvSize(image->width, image->height), IPL_DEPTH_8U, 1);
+        }
+        gray->origin = image->origin;
+        if (image->nChannels == 4) cvCvtColor(image, gray, CV_RGBA2GRAY);
+        else cvCvtColor(image, gray, CV_RGB2GRAY);
+        gray_ready = true;
+    }
+    return gray;
+}
+
+} // namespace alvar
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file 
+ * 
+ * Decides which incoming camera frames the detection nodes process
+ *
+ */
+
+#include <ar_track_alvar/FrameScheduler.h>
+#include <algorithm>
+
+namespace ar_track_alvar
+{
+
+  // Weight of the newest sample in the smoothed processing time and frame period
+  static const double kSmoothingAlpha = 0.1;
+
+  // Fraction of the minimum latency forgotten per frame, so that a latency
+  // spike or a clock change is not remembered forever
+  static const double kLatencyRelax = 0.01;
+
+  FrameScheduler::FrameScheduler(FramePolicy policy, double max_frequency)
+    : processed_count(0), skipped_count(0),
+      policy_(policy), max_frequency_(max_frequency),
+      frame_age_(0), min_latency_(-1), processing_(false),
+      processing_time_(kSmoothingAlpha), frame_period_(kSmoothingAlpha)
+  {
+  }
+
+  bool FrameScheduler::startFrame(const ros::Time &stamp)
+  {
+    frame_age_ = (ros::Time::now() - stamp).toSec();
+
+    if (!last_stamp_.isZero() && stamp > last_stamp_)
+      frame_period_.next((stamp - last_stamp_).toSec());
+    last_stamp_ = stamp;
+
+    bool process = true;
+    switch (policy_)
+    {
+      case PROCESS_LATEST:
+        // The best case age is the transport latency; anything older than
+        // that plus one frame period has a newer frame behind it already
+        if (min_latency_ < 0 || frame_age_ < min_latency_)
+          min_latency_ = frame_age_;
+        else
+          min_latency_ += kLatencyRelax * (frame_age_ - min_latency_);
+        if (processed_count > 0 && frame_period_.get() > 0)
+          process = frame_age_ <= min_latency_ + frame_period_.get();
+        break;
+
+      case FIXED_RATE:
+        if (!last_processed_stamp_.isZero() && stamp > last_processed_stamp_)
+        {
+          double interval = (max_frequency_ > 0) ? 1.0 / max_frequency_ : 0;
+          interval = std::max(interval, processing_time_.get());
+          // Half a frame period of slack keeps a 30 Hz camera at 10 Hz from
+          // alternating between 2 and 3 skipped frames
+          process = (stamp - last_processed_stamp_).toSec() + 0.5 * frame_period_.get() >= interval;
+        }
+        break;
+
+      case AS_FAST_AS_POSSIBLE:
+        break;
+    }
+
+    if (!process)
+    {
+      skipped_count++;
+      return false;
+    }
+
+    last_processed_stamp_ = stamp;
+    processing_start_ = ros::WallTime::now();
+    processing_ = true;
+    return true;
+  }
+
+  void FrameScheduler::finishFrame()
+  {
+    if (!processing_)
+      return;
+    processing_ = false;
+    processing_time_.next((ros::WallTime::now() - processing_start_).toSec());
+    processed_count++;
+  }
+
+} //namespace
@@ -24,6 +24,8 @@
 #include "ar_track_alvar/Alvar.h"
 #include "ar_track_alvar/Marker.h"
 #include "highgui.h"
+#include "ar_track_alvar/Lock.h"
+#include <map>
 
 template class ALVAR_EXPORT alvar::MarkerIteratorImpl<alvar::Marker>;
 template class ALVAR_EXPORT alvar::MarkerIteratorImpl<alvar::MarkerData>;
@@ -36,6 +38,12 @@ using namespace std;
 
 #define HEADER_SIZE 8
 
+// Pointer to the first element of a vector, or NULL when it is empty
+template<class T>
+inline T *vector_data(vector<T> &v) { return (v.empty() ? NULL : &v[0]); }
+template<class T>
+inline const T *vector_data(const vector<T> &v) { return (v.empty() ? NULL : &v[0]); }
+
 void Marker::VisualizeMarkerPose(IplImage *image, Camera *cam, double visualize2d_points[12][2], CvScalar color) const {
 	// Cube
 	for (int i=0; i<4; i++) {
@@ -163,14 +171,14 @@ void Marker::Visualize(IplImage *image, Camera *cam, CvScalar color) const {
 void Marker::CompareCorners(vector<PointDouble > &_marker_corners_img, int *orientation, double *error) {
 	vector<PointDouble >::iterator corners_new = _marker_corners_img.begin();
 	vector<PointDouble >::const_iterator corners_old = marker_corners_img.begin();
-	vector<double> errors(4);
+	double errors[4] = {0};
 	for (int i=0; i<4; i++) {
 		errors[0] += PointSquaredDistance(marker_corners_img[i], _marker_corners_img[i]);
 		errors[1] += PointSquaredDistance(marker_corners_img[i], _marker_corners_img[(i+1)%4]);
 		errors[2] += PointSquaredDistance(marker_corners_img[i], _marker_corners_img[(i+2)%4]);
 		errors[3] += PointSquaredDistance(marker_corners_img[i], _marker_corners_img[(i+3)%4]);
 	}
-	*orientation = min_element(errors.begin(), errors.end()) - errors.begin();
+	*orientation = min_element(errors, errors+4) - errors;
 	*error = sqrt(errors[*orientation]/4);
 	*error /= sqrt(max(PointSquaredDistance(marker_corners_img[0], marker_corners_img[2]), PointSquaredDistance(marker_corners_img[1], marker_corners_img[3])));
 }
@@ -181,23 +189,34 @@ void Marker::CompareContent(vector<PointDouble > &_marker_corners_img, IplImage
 
 }
 
-bool Marker::UpdateContent(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no /*= 0*/) {
-	return UpdateContentBasic(_marker_corners_img, gray, cam, frame_no);
+bool Marker::UpdateContent(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no /*= 0*/, FrameArena *arena /*= NULL*/) {
+	return UpdateContentBasic(_marker_corners_img, gray, cam, frame_no, arena);
+}
+
+// Gray level of pixel (x, y), read directly from 8-bit single channel images
+static inline int GrayAt(IplImage *gray, int x, int y)
+{
+	if ((gray->depth == IPL_DEPTH_8U) && (gray->nChannels == 1))
+		return ((unsigned char *)(gray->imageData + y*gray->widthStep))[x];
+	return (int)cvGetReal2D(gray, y, x);
 }
 
-bool Marker::UpdateContentBasic(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no /*= 0*/) {
-	vector<PointDouble > marker_corners_img_undist;
-	marker_corners_img_undist.resize(_marker_corners_img.size());
-	copy(_marker_corners_img.begin(), _marker_corners_img.end(), marker_corners_img_undist.begin());
+bool Marker::UpdateContentBasic(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no /*= 0*/, FrameArena *arena /*= NULL*/) {
+	FrameArenaScope scope(arena);
+	size_t corner_count = _marker_corners_img.size();
+	PointDouble *marker_corners_img_undist = scope.Allocate<PointDouble>(corner_count);
+	copy(_marker_corners_img.begin(), _marker_corners_img.end(), marker_corners_img_undist);
 
-	// Figure out the marker point position in the image
+	// Figure out the marker point position in the image. The sample points are
+	// kept in single precision coordinate arrays.
 	Homography H;
-	vector<PointDouble> marker_points_img(marker_points.size());
-	marker_points_img.resize(marker_points.size());
-	cam->Undistort(marker_corners_img_undist);
-	H.Find(marker_corners, marker_corners_img_undist);
-	H.ProjectPoints(marker_points, marker_points_img);
-	cam->Distort(marker_points_img);
+	size_t point_count = layout->points.size();
+	float *points_x = scope.Allocate<float>(point_count);
+	float *points_y = scope.Allocate<float>(point_count);
+	cam->Undistort(marker_corners_img_undist, corner_count);
+	H.Find(vector_data(layout->corners), marker_corners_img_undist, (int)corner_count);
+	H.ProjectPoints(vector_data(layout->points), points_x, points_y, point_count);
+	cam->Distort(points_x, points_y, point_count);
 	
 	ros_marker_points_img.clear();
 
@@ -205,11 +224,13 @@ bool Marker::UpdateContentBasic(vector<PointDouble > &_marker_corners_img, IplIm
     int x, y;
 	double min = 255.0, max = 0.0;
 	for (int j=0; j<marker_content->height; j++) {
+		uchar *content_row = marker_content->data.ptr + j*marker_content->step;
 		for (int i=0; i<marker_content->width; i++) {
-			x = (int)(0.5+Limit(marker_points_img[(j*marker_content->width)+i].x, 1, gray->width-2));
-			y = (int)(0.5+Limit(marker_points_img[(j*marker_content->width)+i].y, 1, gray->height-2));
+			size_t k = (j*marker_content->width)+i;
+			x = (int)(0.5+Limit(points_x[k], 1, gray->width-2));
+			y = (int)(0.5+Limit(points_y[k], 1, gray->height-2));
 			
-			marker_points_img[(j*marker_content->width)+i].val = (int)cvGetReal2D(gray, y, x);
+			int val = GrayAt(gray, x, y);
 			
 			ros_marker_points_img.push_back(PointDouble(x,y));
 
@@ -226,54 +247,65 @@ bool Marker::UpdateContentBasic(vector<PointDouble > &_marker_corners_img, IplIm
 			tmp = vals[2];
 			*/
 
-			cvSet2D(marker_content, j, i, cvScalar(marker_points_img[(j*marker_content->width)+i].val));
-			if(marker_points_img[(j*marker_content->width)+i].val > max) max = marker_points_img[(j*marker_content->width)+i].val;
-			if(marker_points_img[(j*marker_content->width)+i].val < min) min = marker_points_img[(j*marker_content->width)+i].val;
+			content_row[i] = (uchar)val;
+			if(val > max) max = val;
+			if(val < min) min = val;
 		}
 	}
 
 	// Take few additional points from border and just 
 	// outside the border to make the right thresholding
-	vector<PointDouble> marker_margin_w_img(marker_margin_w.size());
-	vector<PointDouble> marker_margin_b_img(marker_margin_b.size());
-	H.ProjectPoints(marker_margin_w, marker_margin_w_img);
-	H.ProjectPoints(marker_margin_b, marker_margin_b_img);
-	cam->Distort(marker_margin_w_img);
-	cam->Distort(marker_margin_b_img);
+	size_t margin_w_count = layout->margin_w.size();
+	size_t margin_b_count = layout->margin_b.size();
+	float *margin_w_x = scope.Allocate<float>(margin_w_count);
+	float *margin_w_y = scope.Allocate<float>(margin_w_count);
+	float *margin_b_x = scope.Allocate<float>(margin_b_count);
+	float *margin_b_y = scope.Allocate<float>(margin_b_count);
+	int *margin_w_val = scope.Allocate<int>(margin_w_count);
+	int *margin_b_val = scope.Allocate<int>(margin_b_count);
+	H.ProjectPoints(vector_data(layout->margin_w), margin_w_x, margin_w_y, margin_w_count);
+	H.ProjectPoints(vector_data(layout->margin_b), margin_b_x, margin_b_y, margin_b_count);
+	cam->Distort(margin_w_x, margin_w_y, margin_w_count);
+	cam->Distort(margin_b_x, margin_b_y, margin_b_count);
 
 	min = max = 0; // Now min and max values are averages over black and white border pixels.
-	for (size_t i=0; i<marker_margin_w_img.size(); i++) {
-		x = (int)(0.5+Limit(marker_margin_w_img[i].x, 0, gray->width-1));
-		y = (int)(0.5+Limit(marker_margin_w_img[i].y, 0, gray->height-1));
-		marker_margin_w_img[i].val = (int)cvGetReal2D(gray, y, x);
-		max += marker_margin_w_img[i].val;
+	for (size_t i=0; i<margin_w_count; i++) {
+		x = (int)(0.5+Limit(margin_w_x[i], 0, gray->width-1));
+		y = (int)(0.5+Limit(margin_w_y[i], 0, gray->height-1));
+		margin_w_val[i] = GrayAt(gray, x, y);
+		max += margin_w_val[i];
 		//if(marker_margin_w_img[i].val > max) max = marker_margin_w_img[i].val;
 		//if(marker_margin_w_img[i].val < min) min = marker_margin_w_img[i].val;
 	}
-	for (size_t i=0; i<marker_margin_b_img.size(); i++) {
-		x = (int)(0.5+Limit(marker_margin_b_img[i].x, 0, gray->width-1));
-		y = (int)(0.5+Limit(marker_margin_b_img[i].y, 0, gray->height-1));
-		marker_margin_b_img[i].val = (int)cvGetReal2D(gray, y, x);
-		min += marker_margin_b_img[i].val;
+	for (size_t i=0; i<margin_b_count; i++) {
+		x = (int)(0.5+Limit(margin_b_x[i], 0, gray->width-1));
+		y = (int)(0.5+Limit(margin_b_y[i], 0, gray->height-1));
+		margin_b_val[i] = GrayAt(gray, x, y);
+		min += margin_b_val[i];
 		//if(marker_margin_b_img[i].val > max) max = marker_margin_b_img[i].val;
 		//if(marker_margin_b_img[i].val < min) min = marker_margin_b_img[i].val;
         ros_marker_points_img.push_back(PointDouble(x,y));
 	}
-	max /= marker_margin_w_img.size();
-	min /= marker_margin_b_img.size();
-
-	// Threshold the marker content
-	cvThreshold(marker_content, marker_content, (max+min)/2.0, 255, CV_THRESH_BINARY);
+	max /= margin_w_count;
+	min /= margin_b_count;
+
+	// Threshold the marker content (same as CV_THRESH_BINARY)
+	for (int j=0; j<marker_content->rows; j++) {
+		uchar *row = marker_content->data.ptr + j*marker_content->step;
+		for (int i=0; i<marker_content->cols; i++) {
+			row[i] = (row[i] > (max+min)/2.0 ? 255 : 0);
+		}
+	}
 
 	// Count erroneous margin nodes
 	int erroneous = 0;
 	int total = 0;
-	for (size_t i=0; i<marker_margin_w_img.size(); i++) {
-		if (marker_margin_w_img[i].val < (max+min)/2.0) erroneous++;
+	for (size_t i=0; i<margin_w_count; i++) {
+		if (margin_w_val[i] < (max+min)/2.0) erroneous++;
 		total++;
 	}
-	for (size_t i=0; i<marker_margin_b_img.size(); i++) {
-		if (marker_margin_b_img[i].val > (max+min)/2.0) erroneous++;
+	for (size_t i=0; i<margin_b_count; i++) {
+		if (margin_b_val[i] > (max+min)/2.0) erroneous++;
 		total++;
 	}
 	margin_error = (double)erroneous/total;
@@ -283,27 +315,30 @@ bool Marker::UpdateContentBasic(vector<PointDouble > &_marker_corners_img, IplIm
 	// Now we fill also this temporary debug table for visualizing marker code reading
 	// TODO: this whole vector is only for debug purposes
 	marker_allpoints_img.clear();
-	for (size_t i=0; i<marker_margin_w_img.size(); i++) {
-		PointDouble p = marker_margin_w_img[i];
-		if (p.val < (max+min)/2.0) p.val=255; // error
+	for (size_t i=0; i<margin_w_count; i++) {
+		PointDouble p;
+		p.x = margin_w_x[i]; p.y = margin_w_y[i];
+		if (margin_w_val[i] < (max+min)/2.0) p.val=255; // error
 		else p.val=0; // ok
 		marker_allpoints_img.push_back(p);
 	}
-	for (size_t i=0; i<marker_margin_b_img.size(); i++) {
-		PointDouble p = marker_margin_b_img[i];
-		if (p.val > (max+min)/2.0) p.val=255; // error
+	for (size_t i=0; i<margin_b_count; i++) {
+		PointDouble p;
+		p.x = margin_b_x[i]; p.y = margin_b_y[i];
+		if (margin_b_val[i] > (max+min)/2.0) p.val=255; // error
 		else p.val=0; // ok
 		marker_allpoints_img.push_back(p);
 	}
-	for (size_t i=0; i<marker_points_img.size(); i++) {
-		PointDouble p = marker_points_img[i];
+	for (size_t i=0; i<point_count; i++) {
+		PointDouble p;
+		p.x = points_x[i]; p.y = points_y[i];
 		p.val=128; // Unknown?
 		marker_allpoints_img.push_back(p);
 	}
 #endif
 	return true;
 }
-void Marker::UpdatePose(vector<PointDouble > &_marker_corners_img, Camera *cam, int orientation, int frame_no /* =0 */, bool update_pose /* =true */) {
+void Marker::UpdatePose(vector<PointDouble > &_marker_corners_img, Camera *cam, int orientation, int frame_no /* =0 */, bool update_pose /* =true */, FrameArena *arena /* =NULL */) {
 	marker_corners_img.resize(_marker_corners_img.size());
 	copy(_marker_corners_img.begin(), _marker_corners_img.end(), marker_corners_img.begin());
 
@@ -311,7 +346,7 @@ void Marker::UpdatePose(vector<PointDouble > &_marker_corners_img, Camera *cam,
 	if(orientation > 0)
 		std::rotate(marker_corners_img.begin(), marker_corners_img.begin() + orientation, marker_corners_img.end());
 
-	if (update_pose) cam->CalcExteriorOrientation(marker_corners, marker_corners_img, &pose);
+	if (update_pose) cam->CalcExteriorOrientation(layout->corners, marker_corners_img, &pose, arena);
 }
 bool Marker::DecodeContent(int *orientation) {
 	*orientation = 0;
@@ -353,11 +388,9 @@ void Marker::ScaleMarkerToImage(IplImage *image) const {
 	cvReleaseImage(&img);
 }
 
-void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
-	// TODO: Is this right place for default marker size?
-	edge_length = (_edge_length?_edge_length:1);
-	res = _res; //(_res?_res:10);
-	margin = (_margin?_margin:1);
+MarkerLayout::MarkerLayout(double _edge_length, int _res, double _margin)
+	: edge_length(_edge_length), res(_res), margin(_margin)
+{
 	double x_min = -0.5*edge_length;
 	double y_min = -0.5*edge_length;
 	double x_max = 0.5*edge_length;
@@ -368,72 +401,69 @@ void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
 	double cy_max = (y_max * res)/(res + margin + margin);
 	double step = edge_length / (res + margin + margin);
 
-	// marker_corners
-	marker_corners_img.resize(4);
-
 	// Same order as the detected corners
-	marker_corners.clear();
-	marker_corners.push_back(PointDouble(x_min, y_min));
-	marker_corners.push_back(PointDouble(x_max, y_min));
-	marker_corners.push_back(PointDouble(x_max, y_max));
-	marker_corners.push_back(PointDouble(x_min, y_max));
+	corners.clear();
+	corners.push_back(PointDouble(x_min, y_min));
+	corners.push_back(PointDouble(x_max, y_min));
+	corners.push_back(PointDouble(x_max, y_max));
+	corners.push_back(PointDouble(x_min, y_max));
 
 	// Rest can be done only if we have existing resolution
 	if (res <= 0) return;
 
-	// marker_points
-	marker_points.clear();
+	// points
+	points.clear();
 	for(int j = 0; j < res; ++j) {
 		for(int i = 0; i < res; ++i) {
 			PointDouble  pt;
 			pt.y = cy_max - (step*j) - (step/2);
 			pt.x = cx_min + (step*i) + (step/2);
-			marker_points.push_back(pt);
+			points.push_back(pt);
 		}
 	}
 
 	// Samples to be used in margins
 	// TODO: Now this works only if the "margin" is without decimals
 	// TODO: This should be made a lot cleaner
-	marker_margin_w.clear();
-	marker_margin_b.clear();
+	margin_w.clear();
+	margin_b.clear();
 	for(int j = -1; j<=margin-1; j++) {
 		PointDouble  pt;
 		// Sides
 		for (int i=0; i<res; i++) {
 			pt.x = cx_min + step*i + step/2;
 			pt.y = y_min + step*j + step/2;
-			if (j < 0) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if (j < 0) margin_w.push_back(pt);
+			else margin_b.push_back(pt);
 			pt.y = y_max - step*j - step/2;
-			if (j < 0) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if (j < 0) margin_w.push_back(pt);
+			else margin_b.push_back(pt);
 			pt.y = cy_min + step*i + step/2;
 			pt.x = x_min + step*j + step/2;
-			if (j < 0) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if (j < 0) margin_w.push_back(pt);
+			else margin_b.push_back(pt);
 			pt.x = x_max - step*j - step/2;
-			if (j < 0) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if (j < 0) margin_w.push_back(pt);
+			else margin_b.push_back(pt);
 		}
 		// Corners
 		for(int i = -1; i<=margin-1; i++) {
 			pt.x = x_min + step*i + step/2;
 			pt.y = y_min + step*j + step/2;
-			if ((j < 0) || (i < 0)) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if ((j < 0) || (i < 0)) margin_w.push_back(pt);
+			else margin_b.push_back(pt);
 			pt.x = x_min + step*i + step/2;
 			pt.y = y_max - step*j - step/2;
-			if ((j < 0) || (i < 0)) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if ((j < 0) || (i < 0)) margin_w.push_back(pt);
+			else margin_b.push_back(pt);
 			pt.x = x_max - step*i - step/2;
 			pt.y = y_max - step*j - step/2;
-			if ((j < 0) || (i < 0)) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if ((j < 0) || (i < 0)) margin_w.push_back(pt);
+			else margin_b.push_back(pt);
 			pt.x = x_max - step*i - step/2;
 			pt.y = y_min + step*j + step/2;
-			if ((j < 0) || (i < 0)) marker_margin_w.push_back(pt);
-			else marker_margin_b.push_back(pt);
+			if ((j < 0) || (i < 0)) margin_w.push_back(pt);
+			else margin_b.push_back(pt);
 		}
 	}
 	/*
@@ -445,13 +475,13 @@ void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
 			if ((pt.x < x_min) || (pt.y < y_min) ||
 				(pt.x > x_max) || (pt.y > y_max))
 			{
-				marker_margin_w.push_back(pt);
+				margin_w.push_back(pt);
 			}
 			else 
 			if ((pt.x < cx_min) || (pt.y < cy_min) ||
 				(pt.x > cx_max) || (pt.y > cy_max))
 			{
-				marker_margin_b.push_back(pt);
+				margin_b.push_back(pt);
 			}
 		}
 	}
@@ -465,95 +495,157 @@ void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
 			if ((pt.x < x_min) || (pt.y < y_min) ||
 				(pt.x > x_max) || (pt.y > y_max))
 			{
-				marker_margin_w.push_back(pt);
+				margin_w.push_back(pt);
 			}
 			else 
 			if ((pt.x < cx_min) || (pt.y < cy_min) ||
 				(pt.x > cx_max) || (pt.y > cy_max))
 			{
-				marker_margin_b.push_back(pt);
+				margin_b.push_back(pt);
 			}
 		}
 	}
 	*/
 	/*
-	marker_margin_w.clear();
-	marker_margin_b.clear();
+	margin_w.clear();
+	margin_b.clear();
 	for (double y=y_min-(step/2); y<y_max+(step/2); y+=step) {
 		for (double x=x_min-(step/2); x<x_max+(step/2); x+=step) {
 			PointDouble pt(x, y);
 			if ((x < x_min) || (y < y_min) ||
 				(x > x_max) || (y > y_max))
 			{
-				marker_margin_w.push_back(pt);
+				margin_w.push_back(pt);
 			} 
 			else 
 			if ((x < cx_min) || (y < cy_min) ||
 				(x > cx_max) || (y > cy_max))
 			{
-				marker_margin_b.push_back(pt);
+				margin_b.push_back(pt);
 			}
 		}
 	}
 	*/
 	/*
-	marker_points.clear();
-	marker_margin_w.clear();
-	marker_margin_b.clear();
+	points.clear();
+	margin_w.clear();
+	margin_b.clear();
 	for(int j = 0; j < res+margin+margin+2; ++j) {
 		for(int i = 0; i < res+margin+margin+2; ++i) {
 			PointDouble  pt;
 		}
 	}
 	*/
+}
+
+const MarkerLayout *MarkerLayout::Get(double _edge_length, int _res, double _margin) {
+	typedef std::map<std::pair<int, std::pair<double, double> >, MarkerLayout*> LayoutMap;
+	static Mutex mutex;
+	static LayoutMap layouts;
+	Lock lock(&mutex);
+	LayoutMap::key_type key(_res, std::make_pair(_margin, _edge_length));
+	LayoutMap::iterator iter = layouts.find(key);
+	if (iter != layouts.end()) return iter->second;
+	MarkerLayout *l = new MarkerLayout(_edge_length, _res, _margin);
+	layouts[key] = l;
+	return l;
+}
+
+void Marker::SetMarkerSize(double _edge_length, int _res, double _margin) {
+	// TODO: Is this right place for default marker size?
+	edge_length = (_edge_length?_edge_length:1);
+	res = _res; //(_res?_res:10);
+	margin = (_margin?_margin:1);
+	if (!layout || (layout->edge_length != edge_length) || (layout->res != res) || (layout->margin != margin)) {
+		layout = MarkerLayout::Get(edge_length, res, margin);
+	}
+
+	// marker_corners
+	marker_corners_img.resize(4);
 
-	// marker content
-	if (marker_content) cvReleaseMat(&marker_content);
-	marker_content = cvCreateMat(res, res, CV_8U);
+	// Rest can be done only if we have existing resolution
+	if (res <= 0) return;
+
+	// marker content (reused when the resolution does not change)
+	if ((marker_content != &marker_content_inline) && marker_content &&
+		((marker_content->rows != res) || (marker_content->cols != res)))
+	{
+		cvReleaseMat(&marker_content);
+	}
+	if (res*res <= MARKER_CONTENT_INLINE_SIZE) {
+		if (marker_content && (marker_content != &marker_content_inline)) cvReleaseMat(&marker_content);
+		marker_content = cvInitMatHeader(&marker_content_inline, res, res, CV_8U, marker_content_data);
+	} else if (!marker_content || (marker_content == &marker_content_inline)) {
+		marker_content = cvCreateMat(res, res, CV_8U);
+	}
 	cvSet(marker_content, cvScalar(255));
 }
 Marker::~Marker() {
-	if (marker_content) cvReleaseMat(&marker_content);
+	if (marker_content && (marker_content != &marker_content_inline)) cvReleaseMat(&marker_content);
 }
 Marker::Marker(double _edge_length, int _res, double _margin)
 {
+	layout = NULL;
 	marker_content = NULL;
 	margin_error = 0;
 	decode_error = 0;
 	track_error = 0;
 	SetMarkerSize(_edge_length, _res, _margin);
 	ros_orientation = -1;
+	content_age = 0;
 	ros_corners_3D.resize(4);
 	valid=false;
 }
 Marker::Marker(const Marker& m) {
+	layout = NULL;
 	marker_content = NULL;
+	CopyFrom(m);
+}
+Marker &Marker::operator=(const Marker& m) {
+	if (this != &m) CopyFrom(m);
+	return *this;
+}
+void Marker::CopyFrom(const Marker& m) {
+	// The geometry is shared, only the per-detection state is copied
+	layout = m.layout;
 	SetMarkerSize(m.edge_length, m.res, m.margin);
 
 	pose = m.pose;
 	margin_error = m.margin_error;
 	decode_error = m.decode_error;
 	track_error = m.track_error;
-	cvCopy(m.marker_content, marker_content);
-    ros_orientation = m.ros_orientation;
-
-	ros_marker_points_img.resize(m.ros_marker_points_img.size());
-	copy(m.ros_marker_points_img.begin(), m.ros_marker_points_img.end(), ros_marker_points_img.begin());
-	marker_corners.resize(m.marker_corners.size());
-	copy(m.marker_corners.begin(), m.marker_corners.end(), marker_corners.begin());
-	marker_points.resize(m.marker_points.size());
-	copy(m.marker_points.begin(), m.marker_points.end(), marker_points.begin());
-	marker_corners_img.resize(m.marker_corners_img.size());
-	copy(m.marker_corners_img.begin(), m.marker_corners_img.end(), marker_corners_img.begin());
-    ros_corners_3D.resize(m.ros_corners_3D.size());
-	copy(m.ros_corners_3D.begin(), m.ros_corners_3D.end(), ros_corners_3D.begin());
+	if (m.marker_content && marker_content) cvCopy(m.marker_content, marker_content);
+	ros_orientation = m.ros_orientation;
+	content_age = m.content_age;
+
+	ros_marker_points_img = m.ros_marker_points_img;
+	marker_corners_img = m.marker_corners_img;
+	ros_corners_3D = m.ros_corners_3D;
 
 	valid = m.valid;
 #ifdef VISUALIZE_MARKER_POINTS
-	marker_allpoints_img.resize(m.marker_allpoints_img.size());
-	copy(m.marker_allpoints_img.begin(), m.marker_allpoints_img.end(), marker_allpoints_img.begin());
+	marker_allpoints_img = m.marker_allpoints_img;
 #endif
 }
+void Marker::GetDetection(MarkerDetection *detection, bool tracked) const {
+	detection->id = GetId();
+	for (int i=0; i<4; i++) {
+		if (i < (int)marker_corners_img.size()) {
+			detection->corners[i].x = marker_corners_img[i].x;
+			detection->corners[i].y = marker_corners_img[i].y;
+		} else {
+			detection->corners[i].x = detection->corners[i].y = 0;
+		}
+		detection->quaternion[i] = pose.quaternion[i];
+	}
+	for (int i=0; i<3; i++) detection->translation[i] = pose.translation[i];
+	detection->edge_length = edge_length;
+	detection->res = res;
+	detection->margin_error = margin_error;
+	detection->decode_error = decode_error;
+	detection->track_error = track_error;
+	detection->tracked = tracked;
+}
 
 bool MarkerArtoolkit::DecodeContent(int *orientation) {
 	int a = (int)cvGetReal2D(marker_content, 0, 0);
@@ -566,8 +658,8 @@ bool MarkerArtoolkit::DecodeContent(int *orientation) {
 	else if (!d && !a && b) *orientation = 3;
 	else return false;
 
-	Bitset bs;
-	bs.clear();
+	FrameArenaScope scope(NULL);
+	BitsetBuffer bs(scope.Allocate<bool>(res*res), res*res);
 	for (int j = 0; j < res; j++) {
 		for (int i = 0; i < res ; i++) {
 			if (*orientation == 0) {
@@ -631,7 +723,7 @@ void MarkerArtoolkit::SetContent(unsigned long _id) {
 
 void MarkerData::DecodeOrientation(int *error, int *total, int *orientation) {
 	int i,j;
-	vector<double> errors(4);
+	double errors[4] = {0};
 	int color = 255;
 
 	// Resolution identification
@@ -662,37 +754,35 @@ void MarkerData::DecodeOrientation(int *error, int *total, int *orientation) {
 			if ((int)cvGetReal2D(marker_content, i, j)       !=   0) errors[3]++;
 		}
 	}
-	*orientation = min_element(errors.begin(), errors.end()) - errors.begin();
+	*orientation = min_element(errors, errors+4) - errors;
 	*error = int(errors[*orientation]);
 	//*orientation = 0; // ttehop
 }
 
-bool MarkerData::DetectResolution(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam) {
-	vector<PointDouble> marker_corners_img_undist;
-	marker_corners_img_undist.resize(_marker_corners_img.size());
-	copy(_marker_corners_img.begin(), _marker_corners_img.end(), marker_corners_img_undist.begin());
+bool MarkerData::DetectResolution(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, FrameArena *arena /*= NULL*/) {
+	FrameArenaScope scope(arena);
+	size_t corner_count = _marker_corners_img.size();
+	PointDouble *marker_corners_img_undist = scope.Allocate<PointDouble>(corner_count);
+	copy(_marker_corners_img.begin(), _marker_corners_img.end(), marker_corners_img_undist);
 
 	// line_points
-	std::vector<PointDouble> line_points;
-	PointDouble pt;
-	line_points.clear();
-	pt.x=0; pt.y=0; line_points.push_back(pt);
-	pt.x=-0.5*edge_length; pt.y=0; line_points.push_back(pt);
-	pt.x=+0.5*edge_length; pt.y=0; line_points.push_back(pt);
-	pt.x=0; pt.y=-0.5*edge_length; line_points.push_back(pt);
-	pt.x=0; pt.y=+0.5*edge_length; line_points.push_back(pt);
+	PointDouble line_points[5];
+	line_points[0].x=0; line_points[0].y=0;
+	line_points[1].x=-0.5*edge_length; line_points[1].y=0;
+	line_points[2].x=+0.5*edge_length; line_points[2].y=0;
+	line_points[3].x=0; line_points[3].y=-0.5*edge_length;
+	line_points[4].x=0; line_points[4].y=+0.5*edge_length;
 
 	// Figure out the marker point position in the image
 	// TODO: Note that line iterator cannot iterate outside image
 	//       therefore we need to distort the endpoints and iterate straight lines.
 	//       Right way would be to iterate undistorted lines and distort line points.
 	Homography H;
-	vector<PointDouble> line_points_img(line_points.size());
-	line_points_img.resize(line_points.size());
-	cam->Undistort(marker_corners_img_undist);
-	H.Find(marker_corners, marker_corners_img_undist);
-	H.ProjectPoints(line_points, line_points_img);
-	cam->Distort(line_points_img);
+	PointDouble line_points_img[5];
+	cam->Undistort(marker_corners_img_undist, corner_count);
+	H.Find(vector_data(layout->corners), marker_corners_img_undist, (int)corner_count);
+	H.ProjectPoints(line_points, line_points_img, 5);
+	cam->Distort(line_points_img, 5);
 
 	// Now we have undistorted line end points
 	// Find lines and then distort the whole line
@@ -716,17 +806,18 @@ bool MarkerData::DetectResolution(vector<PointDouble > &_marker_corners_img, Ipl
 			return false;
 		}
 		int count = cvInitLineIterator(gray, pt1, pt2, &iterator, 8, 0);
-		std::vector<uchar> vals;
+		FrameArenaScope line_scope(scope.Get());
+		uchar *vals = line_scope.Allocate<uchar>(count);
 		for(int ii = 0; ii < count; ii++ ){
 			CV_NEXT_LINE_POINT(iterator);
-			vals.push_back(*(iterator.ptr));
+			vals[ii] = *(iterator.ptr);
 		}
-		uchar vmin = *(std::min_element(vals.begin(), vals.end()));
-		uchar vmax = *(std::max_element(vals.begin(), vals.end()));
+		uchar vmin = *(std::min_element(vals, vals+count));
+		uchar vmax = *(std::max_element(vals, vals+count));
 		uchar thresh = (vmin+vmax)/2;
 		white=true;
 		int bc=0, wc=0, N=2;
-		for (size_t ii=0; ii<vals.size(); ii++) {
+		for (int ii=0; ii<count; ii++) {
 			// change the color status if we had 
 			// N subsequent pixels of the other color
 			if (vals[ii] < thresh) { bc++; wc=0; }
@@ -761,14 +852,14 @@ bool MarkerData::DetectResolution(vector<PointDouble > &_marker_corners_img, Ipl
 	return true;
 }
 
-bool MarkerData::UpdateContent(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no /*= 0*/) {
+bool MarkerData::UpdateContent(vector<PointDouble > &_marker_corners_img, IplImage *gray, Camera *cam, int frame_no /*= 0*/, FrameArena *arena /*= NULL*/) {
 	if (res == 0) {
-		if (!DetectResolution(_marker_corners_img, gray, cam)) return false;
+		if (!DetectResolution(_marker_corners_img, gray, cam, arena)) return false;
 	}
-	return UpdateContentBasic(_marker_corners_img, gray, cam, frame_no);
+	return UpdateContentBasic(_marker_corners_img, gray, cam, frame_no, arena);
 }
 
-int MarkerData::DecodeCode(int orientation, BitsetExt *bs, int *erroneous, int *total, 
+int MarkerData::DecodeCode(int orientation, BitsetBuffer *bs, int *erroneous, int *total, 
 	unsigned char* content_type) 
 {
 	// TODO: The orientation isn't fully understood?
@@ -793,7 +884,11 @@ int MarkerData::DecodeCode(int orientation, BitsetExt *bs, int *erroneous, int *
 			(*total)++;
 		}
 	}
+	return DecodeHamming(bs, erroneous, content_type);
+}
 
+int MarkerData::DecodeHamming(BitsetBuffer *bs, int *erroneous, unsigned char* content_type)
+{
 	unsigned char flags = 0;
 	int errors = 0;
 
@@ -801,7 +896,8 @@ int MarkerData::DecodeCode(int orientation, BitsetExt *bs, int *erroneous, int *
 	// hamming(8,4) coded number
 	if(bs->Length() > 16){
 		// read header (8-bit hamming(8,4) -> 4-bit flags)
-		BitsetExt header;
+		bool header_bits[HEADER_SIZE];
+		BitsetBuffer header(header_bits, HEADER_SIZE);
 
 		for(int i = 0; i < HEADER_SIZE; i++)
 			header.push_back(bs->pop_front());
@@ -826,14 +922,12 @@ int MarkerData::DecodeCode(int orientation, BitsetExt *bs, int *erroneous, int *
 	if (errors > 0) (*erroneous) += errors;
 	return errors;	
 }
-void MarkerData::Read6bitStr(BitsetExt *bs, char *s, size_t s_max_len) {
-	deque<bool> bits = bs->GetBits();
-	deque<bool>::const_iterator iter;
+void MarkerData::Read6bitStr(BitsetBuffer *bs, char *s, size_t s_max_len) {
 	size_t len = 0;
 	int bitpos = 5;
 	unsigned long c=0;
-	for (iter = bits.begin(); iter != bits.end(); iter++) {
-		if (*iter) c |= (0x01 << bitpos);
+	for (int i = 0; i < bs->Length(); i++) {
+		if ((*bs)[i]) c |= (0x01 << bitpos);
 		bitpos--;
 		if (bitpos < 0) {
 			if (c == 000)                      s[len] = ':';
@@ -879,12 +973,18 @@ bool MarkerData::DecodeContent(int *orientation) {
 	//bool decode(vector<int>& colors, int *orientation, double *error) {
 	*orientation = 0;
 
-	BitsetExt bs;
+	// The code bits are kept on the stack, so decoding does not allocate
+	FrameArenaScope scope(NULL);
+	BitsetBuffer bs(scope.Allocate<bool>(res*res), res*res);
 	int erroneous=0;
 	int total=0;
 
 	DecodeOrientation(&erroneous, &total, orientation);
 	int err = DecodeCode(*orientation, &bs, &erroneous, &total, &content_type);
+	return SetDecodedData(&bs, err, erroneous, total);
+}
+
+bool MarkerData::SetDecodedData(BitsetBuffer *bs, int err, int erroneous, int total) {
 	if(err == -1) {
 		// couldn't fix 
 		decode_error = DBL_MAX;
@@ -892,10 +992,10 @@ bool MarkerData::DecodeContent(int *orientation) {
 	}
 
 	if(content_type == MARKER_CONTENT_TYPE_NUMBER){
-		data.id = bs.ulong();
+		data.id = bs->ulong();
 	} 
 	else {
-		Read6bitStr(&bs, data.str, MAX_MARKER_STRING_LEN);
+		Read6bitStr(bs, data.str, MAX_MARKER_STRING_LEN);
 	}
 
 	decode_error = (double)(erroneous)/total;
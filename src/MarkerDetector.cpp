@@ -26,18 +26,81 @@
 template class ALVAR_EXPORT alvar::MarkerDetector<alvar::Marker>;
 template class ALVAR_EXPORT alvar::MarkerDetector<alvar::MarkerData>;
 template class ALVAR_EXPORT alvar::MarkerDetector<alvar::MarkerArtoolkit>;
+template class ALVAR_EXPORT alvar::MarkerDetector<alvar::MarkerDataRes<5> >;
+template class ALVAR_EXPORT alvar::MarkerDetector<alvar::MarkerDataRes<7> >;
+template class ALVAR_EXPORT alvar::MarkerDetector<alvar::MarkerDataRes<9> >;
+template class ALVAR_EXPORT alvar::MarkerDetector<alvar::MarkerDataRes<11> >;
 
 using namespace std;
 
 namespace alvar {
 	MarkerDetectorImpl::MarkerDetectorImpl() {
+		candidate = NULL;
+		image_cache = NULL;
+		motion_prior = NULL;
+		res = 0;
+		skipped_count = 0;
 		SetMarkerSize();
 		SetOptions();
+		SetTrackVerification();
+		SetCandidateCascade();
+		SetTimeBudget();
 		labeling = NULL;
 	}
 
 	MarkerDetectorImpl::~MarkerDetectorImpl() {
 		if (labeling) delete labeling;
+		for (size_t i=0; i<candidate_slots.size(); i++) delete candidate_slots[i].marker;
+	}
+
+	Marker* MarkerDetectorImpl::ResetCandidate() {
+		if (!candidate) {
+			size_t i = 0;
+			while ((i < candidate_slots.size()) &&
+				((candidate_slots[i].edge_length != edge_length) ||
+				 (candidate_slots[i].res != res) ||
+				 (candidate_slots[i].margin != margin))) i++;
+			if (i == candidate_slots.size()) {
+				CandidateSlot slot;
+				slot.edge_length = edge_length;
+				slot.res = res;
+				slot.margin = margin;
+				slot.marker = new_M(edge_length, res, margin);
+				slot.marker_edge_length = slot.marker->GetMarkerEdgeLength();
+				slot.marker_res = slot.marker->GetRes();
+				slot.marker_margin = slot.marker->GetMargin();
+				candidate_slots.push_back(slot);
+			}
+			candidate = candidate_slots[i].marker;
+			candidate_edge_length = candidate_slots[i].marker_edge_length;
+			candidate_res = candidate_slots[i].marker_res;
+			candidate_margin = candidate_slots[i].marker_margin;
+		}
+		// The resolution detection and the per id edge lengths resize the candidate
+		if ((candidate->GetMarkerEdgeLength() != candidate_edge_length) ||
+			(candidate->GetRes() != candidate_res) ||
+			(candidate->GetMargin() != candidate_margin))
+		{
+			candidate->SetMarkerSize(candidate_edge_length, candidate_res, candidate_margin);
+		}
+		candidate->SetError(Marker::MARGIN_ERROR, 0);
+		candidate->SetError(Marker::DECODE_ERROR, 0);
+		candidate->SetError(Marker::TRACK_ERROR, 0);
+		candidate->ros_orientation = -1;
+		candidate->content_age = 0;
+		return candidate;
+	}
+
+	void MarkerDetectorImpl::PushMarker(Marker *mn, bool tracked) {
+		_markers_push_back(mn);
+		detections.push_back(MarkerDetection());
+		mn->GetDetection(&detections.back(), tracked);
+	}
+
+	void MarkerDetectorImpl::SkipCandidate(const vector<PointDouble> &corners) {
+		if (skipped_count < skipped_candidates.size()) skipped_candidates[skipped_count] = corners;
+		else skipped_candidates.push_back(corners);
+		skipped_count++;
 	}
 
 	void MarkerDetectorImpl::TrackMarkersReset() {
@@ -46,8 +109,14 @@ namespace alvar {
 
 	void MarkerDetectorImpl::TrackMarkerAdd(int id, PointDouble corners[4]) {
     Marker *mn = new_M(edge_length, res, margin);
+		int id_res = res;
+		if ((res == 0) && (map_res.find(id) != map_res.end())) {
+			id_res = map_res[id];
+		}
 		if (map_edge_length.find(id) != map_edge_length.end()) {
-			mn->SetMarkerSize(map_edge_length[id], res, margin);
+			mn->SetMarkerSize(map_edge_length[id], id_res, margin);
+		} else if (id_res != res) {
+			mn->SetMarkerSize(edge_length, id_res, margin);
 		}
 
 		mn->SetId(id);
@@ -61,12 +130,47 @@ namespace alvar {
 	}
 
 	void MarkerDetectorImpl::SetMarkerSize(double _edge_length, int _res, double _margin) {
+		// The resolutions found by id stay valid for other edge lengths and margins,
+		// which the bundle node switches between on every frame
+		if (_res != res) {
+			map_res.clear();
+			known_res.clear();
+		}
 		edge_length = _edge_length;
 		res = _res;
 		margin = _margin;
 		map_edge_length.clear(); // TODO: Should we clear these here?
+		// The candidate of the new size is picked by the next ResetCandidate
+		candidate = NULL;
   }
 
+	bool MarkerDetectorImpl::DecodeKnownResolution(Marker *mn, vector<PointDouble> &corners, IplImage *gray, Camera *cam, double max_error, int *orientation) {
+		size_t tried = (known_res.size() < MAX_KNOWN_RES_TRIED ? known_res.size() : (size_t)MAX_KNOWN_RES_TRIED);
+		for (size_t i=0; i<tried; i++) {
+			mn->SetMarkerSize(candidate_edge_length, known_res[i], candidate_margin);
+			mn->SetError(Marker::MARGIN_ERROR, 0);
+			mn->SetError(Marker::DECODE_ERROR, 0);
+			if (!mn->UpdateContent(corners, gray, cam, 0, &arena)) continue;
+			if (!mn->DecodeContent(orientation)) continue;
+			if (mn->GetError(Marker::MARGIN_ERROR | Marker::DECODE_ERROR) > max_error) continue;
+			map<unsigned long, int>::const_iterator iter = map_res.find(mn->GetId());
+			if ((iter != map_res.end()) && (iter->second == known_res[i])) return true;
+		}
+		return false;
+	}
+
+	void MarkerDetectorImpl::RememberResolution(Marker *mn) {
+		int detected_res = mn->GetRes();
+		map_res[mn->GetId()] = detected_res;
+		// Move the resolution to the front, the ones seen lately are tried first
+		vector<int>::iterator iter = find(known_res.begin(), known_res.end(), detected_res);
+		if (iter == known_res.end()) {
+			known_res.insert(known_res.begin(), detected_res);
+		} else {
+			rotate(known_res.begin(), iter, iter + 1);
+		}
+	}
+
 	void MarkerDetectorImpl::SetMarkerSizeForId(unsigned long id, double _edge_length) {
 		map_edge_length[id] = _edge_length;
 	}
@@ -75,6 +179,25 @@ namespace alvar {
 		detect_pose_grayscale = _detect_pose_grayscale;
 	}
 
+	void MarkerDetectorImpl::SetTrackVerification(int _verify_interval, double _verify_track_error) {
+		verify_interval = _verify_interval;
+		verify_track_error = _verify_track_error;
+	}
+
+	void MarkerDetectorImpl::SetCandidateCascade(bool _enabled, int _min_contrast, double _max_side_ratio) {
+		cascade_enabled = _enabled;
+		cascade_min_contrast = _min_contrast;
+		cascade_max_side_ratio = _max_side_ratio;
+	}
+
+	void MarkerDetectorImpl::SetTimeBudget(double _time_budget) {
+		time_budget = _time_budget;
+	}
+
+	bool MarkerDetectorImpl::BudgetExceeded() {
+		return (time_budget > 0) && (budget_timer.stop() > time_budget);
+	}
+
 	int MarkerDetectorImpl::Detect(IplImage *image,
 			   Camera *cam,
 			   bool track,
@@ -86,22 +209,39 @@ namespace alvar {
 	{
 		assert(image->origin == 0); // Currently only top-left origin supported
 		double error=-1;
+		budget_timer.start();
 
 		// Swap marker tables
 		_swap_marker_tables();
 		_markers_clear();
+		detections.clear();
+		skipped_count = 0;
+		arena.Reset();
 
 		switch(labeling_method)
 		{
 			case CVSEQ :
 		
-				if(!labeling)
+				if(!dynamic_cast<LabelingCvSeq*>(labeling)) {
+					delete labeling;
 					labeling = new LabelingCvSeq();
+				}
 				((LabelingCvSeq*)labeling)->SetOptions(detect_pose_grayscale);
 				break;
+
+			case RUNLENGTH :
+
+				if(!dynamic_cast<LabelingRunLength*>(labeling)) {
+					delete labeling;
+					labeling = new LabelingRunLength();
+				}
+				break;
 		}
 
 		labeling->SetCamera(cam);
+		labeling->SetArena(&arena);
+		labeling->SetImageCache(image_cache);
+		labeling->SetCascadeParams(cascade_enabled, cascade_min_contrast, cascade_max_side_ratio);
 		labeling->LabelSquares(image, visualize);
 		vector<vector<PointDouble> >& blob_corners = labeling->blob_corners;
 		IplImage* gray = labeling->gray;
@@ -109,8 +249,23 @@ namespace alvar {
 		int orientation;
 
 		// When tracking we find the best matching blob and test if it is near enough?
+		bool out_of_time = false;
+		if (track && motion_prior) {
+			// Move the corners of the previous frame by the predicted image motion
+			motion_prior->Track(gray);
+			for (size_t ii=0; ii<_track_markers_size(); ii++) {
+				vector<PointDouble> &corners = _track_markers_at(ii)->marker_corners_img;
+				for (size_t k=0; k<corners.size(); k++) {
+					motion_prior->Compensate(&corners[k].x, &corners[k].y);
+				}
+			}
+		}
 		if (track) {
 			for (size_t ii=0; ii<_track_markers_size(); ii++) {
+				if (BudgetExceeded()) {
+					out_of_time = true;
+					break;
+				}
 				Marker *mn = _track_markers_at(ii);
 				if (mn->GetError(Marker::DECODE_ERROR|Marker::MARGIN_ERROR) > 0) continue; // We track only perfectly decoded markers
 				int track_i=-1;
@@ -129,9 +284,24 @@ namespace alvar {
 					mn->SetError(Marker::DECODE_ERROR, 0);
 					mn->SetError(Marker::MARGIN_ERROR, 0);
 					mn->SetError(Marker::TRACK_ERROR, track_error);
-                    mn->UpdateContent(blob_corners[track_i], gray, cam);    //Maybe should only do this when kinect is being used? Don't think it hurts anything...
-					mn->UpdatePose(blob_corners[track_i], cam, track_orientation, update_pose);
-					_markers_push_back(mn);
+					// The corner match already identifies the marker, so the content is
+					// only read again periodically or when the marker moved a lot
+					if ((mn->content_age+1 >= verify_interval) || (track_error > verify_track_error)) {
+						unsigned long id = mn->GetId();
+						int decode_orientation;
+						if (!mn->UpdateContent(blob_corners[track_i], gray, cam, 0, &arena) ||
+							!mn->DecodeContent(&decode_orientation) ||
+							(mn->GetId() != id))
+						{
+							continue; // Lost the track, the blob is handled as a new marker below
+						}
+						mn->SetError(Marker::DECODE_ERROR, 0);
+						mn->content_age = 0;
+					} else {
+						mn->content_age++;
+					}
+					mn->UpdatePose(blob_corners[track_i], cam, track_orientation, 0, update_pose, &arena);
+					PushMarker(mn, true);
 					blob_corners[track_i].clear(); // We don't want to handle this again...
 					if (visualize) mn->Visualize(image, cam, CV_RGB(255,255,0));
 				}
@@ -139,29 +309,65 @@ namespace alvar {
 		}
 
 		// Now we go through the rest of the blobs -- in case there are new markers...
+		// With a time budget the largest blobs are handled first, so that the budget
+		// is spent on the candidates most likely to be markers
+		FrameArenaScope scope(&arena);
+		std::pair<double, int> *order = scope.Allocate<std::pair<double, int> >(blob_corners.size());
+		size_t order_count = 0;
 		for(size_t i = 0; i < blob_corners.size(); ++i)
 		{
 			if (blob_corners[i].empty()) continue;
+			double area = 0;
+			if (time_budget > 0) {
+				vector<PointDouble> &c = blob_corners[i];
+				for (size_t k = 0; k < c.size(); ++k) {
+					const PointDouble &p0 = c[k];
+					const PointDouble &p1 = c[(k+1)%c.size()];
+					area += p0.x*p1.y - p1.x*p0.y;
+				}
+			}
+			order[order_count++] = std::make_pair(-fabs(area), (int)i); // Ties keep the contour order
+		}
+		if (time_budget > 0) std::sort(order, order+order_count);
 
-			Marker *mn = new_M(edge_length, res, margin);
-			bool ub = mn->UpdateContent(blob_corners[i], gray, cam);
-            bool db = mn->DecodeContent(&orientation); 
+		for(size_t oi = 0; oi < order_count; ++oi)
+		{
+			size_t i = order[oi].second;
+			if (out_of_time || BudgetExceeded()) {
+				out_of_time = true;
+				SkipCandidate(blob_corners[i]);
+				continue;
+			}
+
+			Marker *mn = ResetCandidate();
+			bool ub, db;
+			// With automatic resolution the markers seen before are first read with their
+			// known resolution, so the resolution detection only runs for new ids
+			if ((res == 0) && DecodeKnownResolution(mn, blob_corners[i], gray, cam, max_new_marker_error, &orientation)) {
+				ub = db = true;
+			} else {
+				if (res == 0) mn = ResetCandidate();
+				ub = mn->UpdateContent(blob_corners[i], gray, cam, 0, &arena);
+				db = mn->DecodeContent(&orientation); 
+			}
 			if (ub && db &&
 				(mn->GetError(Marker::MARGIN_ERROR | Marker::DECODE_ERROR) <= max_new_marker_error))
 			{
+				if (res == 0) RememberResolution(mn);
 				if (map_edge_length.find(mn->GetId()) != map_edge_length.end()) {
-					mn->SetMarkerSize(map_edge_length[mn->GetId()], res, margin);
+					// Keep the detected resolution of the marker
+					mn->SetMarkerSize(map_edge_length[mn->GetId()], mn->GetRes(), margin);
 				}
-				mn->UpdatePose(blob_corners[i], cam, orientation, update_pose);
+				mn->UpdatePose(blob_corners[i], cam, orientation, 0, update_pose, &arena);
                 mn->ros_orientation = orientation;
-				_markers_push_back(mn);
+				PushMarker(mn, false);
  
 				if (visualize) mn->Visualize(image, cam, CV_RGB(255,0,0));
 			}
-
-			delete mn;
 		}
 
+		_markers_trim();
+		skipped_candidates.resize(skipped_count);
 		return (int) _markers_size();
 	}
 
@@ -193,8 +399,8 @@ namespace alvar {
 				mn->SetError(Marker::DECODE_ERROR, 0);
 				mn->SetError(Marker::MARGIN_ERROR, 0);
 				mn->SetError(Marker::TRACK_ERROR, track_error);
-				mn->UpdatePose(blob_corners[track_i], cam, track_orientation);
-				_markers_push_back(mn);
+				mn->UpdatePose(blob_corners[track_i], cam, track_orientation, 0, true, &arena);
+				PushMarker(mn, true);
 				count++;
 				blob_corners[track_i].clear(); // We don't want to handle this again...
 
@@ -203,6 +409,7 @@ namespace alvar {
 				}
 			}
 		}
+		_markers_trim();
 		return count;
 	}
 
@@ -358,7 +358,7 @@ double MultiMarker::_GetPose(MarkerIterator &begin, MarkerIterator &end, Camera*
 
 		// But only if we have corresponding points in the pointcloud
 		if (marker_status[index] > 0) {
-			for(size_t j = 0; j < marker->marker_corners.size(); ++j)
+			for(size_t j = 0; j < marker->GetMarkerCorners().size(); ++j)
 			{
 				CvPoint3D64f Xnew = pointcloud[pointcloud_index(id, (int)j)];
 				world_points.push_back(Xnew);
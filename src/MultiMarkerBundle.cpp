@@ -90,7 +90,7 @@ void Est(CvMat* state, CvMat* estimation, void *param)
 
 			cvProjectPoints2(&mat_object_points, &mat_rotation_vector,
 				&mat_translation_vector, &(camera->calib_K),
-				&(camera->calib_D), &mat_proj);
+				camera->Distortion(), &mat_proj);
 
 			index = i*n_points*2 + j*2;
 			estimation->data.db[index+0] = proj[0];
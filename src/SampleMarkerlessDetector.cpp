@@ -158,6 +158,8 @@ int main(int argc, char *argv[])
                 delete cap;
                 return 1;
             }
+            // Classify the keypoints on all cores
+            fernDetector.setThreadCount(0);
 
             std::stringstream settingsFilename;
             settingsFilename << "camera_settings_" << uniqueName << ".xml";
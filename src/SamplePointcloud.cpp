@@ -102,7 +102,7 @@ void videocallback(IplImage *image)
         own_drawable_count=0;
 
         // Draw features
-        std::map<int, SimpleSfM::Feature>::iterator iter;
+        SimpleSfM::FeatureMap::iterator iter;
         iter = sfm->container.begin();
         for(;iter != sfm->container.end(); iter++) {
 			if (sfm->container_triangulated.find(iter->first) !=  sfm->container_triangulated.end()) continue;
@@ -210,6 +210,7 @@ int main(int argc, char *argv[])
         CvTestbed::Instance().SetKeyCallback(keycallback);
         CvTestbed::Instance().SetVideoCallback(videocallback);
         sfm = new SimpleSfM();
+        sfm->SetThreadCount(0); // One thread per core
 
         // Enumerate possible capture plugins
         CaptureFactory::CapturePluginVector plugins = CaptureFactory::instance()->enumeratePlugins();
@@ -21,7 +21,10 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "SfM.h"
+#include "ar_track_alvar/SfM.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace alvar {
 
@@ -151,6 +154,82 @@ void CreateShadowPoint(CvPoint3D32f &p3d_sh, CvPoint3D32f p3d, CameraEC *cam, Po
 	//std::cout<<"psh: "<<p3d_sh.x<<","<<p3d_sh.y<<","<<p3d_sh.z<<std::endl;	
 }
 
+int SimpleSfM::ParallelThreads() const {
+#ifdef _OPENMP
+	if (thread_count > 0) return thread_count;
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+float SimpleSfM::Reproject(Pose *pose, int type_id, bool needs_has_p2d, float average_outlier_limit) {
+	float limit_sq = average_outlier_limit*average_outlier_limit;
+	int n = (int)container.size();
+	reproj_dist_sq.resize(n);
+	FeatureMap::iterator items = container.begin();
+	#pragma omp parallel for num_threads(ParallelThreads())
+	for (int i=0; i<n; i++) {
+		Feature &f = items[i].second;
+		reproj_dist_sq[i] = -1.f;
+		if (needs_has_p2d && !f.has_p2d) continue;
+		if ((type_id != -1) && (type_id != f.type_id)) continue;
+		cam.ProjectPoint(f.p3d, pose, f.projected_p2d);
+		cam.ProjectPoint(f.p3d_sh, pose, f.projected_p2d_sh);
+		float dist_sq = (f.p2d.x-f.projected_p2d.x)*(f.p2d.x-f.projected_p2d.x);
+		dist_sq      += (f.p2d.y-f.projected_p2d.y)*(f.p2d.y-f.projected_p2d.y);
+		if ((limit_sq == 0) || (dist_sq < limit_sq)) reproj_dist_sq[i] = dist_sq;
+	}
+	// Summed in id order so that the result does not depend on the threads
+	float reprojection_sum=0.f;
+	int   reprojection_count=0;
+	for (int i=0; i<n; i++) {
+		if (reproj_dist_sq[i] < 0) continue;
+		reprojection_sum += sqrt(reproj_dist_sq[i]);
+		reprojection_count++;
+	}
+	if (reprojection_count == 0) return 0.f;
+	return reprojection_sum/reprojection_count;
+}
+
+/** \brief Decides which features are erased in step #7 of \e SimpleSfM::Update ; the
+ *  features that are kept may lose their 3D-coordinates. The features are tested in id
+ *  order in one pass over the container.
+ */
+class PoorFeatureTest {
+	SimpleSfM::FeatureMap &container_triangulated;
+	float reproj_err_limit_sq;
+	size_t min_triangulate;
+public:
+	PoorFeatureTest(SimpleSfM::FeatureMap &_container_triangulated, float _reproj_err_limit_sq, size_t _min_triangulate)
+		: container_triangulated(_container_triangulated), reproj_err_limit_sq(_reproj_err_limit_sq), min_triangulate(_min_triangulate) {}
+	bool operator()(std::pair<int, SimpleSfM::Feature> &item) const {
+		SimpleSfM::Feature &f = item.second;
+		if (f.type_id <= 0) return false;
+		if ((f.estimation_type == 0) || !f.has_p2d || !f.has_p3d) return false;
+		// Note that the projected_p2d needs to have valid content at this point
+		double dist_sq = (f.p2d.x-f.projected_p2d.x)*(f.p2d.x-f.projected_p2d.x);
+		dist_sq       += (f.p2d.y-f.projected_p2d.y)*(f.p2d.y-f.projected_p2d.y);
+
+		if (f.estimation_type == 1) {
+			if (dist_sq > (reproj_err_limit_sq)) f.has_p3d = false;
+		} else if (f.estimation_type == 2) {
+			if (dist_sq > (reproj_err_limit_sq)) return true;
+		} else if (f.estimation_type == 3) {
+			if (container_triangulated.size() < min_triangulate) {
+				if (dist_sq > (reproj_err_limit_sq)) return true;
+			} else {
+				if (dist_sq > (reproj_err_limit_sq)) f.has_p3d = false;
+				if (dist_sq > (reproj_err_limit_sq*2)) {
+					container_triangulated.erase(item.first);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+};
+
 bool SimpleSfM::Update(IplImage *image, bool assume_plane, bool triangulate, float reproj_err_limit, float triangulate_angle) {
 	const int min_triangulate=50, max_triangulate=150;
 	const float plane_dist_limit = 100.f;
@@ -158,10 +237,10 @@ bool SimpleSfM::Update(IplImage *image, bool assume_plane, bool triangulate, flo
 	const float parallax_length = 10.f;
 	const float parallax_length_sq = parallax_length*parallax_length;
 	float reproj_err_limit_sq = reproj_err_limit*reproj_err_limit;
-	std::map<int, Feature>::iterator  iter;
-	std::map<int, Feature>::iterator iter_end = container.end();
+	FeatureMap::iterator iter;
 
 	// #1. Detect marker corners and track features
+	image_cache.SetImage(image);
 	marker_detector.Detect(image, &cam, container, 0, 0, 1023, true, false);
 	tf.Purge();
 	tf.Track(image, 0, container, 1); // Track without adding features
@@ -175,9 +254,9 @@ bool SimpleSfM::Update(IplImage *image, bool assume_plane, bool triangulate, flo
 	if (!pose_ok) return false;
 
 	// #3. Reproject features and their shadows
-	double err_markers  = cam.Reproject(container, &pose, 0, true, false, 100);
+	double err_markers  = Reproject(&pose, 0, true, 100);
 	if (err_markers > reproj_err_limit*2) { Reset(false); return false;}
-	double err_features = cam.Reproject(container, &pose, 1, false, false, 100);
+	double err_features = Reproject(&pose, 1, false, 100);
 	if ((err_markers == 0) && (err_features > reproj_err_limit*2)) {
 		// Error is so large, that we just are satisfied we have some pose
 		// Don't triangulate and remove points based on this result
@@ -199,9 +278,10 @@ bool SimpleSfM::Update(IplImage *image, bool assume_plane, bool triangulate, flo
 				{
 					CvScalar s = cvGet2D(mask, int(iter->second.projected_p2d.y), int(iter->second.projected_p2d.x));
 					if (s.val[0] == 0) {
-						container[iter->first] = iter->second;
-						container[iter->first].estimation_type = 3;
-						container[iter->first].p2d = container[iter->first].projected_p2d;
+						Feature &f = container[iter->first];
+						f = iter->second;
+						f.estimation_type = 3;
+						f.p2d = f.projected_p2d;
 					}
 				}
 			}
@@ -212,9 +292,13 @@ bool SimpleSfM::Update(IplImage *image, bool assume_plane, bool triangulate, flo
 	// #5. Add other features to container
 	// Assume them initially on marker plane if (assume_plane == true)
 	tf.AddFeatures(container, 1, 1024, 0xffffff); //65535);
+	// The features are independent of each other in #5 and #6
+	int n = (int)container.size();
+	FeatureMap::iterator items = container.begin();
 	if (assume_plane) {
-		for (iter = container.begin(); iter != iter_end; iter++) {
-			Feature &f = iter->second;
+		#pragma omp parallel for num_threads(ParallelThreads())
+		for (int i=0; i<n; i++) {
+			Feature &f = items[i].second;
 			//if (f.type_id == 0) continue;
 			if (!f.has_p3d && f.estimation_type < 1) {
 				//cam.Get3dOnPlane(&pose, f.p2d, f.p3d);
@@ -238,8 +322,9 @@ bool SimpleSfM::Update(IplImage *image, bool assume_plane, bool triangulate, flo
 
 	// #6. Triangulate features with good parallax
 	if (triangulate) {
-		for (iter = container.begin(); iter != iter_end; iter++) {
-			Feature &f = iter->second;
+		#pragma omp parallel for num_threads(ParallelThreads())
+		for (int i=0; i<n; i++) {
+			Feature &f = items[i].second;
 			//if (f.type_id == 0) continue;
 			if (!f.has_p3d && !f.has_stored_pose) {
 				f.pose1 = pose;
@@ -268,48 +353,8 @@ bool SimpleSfM::Update(IplImage *image, bool assume_plane, bool triangulate, flo
 	}
 
 	// #7. Erase poor features
-	cam.Reproject(container, &pose, 1, false, false, 100); // TODO: Why again...
-	iter = container.begin();
-	while(iter != container.end()) {
-		bool iter_inc = true;
-		if (iter->second.type_id > 0) {
-			Feature &f = iter->second;
-			if ((f.estimation_type == 0) || !f.has_p2d || !f.has_p3d);
-			else {
-				// Note that the projected_p2d needs to have valid content at this point
-				double dist_sq = (f.p2d.x-f.projected_p2d.x)*(f.p2d.x-f.projected_p2d.x);
-				dist_sq       += (f.p2d.y-f.projected_p2d.y)*(f.p2d.y-f.projected_p2d.y);
-
-				if (f.estimation_type == 1) {
-					if (dist_sq > (reproj_err_limit_sq)) f.has_p3d = false;
-				} else if (f.estimation_type == 2) {
-					if (dist_sq > (reproj_err_limit_sq)) {
-						container.erase(iter++);
-						iter_inc = false;
-					}
-				} else if (f.estimation_type == 3) {
-					if (container_triangulated.size() < min_triangulate) {
-						if (dist_sq > (reproj_err_limit_sq)) {
-							container.erase(iter++);
-							iter_inc = false;
-						}
-					} else {
-						if (dist_sq > (reproj_err_limit_sq)) f.has_p3d = false;
-						if (dist_sq > (reproj_err_limit_sq*2)) {
-							std::map<int, Feature>::iterator iter_tmp;
-							iter_tmp = container_triangulated.find(iter->first);
-							if (iter_tmp != container_triangulated.end()) {
-								container_triangulated.erase(iter_tmp);
-							}
-							container.erase(iter++);
-							iter_inc = false;
-						}
-					}
-				}
-			}
-		}
-		if (iter_inc) iter++;
-	}
+	Reproject(&pose, 1, false, 100); // TODO: Why again...
+	container.EraseIf(PoorFeatureTest(container_triangulated, reproj_err_limit_sq, min_triangulate));
 
 	// #8. Remember good features that have little reprojection error while the parallax is noticeable
 	if (remember_3d_points && (container_triangulated.size() < max_triangulate)) {
@@ -337,6 +382,7 @@ bool SimpleSfM::Update(IplImage *image, bool assume_plane, bool triangulate, flo
 }
 
 bool SimpleSfM::UpdateTriangulateOnly(IplImage *image) {
+	image_cache.SetImage(image);
 	marker_detector.Detect(image, &cam, container, 0, 0, 1023, true, false);
 	tf.Purge();
 	tf.Track(image, 0, container, 1, 1024, 65535);
@@ -344,8 +390,8 @@ bool SimpleSfM::UpdateTriangulateOnly(IplImage *image) {
 	if (!pose_ok) pose_ok = cam.CalcExteriorOrientation(container, &pose);
 	else pose_ok = cam.UpdatePose(container, &pose);
 	if(pose_ok) update_tri = moving.UpdateDistance(&pose, scale);
-	std::map<int,Feature>::iterator iter = container.begin();
-	std::map<int,Feature>::iterator iter_end = container.end();
+	FeatureMap::iterator iter = container.begin();
+	FeatureMap::iterator iter_end = container.end();
 	for(;iter != iter_end; iter++) {
 		if (pose_ok && (iter->second.type_id == 1) && (!iter->second.has_stored_pose) && (!iter->second.has_p3d)) {
 			iter->second.pose1 = pose;
@@ -373,22 +419,21 @@ bool SimpleSfM::UpdateTriangulateOnly(IplImage *image) {
 		}
 	}
 	if (pose_ok) {
-		double err_markers  = cam.Reproject(container, &pose, 0, true, false, 100);
+		double err_markers  = Reproject(&pose, 0, true, 100);
 		if(err_markers > 30) { Reset(false); return false;}
-		double err_features = cam.Reproject(container, &pose, 1, false, false, 100);
+		Reproject(&pose, 1, false, 100);
 		cam.EraseUsingReprojectionError(container, 30, 1);
 	}
 	return pose_ok;
 }
 
 bool SimpleSfM::UpdateRotationsOnly(IplImage *image) {
+	image_cache.SetImage(image);
 	int n_markers = marker_detector.Detect(image, &cam, container, 0, 0, 1023, true, false);
 	static int n_markers_prev = 0;
 	tf.Purge();
 	tf.Track(image, 0, container, 1, 1024, 65535);
 	tf.EraseNonTracked(container, 1);
-	int type_id = -1;
-	if(n_markers>=1) type_id = 0;
 	if (n_markers==1)
 	{
 		pose_ok = cam.CalcExteriorOrientation(container, &pose, 0);
@@ -407,8 +452,8 @@ bool SimpleSfM::UpdateRotationsOnly(IplImage *image) {
 		if (n_markers_prev > 0) {
 			pose_difference.Reset();
 			pose_difference.Mirror(false, true, true);
-			std::map<int,Feature>::iterator iter = container.begin();
-			std::map<int,Feature>::iterator iter_end = container.end();
+			FeatureMap::iterator iter = container.begin();
+			FeatureMap::iterator iter_end = container.end();
 			for(;iter != iter_end; iter++) {
 				if ((iter->second.type_id == 1) && (iter->second.has_p2d)) {
 					CvPoint2D32f _p2d = iter->second.p2d;
@@ -434,8 +479,8 @@ bool SimpleSfM::UpdateRotationsOnly(IplImage *image) {
 	n_markers_prev = n_markers;
 	if (pose_ok) {
 		if (n_markers < 1) {
-			std::map<int,Feature>::iterator iter = container.begin();
-			std::map<int,Feature>::iterator iter_end = container.end();
+			FeatureMap::iterator iter = container.begin();
+			FeatureMap::iterator iter_end = container.end();
 			for(;iter != iter_end; iter++) {
 				if ((iter->second.type_id == 1) && (!iter->second.has_p3d) && (iter->second.has_p2d)) {
 					CvPoint2D32f _p2d = iter->second.p2d;
@@ -445,9 +490,9 @@ bool SimpleSfM::UpdateRotationsOnly(IplImage *image) {
 			}
 		}
 
-		double err_markers  = cam.Reproject(container, &pose, 0, true, false, 100);
+		double err_markers  = Reproject(&pose, 0, true, 100);
 		if(err_markers > 10) { Reset(false); return false;}
-		double err_features = cam.Reproject(container, &pose_difference, 1, false, false, 100);
+		Reproject(&pose_difference, 1, false, 100);
 		cam.EraseUsingReprojectionError(container, 10, 1);
 	}
 	return pose_ok;
@@ -455,8 +500,8 @@ bool SimpleSfM::UpdateRotationsOnly(IplImage *image) {
 
 void SimpleSfM::Draw(IplImage *rgba) {
 	if(markers_found) return;
-	std::map<int,Feature>::iterator iter = container.begin();
-	std::map<int,Feature>::iterator iter_end = container.end();
+	FeatureMap::iterator iter = container.begin();
+	FeatureMap::iterator iter_end = container.end();
 	for(;iter != iter_end;iter++) {
 		Feature &f = iter->second;
 		if (f.has_p2d) {
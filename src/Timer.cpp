@@ -21,9 +21,9 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "Timer.h"
+#include "ar_track_alvar/Timer.h"
 
-#include "Timer_private.h"
+#include "ar_track_alvar/Timer_private.h"
 
 namespace alvar {
 
@@ -21,7 +21,7 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "Timer_private.h"
+#include "ar_track_alvar/Timer_private.h"
 
 #include <time.h>
 
@@ -21,7 +21,7 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "TrackerFeatures.h"
+#include "ar_track_alvar/TrackerFeatures.h"
 #include <cv.h>
 
 using namespace std;
@@ -31,7 +31,7 @@ using namespace std;
 
 TrackerFeatures::TrackerFeatures(int _max_features, int _min_features, double _quality_level, double _min_distance, int _pyr_levels, int _win_size) :
 	x_res(0), y_res(0), frame_count(0), quality_level(0), min_distance(0), min_features(0), max_features(0), status(0),
-	img_eig(0), img_tmp(0), gray(0), prev_gray(0), pyramid(0), prev_pyramid(0), mask(0), next_id(0), win_size(0), pyr_levels(0),
+	img_eig(0), img_tmp(0), gray(0), prev_gray(0), pyramid(0), prev_pyramid(0), mask(0), next_id(0), win_size(0), pyr_levels(0), pyramid_ready(false), image_cache(0),
 	prev_features(0), features(0), prev_feature_count(0), feature_count(0), prev_ids(0), ids(0)
 {
 	next_id=1; // When this should be reset?
@@ -103,37 +103,101 @@ void TrackerFeatures::Reset() {
 }
 
 bool TrackerFeatures::DelFeature(int index) {
-	if (index > feature_count) return false;
+	if ((index < 0) || (index >= feature_count)) return false;
 	feature_count--;
 	for (int i=index; i<feature_count; i++) {
 		features[i] = features[i+1];
 		ids[i] = ids[i+1];
+		SetIdSlot(ids[i], i);
 	}
 	return true;
 }
 
-bool TrackerFeatures::DelFeatureId(int id) {
+void TrackerFeatures::SetIdSlot(int id, int slot) {
+	if (id < 0) return;
+	if (id >= (int)id_slot.size()) id_slot.resize(max(id+1, 2*(int)id_slot.size()), -1);
+	id_slot[id] = slot;
+}
+
+int TrackerFeatures::FeatureIndex(int id) {
+	if (id < 0) return -1;
+	if (id < (int)id_slot.size()) {
+		int slot = id_slot[id];
+		if ((slot >= 0) && (slot < feature_count) && (ids[slot] == id)) return slot;
+	}
+	// Not tracked, or the ids were written directly; only the live features are searched
 	for (int i=0; i<feature_count; i++) {
-		if (ids[i] == id) return DelFeature(i);
+		if (ids[i] == id) {
+			SetIdSlot(id, i);
+			return i;
+		}
 	}
-	return false;
+	return -1;
+}
+
+bool TrackerFeatures::DelFeatureId(int id) {
+	int index = FeatureIndex(id);
+	if (index < 0) return false;
+	return DelFeature(index);
 }
 
 int TrackerFeatures::Purge() {
 	int removed_count=0;
 	float dist = 0.7f*float(min_distance);
+	if ((feature_count < 2) || !(dist > 0)) return 0;
+
+	// The kept features are bucketed on a grid with cells of at least dist,
+	// so a feature closer than dist can only be in the same or in one of the
+	// eight neighbouring cells
+	float min_x = features[0].x, max_x = features[0].x;
+	float min_y = features[0].y, max_y = features[0].y;
 	for (int i=1; i<feature_count; i++) {
-		for (int ii=0; ii<i; ii++) {
-			float dx = features[i].x - features[ii].x;
-			float dy = features[i].y - features[ii].y;
-			if (dx < 0) dx = -dx; if (dy < 0) dy = -dy;
-			if ((dx < dist) && (dy < dist)) {
-				DelFeature(i); i--;
-				removed_count++;
-				break;
+		min_x = min(min_x, features[i].x); max_x = max(max_x, features[i].x);
+		min_y = min(min_y, features[i].y); max_y = max(max_y, features[i].y);
+	}
+	double cell = dist;
+	double max_cells = 4.0*feature_count;
+	if (((max_x-min_x)/cell+1)*((max_y-min_y)/cell+1) > max_cells) {
+		cell = std::sqrt(double(max_x-min_x+1)*double(max_y-min_y+1)/max_cells);
+		if (cell < dist) cell = dist;
+	}
+	int grid_w = int((max_x-min_x)/cell)+1;
+	int grid_h = int((max_y-min_y)/cell)+1;
+	grid_head.assign(grid_w*grid_h, -1);
+	grid_next.resize(feature_count);
+
+	// Compact the kept features in one pass; a feature is removed when it is
+	// too close to any earlier kept feature (the smaller ids are kept)
+	int kept=0;
+	for (int i=0; i<feature_count; i++) {
+		int cx = min(int((features[i].x-min_x)/cell), grid_w-1);
+		int cy = min(int((features[i].y-min_y)/cell), grid_h-1);
+		bool close = false;
+		for (int gy=max(cy-1, 0); (gy<=min(cy+1, grid_h-1)) && !close; gy++) {
+			for (int gx=max(cx-1, 0); (gx<=min(cx+1, grid_w-1)) && !close; gx++) {
+				for (int k=grid_head[gy*grid_w+gx]; k>=0; k=grid_next[k]) {
+					float dx = features[i].x - features[k].x;
+					float dy = features[i].y - features[k].y;
+					if (dx < 0) dx = -dx; if (dy < 0) dy = -dy;
+					if ((dx < dist) && (dy < dist)) {
+						close = true;
+						break;
+					}
+				}
 			}
 		}
+		if (close) {
+			removed_count++;
+			continue;
+		}
+		features[kept] = features[i];
+		ids[kept] = ids[i];
+		SetIdSlot(ids[kept], kept);
+		grid_next[kept] = grid_head[cy*grid_w+cx];
+		grid_head[cy*grid_w+cx] = kept;
+		kept++;
 	}
+	feature_count = kept;
 	return removed_count;
 }
 
@@ -155,6 +219,7 @@ double TrackerFeatures::TrackHid(IplImage *img, IplImage *new_features_mask, boo
 		prev_pyramid = cvCreateImage(cvSize(img->width+8,img->height/3), IPL_DEPTH_8U, 1);
 		mask = cvCreateImage(cvGetSize(img), IPL_DEPTH_8U, 1);
 		frame_count=0;
+		pyramid_ready=false;
 		if (min_distance == 0) {
 			min_distance = std::sqrt(double(img->width*img->height/max_features));
 			min_distance *= 0.8; //(double(min_features)/max_features);
@@ -164,14 +229,20 @@ double TrackerFeatures::TrackHid(IplImage *img, IplImage *new_features_mask, boo
 	IplImage* tmp;
 	CvPoint2D32f* tmp2;
 	CV_SWAP(prev_gray, gray, tmp);
+	CV_SWAP(prev_pyramid, pyramid, tmp);
 	CV_SWAP(prev_features, features, tmp2);
 	prev_feature_count=feature_count;
 	memcpy(prev_ids, ids, sizeof(int)*max_features);
-	if (img->nChannels == 1) {
+	if (image_cache && (image_cache->GetImage() == img)) {
+		cvCopy(image_cache->GetGray(), gray);
+	} else if (img->nChannels == 1) {
 		cvCopy(img, gray);
 	} else {
 		cvCvtColor(img, gray, CV_RGB2GRAY);
 	}
+	// The pyramid of the previous frame is reused when it was built
+	int lk_flags = (pyramid_ready ? CV_LKFLOW_PYR_A_READY : 0);
+	pyramid_ready = false;
 	// TODO: We used to add features here
 	//if (prev_feature_count < 1) return -1;
 	frame_count++;
@@ -179,16 +250,19 @@ double TrackerFeatures::TrackHid(IplImage *img, IplImage *new_features_mask, boo
 		memcpy(features, prev_features, sizeof(CvPoint2D32f)*prev_feature_count);
 		memcpy(ids, prev_ids, sizeof(int)*prev_feature_count);
 		feature_count = prev_feature_count;
+		for (int i=0; i<feature_count; i++) SetIdSlot(ids[i], i);
 	} else if (prev_feature_count > 0) {
 		// Track
 		cvCalcOpticalFlowPyrLK(prev_gray, gray, prev_pyramid, pyramid,
 			prev_features, features, prev_feature_count, cvSize(win_size, win_size), pyr_levels, status, 0,
-			cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,20,0.03), 0);
+			cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,20,0.03), lk_flags);
+		pyramid_ready = true;
 		feature_count=0;
 		for (int i=0; i<prev_feature_count; i++) {
 			if (!status[i]) continue;
 			features[feature_count] = features[i]; 
 			ids[feature_count] = prev_ids[i];
+			SetIdSlot(ids[feature_count], feature_count);
 			feature_count++;
 		}
 	}
@@ -250,6 +324,7 @@ int TrackerFeatures::AddFeatures(IplImage *new_features_mask) {
 		if (new_feature_count >= 1) {
 			for (int i=feature_count; i<feature_count+new_feature_count; i++) {
 				ids[i] = next_id;
+				SetIdSlot(ids[i], i);
 				next_id=((next_id+1)%(0x7fff));
 			}
 			feature_count += new_feature_count;
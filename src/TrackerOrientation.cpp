@@ -21,24 +21,133 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "TrackerOrientation.h"
-#include "Optimization.h"
+#include "ar_track_alvar/TrackerOrientation.h"
 
 using namespace std;
 
 namespace alvar {
 using namespace std;
 
-void TrackerOrientation::Project(CvMat* state, CvMat* projection, void *param)
+// Tukey weight of a residual, as in Optimization::CalcTukeyWeight
+static double TukeyWeight(double residual, double c)
 {
-	TrackerOrientation *tracker = (TrackerOrientation*)param;
-	int count = projection->rows;
-	CvMat rot_mat = cvMat(3, 1, CV_64F, &(state->data.db[0+0]));
+	double ret = (c*c)/6.0;
+	if(fabs(residual) <= c)
+	{
+		double tmp = 1.0-((residual/c)*(residual/c));
+		ret *= (1.0-tmp*tmp*tmp);
+	}
+	if(residual) return fabs(sqrt(ret)/residual);
+	return 1.0;
+}
+
+// Solves A*x = b for a symmetric positive definite 3x3 A (row-major) using Cholesky
+static bool SolveSymmetric3(const double A[9], const double b[3], double x[3])
+{
+	double l00 = A[0];
+	if(l00 <= 0) return false;
+	l00 = sqrt(l00);
+	double l10 = A[3]/l00;
+	double l20 = A[6]/l00;
+	double l11 = A[4] - l10*l10;
+	if(l11 <= 0) return false;
+	l11 = sqrt(l11);
+	double l21 = (A[7] - l20*l10)/l11;
+	double l22 = A[8] - l20*l20 - l21*l21;
+	if(l22 <= 0) return false;
+	l22 = sqrt(l22);
+	// L*y = b
+	double y0 = b[0]/l00;
+	double y1 = (b[1] - l10*y0)/l11;
+	double y2 = (b[2] - l20*y0 - l21*y1)/l22;
+	// L'*x = y
+	x[2] = y2/l22;
+	x[1] = (y1 - l21*x[2])/l11;
+	x[0] = (y0 - l10*x[1] - l20*x[2])/l00;
+	return true;
+}
+
+void TrackerOrientation::ProjectRotation(const double rot[3], int count, double *projections, double *jacobian)
+{
+	double rot_data[3] = {rot[0], rot[1], rot[2]};
 	double zeros[3] = {0};
+	CvMat rot_mat = cvMat(3, 1, CV_64F, rot_data);
 	CvMat zero_tra = cvMat(3, 1, CV_64F, zeros);
-	cvReshape(projection, projection, 2, 1);
-	cvProjectPoints2(tracker->_object_model, &rot_mat, &zero_tra, &(tracker->_camera->calib_K), &(tracker->_camera->calib_D), projection);
-	cvReshape(projection, projection, 1, count);
+	CvMat object_points = cvMat(count, 1, CV_64FC3, &_object_points[0]);
+	CvMat image_points = cvMat(count, 1, CV_64FC2, projections);
+	if(jacobian)
+	{
+		CvMat dpdrot = cvMat(2*count, 3, CV_64F, jacobian);
+		cvProjectPoints2(&object_points, &rot_mat, &zero_tra, &(_camera->calib_K), _camera->Distortion(), &image_points, &dpdrot);
+	}
+	else
+		cvProjectPoints2(&object_points, &rot_mat, &zero_tra, &(_camera->calib_K), _camera->Distortion(), &image_points);
+}
+
+double TrackerOrientation::OptimizeRotation(double rot[3], int count, double stop, int max_iter)
+{
+	// The steps and the stopping rule follow Optimization::Optimize with TUKEY_LM,
+	// but the Jacobian is the analytic one from cvProjectPoints2 and the normal
+	// equations are accumulated directly into 3x3
+	const int n_meas = 2*count;
+	double *obs  = &_observations[0];
+	double *proj = &_projections[0];
+	double *J    = &_jacobian[0];
+	double lambda = 0.001;
+	double error_old = 0;
+	for(int cntr = 0; ; ++cntr)
+	{
+		ProjectRotation(rot, count, proj, J);
+
+		double JtWJ[9] = {0}, JtWe[3] = {0};
+		error_old = 0;
+		for(int k = 0; k < n_meas; ++k)
+		{
+			double e = obs[k] - proj[k];
+			error_old += e*e;
+			double w = TukeyWeight(e, 3);
+			const double *j = J + 3*k;
+			for(int r = 0; r < 3; ++r)
+			{
+				double wj = w*j[r];
+				JtWe[r] += wj*e;
+				for(int c = 0; c <= r; ++c)
+					JtWJ[r*3+c] += wj*j[c];
+			}
+		}
+		error_old = sqrt(error_old);
+		JtWJ[1] = JtWJ[3]; JtWJ[2] = JtWJ[6]; JtWJ[5] = JtWJ[7];
+		JtWJ[0] += lambda; JtWJ[4] += lambda; JtWJ[8] += lambda;
+
+		double delta[3] = {0};
+		if(!SolveSymmetric3(JtWJ, JtWe, delta)) break;
+		double tmp_par[3] = {rot[0]+delta[0], rot[1]+delta[1], rot[2]+delta[2]};
+
+		ProjectRotation(tmp_par, count, proj);
+		double error_new = 0;
+		for(int k = 0; k < n_meas; ++k)
+			error_new += (obs[k]-proj[k])*(obs[k]-proj[k]);
+		error_new = sqrt(error_new);
+
+		if(error_new < error_old)
+		{
+			rot[0] = tmp_par[0]; rot[1] = tmp_par[1]; rot[2] = tmp_par[2];
+			lambda = lambda/10.0;
+		}
+		else
+		{
+			lambda = lambda*10.0;
+		}
+		if(lambda>10) lambda = 10;
+		if(lambda<0.00001) lambda = 0.00001;
+
+		double n1 = sqrt(delta[0]*delta[0] + delta[1]*delta[1] + delta[2]*delta[2]);
+		double n2 = sqrt(rot[0]*rot[0] + rot[1]*rot[1] + rot[2]*rot[2]);
+		if( ((n1/n2) < stop) ||
+			(cntr >= max_iter) )
+			break;
+	}
+	return error_old;
 }
 
 void TrackerOrientation::Reset()
@@ -59,10 +168,15 @@ bool TrackerOrientation::UpdatePose(IplImage *image)
 	int count_points = _F_v.size();
 	if(count_points < 6) return false;
 
-	CvMat* _M = cvCreateMat(count_points, 1, CV_64FC3);
-	CvMat* image_observations = cvCreateMat(count_points*2, 1, CV_64F); // [u v u v u v ...]'
+	// The buffers only grow, so they are allocated when the feature count increases
+	if((int)_observations.size() < count_points*2)
+	{
+		_object_points.resize(count_points*3);
+		_observations.resize(count_points*2);
+		_projections.resize(count_points*2);
+		_jacobian.resize(count_points*2*3);
+	}
 
-	//map<int,Feature>::iterator it;
 	int ind = 0;
 	for(map<int,Feature>::iterator it=_F_v.begin(); it!=_F_v.end(); it++)	
 	{
@@ -70,50 +184,22 @@ bool TrackerOrientation::UpdatePose(IplImage *image)
 			it->second.status3D  == Feature::IS_INITIAL)  && 
 			it->second.status2D  == Feature::IS_TRACKED)
 		{
-			_M->data.db[ind*3+0] = it->second.point3d.x;
-			_M->data.db[ind*3+1] = it->second.point3d.y;
-			_M->data.db[ind*3+2] = it->second.point3d.z;
+			_object_points[ind*3+0] = it->second.point3d.x;
+			_object_points[ind*3+1] = it->second.point3d.y;
+			_object_points[ind*3+2] = it->second.point3d.z;
 
-			image_observations->data.db[ind*2+0] = it->second.point.x;
-			image_observations->data.db[ind*2+1] = it->second.point.y;
+			_observations[ind*2+0] = it->second.point.x;
+			_observations[ind*2+1] = it->second.point.y;
 			ind++;
 		}
 	}
 
-	if(ind < 6)
-	{			
-		cvReleaseMat(&image_observations);
-		cvReleaseMat(&_M);
-		return false;		
-	}
+	if(ind < 6) return false;
 
 	double rot[3]; CvMat rotm = cvMat(3, 1, CV_64F, rot);
 	_pose.GetRodriques(&rotm);
-
-	CvMat* par = cvCreateMat(3, 1, CV_64F);
-	memcpy(&(par->data.db[0+0]), rot, 3*sizeof(double));
-	//par->data.db[3] = 0;
-
-	CvRect r; r.x = 0; r.y = 0; r.height = ind; r.width = 1;
-	CvMat Msub;
-	cvGetSubRect(_M, &Msub, r);
-	_object_model = &Msub;
-
-	r.height = 2*ind;
-	CvMat image_observations_sub;
-	cvGetSubRect(image_observations, &image_observations_sub, r);
-
-	alvar::Optimization *opt = new alvar::Optimization(3, 2*ind);
-	
-	double foo = opt->Optimize(par, &image_observations_sub, 0.0005, 5, Project, this, alvar::Optimization::TUKEY_LM);
-	memcpy(rot, &(par->data.db[0+0]), 3*sizeof(double));
+	OptimizeRotation(rot, ind, 0.0005, 5);
 	_pose.SetRodriques(&rotm);
-	
-	delete opt;
-
-	cvReleaseMat(&par);
-	cvReleaseMat(&image_observations);
-	cvReleaseMat(&_M);
 
 	return true;
 }
@@ -135,6 +221,8 @@ bool TrackerOrientation::UpdateRotationOnly(IplImage *gray, IplImage *image)
 	_ft.Track(_grsc);
 
 	// Go through image features and match to previous (_F_v)
+	// The outliers are dropped from the tracker in the same pass
+	int kept = 0;
 	for (int i = 0; i < _ft.feature_count; i++)
 	{
 		int id            = _ft.ids[i];
@@ -144,11 +232,13 @@ bool TrackerOrientation::UpdateRotationOnly(IplImage *gray, IplImage *image)
 		_F_v[id].status2D = Feature::IS_TRACKED;
 		
 		// Throw outlier away
-		if(_F_v[id].status3D == Feature::IS_OUTLIER)
-		{
-			_ft.DelFeature(i);
-		}			
+		if(_F_v[id].status3D == Feature::IS_OUTLIER) continue;
+
+		_ft.features[kept] = _ft.features[i];
+		_ft.ids[kept]      = id;
+		kept++;
 	}
+	_ft.feature_count = kept;
 
 	// Delete features that are not tracked
 //		map<int,Feature>::iterator 
@@ -21,13 +21,68 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "TrackerPsa.h"
+#include "ar_track_alvar/TrackerPsa.h"
 
 using namespace std;
 
 namespace alvar {
 using namespace std;
 
+// Adds the gray levels of the image (first channel) to the column sums \e hor
+// and the row sums \e ver. 8-bit images are read through row pointers.
+static void AccumulateProfiles(IplImage *img, long *hor, long *ver) {
+	if (img->depth != IPL_DEPTH_8U) {
+		for (int y=0; y<img->height; y++) {
+			for (int x=0; x<img->width; x++) {
+				unsigned char c = (unsigned char)cvGet2D(img, y, x).val[0];
+				hor[x] += c;
+				ver[y] += c;
+			}
+		}
+		return;
+	}
+	int channels = img->nChannels;
+	for (int y=0; y<img->height; y++) {
+		const unsigned char *row = (const unsigned char *)(img->imageData + y*img->widthStep);
+		long sum = 0;
+		if (channels == 1) {
+			for (int x=0; x<img->width; x++) hor[x] += row[x];
+			for (int x=0; x<img->width; x++) sum += row[x];
+		} else {
+			for (int x=0; x<img->width; x++) {
+				unsigned char c = row[x*channels];
+				hor[x] += c;
+				sum += c;
+			}
+		}
+		ver[y] += sum;
+	}
+}
+
+// Finds the shift s in the sequence 0, 1, -1, 2, -2, ... -(max_shift-1), (max_shift-1)
+// that minimizes the mean absolute difference between prof[x+s] and prev[x]
+// over the overlap 0 < x+s < n. Returns the best and the worst mean difference.
+static void ShiftSearch(const long *prof, const long *prev, int n, int max_shift,
+                        double *best_shift, long *best_factor, long *worst_factor)
+{
+	for (int s=0; s<max_shift; (s>0 ? s=-s : s=-s+1) ) {
+		int begin = std::max(1-s, 0);
+		int end = std::min(n-s, n);
+		if (end <= begin) continue;
+		const long *p = prof + s;
+		long factor=0;
+		for (int x=begin; x<end; x++) {
+			factor += labs(p[x] - prev[x]);
+		}
+		factor /= (end-begin);
+		if (factor < *best_factor) {
+			*best_factor=factor;
+			*best_shift=s;
+		}
+		if (factor > *worst_factor) *worst_factor=factor;
+	}
+}
+
 TrackerPsa::TrackerPsa(int _max_shift) {
 	max_shift = _max_shift;
 	x_res = 0; y_res = 0;
@@ -70,13 +125,7 @@ double TrackerPsa::Track(IplImage *img) {
 	// Make shift tables
 	memset(hor, 0, sizeof(long)*x_res);
 	memset(ver, 0, sizeof(long)*y_res);
-	for (int y=0; y<y_res; y++) {
-		for (int x=0; x<x_res; x++) {
-			unsigned char c = (unsigned char)cvGet2D(img, y, x).val[0];
-			hor[x] += c;
-			ver[y] += c;
-		}
-	}
+	AccumulateProfiles(img, hor, ver);
 
 	// If this is first frame -- no motion
 	if (framecount == 1) {
@@ -85,42 +134,8 @@ double TrackerPsa::Track(IplImage *img) {
 
 	// Otherwais detect for motion
 	else {
-		// Sequence for s: 0, 1, -1, 2, -2, ... -(max_shift-1), (max_shift-1)
-		for (int s=0; s<max_shift; (s>0 ? s=-s : s=-s+1) ) {
-			long factor=0;
-			long factorfirst=0;
-			int count=0;
-			for (int x=0; x<x_res; x++) {
-				int x2 = x+s;
-				if ((x2 > 0) && (x2<x_res)) {
-					factor += labs(hor[x2] - horprev[x]);
-					count++;
-				}
-			}
-			factor /= count;
-			if (factor < best_x_factor) {
-				best_x_factor=factor;
-				xd=s;
-			}
-			if (factor > worst_x_factor) worst_x_factor=factor;
-		}
-		for (int s=0; s<max_shift; (s>0 ? s=-s : s=-s+1)) {
-			long factor=0;
-			int count=0;
-			for (int y=0; y<y_res; y++) {
-				int y2 = y+s;
-				if ((y2 > 0) && (y2<y_res)) {
-					factor += labs(ver[y2] - verprev[y]);
-					count++;
-				}
-			}
-			factor /= count;
-			if (factor < best_y_factor) {
-				best_y_factor=factor;
-				yd=s;
-			}
-			if (factor > worst_y_factor) worst_y_factor=factor;
-		}
+		ShiftSearch(hor, horprev, x_res, max_shift, &xd, &best_x_factor, &worst_x_factor);
+		ShiftSearch(ver, verprev, y_res, max_shift, &yd, &best_y_factor, &worst_y_factor);
 		// Figure out the quality?
 		// We assume the result is poor if the 
 		// worst factor is very near the best factor
@@ -150,12 +165,59 @@ TrackerPsaRot::TrackerPsaRot(int _max_shift) : TrackerPsa(_max_shift) {
 	rot=new double [360];
 	rotprev=new double[360];
 	rot_count=new int[360];
+	theta=0;
+	theta_x_res=0; theta_y_res=0;
 }
 
 TrackerPsaRot::~TrackerPsaRot() {
 	if (rot) delete [] rot;
 	if (rotprev) delete [] rotprev;
 	if (rot_count) delete [] rot_count;
+	if (theta) delete [] theta;
+}
+
+void TrackerPsaRot::AngleProfile(IplImage *img, int dx, int dy, double *profile) {
+	// The angles of all pixels around the image center are computed once per
+	// resolution. The table is padded by max_shift, so that the angles around
+	// the center moved by (dx, dy) are found at an offset.
+	int pad = max_shift;
+	int stride = x_res+2*pad;
+	if ((theta_x_res != x_res) || (theta_y_res != y_res)) {
+		if (theta) delete [] theta;
+		theta = new unsigned short [stride*(y_res+2*pad)];
+		for (int ty=0; ty<y_res+2*pad; ty++) {
+			for (int tx=0; tx<stride; tx++) {
+				double y2 = (ty-pad)-(y_res/2);
+				double x2 = (tx-pad)-(x_res/2);
+				int t = int(atan2((double)y2, (double)x2)*180/3.14159265);
+				if (t < 0) t+=360;
+				theta[ty*stride+tx] = (unsigned short)t;
+			}
+		}
+		theta_x_res = x_res;
+		theta_y_res = y_res;
+	}
+
+	memset(profile, 0, sizeof(double)*360);
+	memset(rot_count, 0, sizeof(int)*360);
+	for (int y=0; y<y_res; y++) {
+		const unsigned short *t = theta + (y-dy+pad)*stride + (pad-dx);
+		if ((img->depth == IPL_DEPTH_8U) && (img->nChannels == 1)) {
+			const unsigned char *row = (const unsigned char *)(img->imageData + y*img->widthStep);
+			for (int x=0; x<x_res; x++) {
+				profile[t[x]] += row[x];
+				rot_count[t[x]] ++;
+			}
+		} else {
+			for (int x=0; x<x_res; x++) {
+				profile[t[x]] += (unsigned char)cvGet2D(img, y, x).val[0];
+				rot_count[t[x]] ++;
+			}
+		}
+	}
+	for (int i=0; i<360; i++) {
+		profile[i] /= rot_count[i];
+	}
 }
 
 double TrackerPsaRot::Track(IplImage *img) {
@@ -166,26 +228,7 @@ double TrackerPsaRot::Track(IplImage *img) {
 		rotd=0;
 	}
 	else {
-		memset(rot, 0, sizeof(double)*360);
-		memset(rot_count, 0, sizeof(int)*360);
-		for (int y=0; y<y_res; y++) {
-			for (int x=0; x<x_res; x++) {
-				double y2 = y-(y_res/2)-(yd);
-				double x2 = x-(x_res/2)-(xd);
-				double r = sqrt((double)y2*y2 + x2*x2);
-				int theta = int(atan2((double)y2, (double)x2)*180/3.14159265);
-				if (theta < 0) theta+=360;
-				if ((y >= 0) && (y < img->height) &&
-					(x >= 0) && (x < img->width))
-				{
-					rot[theta] += (unsigned char)cvGet2D(img, y, x).val[0];
-					rot_count[theta] ++;
-				}
-			}
-		}
-		for (int i=0; i<360; i++) {
-			rot[i] /= rot_count[i];
-		}
+		AngleProfile(img, int(xd), int(yd), rot);
 		for (int s=0; s<45; (s>0 ? s=-s : s=-s+1)) {
 			long factor=0;
 			for (int theta=0; theta<360; theta++) {
@@ -201,26 +244,7 @@ double TrackerPsaRot::Track(IplImage *img) {
 		}
 	}
 	// Remember rotation based on center
-	memset(rotprev, 0, sizeof(double)*360);
-	memset(rot_count, 0, sizeof(int)*360);
-	for (int y=0; y<y_res; y++) {
-		for (int x=0; x<x_res; x++) {
-			double y2 = y-(y_res/2);
-			double x2 = x-(x_res/2);
-			double r = sqrt((double)y2*y2 + x2*x2);
-			int theta = int(atan2((double)y2, (double)x2)*180/3.14159265);
-			if (theta < 0) theta+=360;
-			if ((y >= 0) && (y < img->height) &&
-				(x >= 0) && (x < img->width))
-			{
-				rotprev[theta] += (unsigned char)cvGet2D(img, y, x).val[0];
-				rot_count[theta] ++;
-			}
-		}
-	}
-	for (int i=0; i<360; i++) {
-		rotprev[i] /= rot_count[i];
-	}
+	AngleProfile(img, 0, 0, rotprev);
 	return conf1 + best_rot_factor;
 }
 
@@ -21,80 +21,89 @@
  * <http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html>.
  */
 
-#include "TrackerStat.h"
+#include "ar_track_alvar/TrackerStat.h"
 
 using namespace std;
 
 namespace alvar {
 using namespace std;
 
-TrackerStat::TrackerStat(int binsize) : f(100,90) {
+TrackerStat::TrackerStat(int binsize, int max_features, int min_features) : f(max_features, min_features) {
 	hist.AddDimension(binsize); // x
 	hist.AddDimension(binsize); // y
 }
 
+void TrackerStat::SetFeatureBudget(int max_features, int min_features) {
+	f.ChangeSettings(max_features, min_features);
+}
+
 void TrackerStat::Reset() {
 	f.Reset();
 }
 
-double TrackerStat::Track(IplImage *img) 
+void TrackerStat::TrackMatches(IplImage *img)
 {
-	if (img == NULL) return -1;
 	f.Track(img);
+	// The features that survive tracking keep their relative order and the new
+	// ones are appended after them, so the ids can be paired in one merge pass
+	matches.clear();
+	int p = 0;
+	for (int c=0; c<f.feature_count; c++) {
+		while ((p < f.prev_feature_count) && (f.prev_ids[p] != f.ids[c])) p++;
+		if (p >= f.prev_feature_count) break; // The rest are new features
+		matches.push_back(make_pair(p, c));
+		p++;
+	}
+}
+
+double TrackerStat::VoteTranslation()
+{
 	hist.Clear();
-	for (int p=0; p<f.prev_feature_count ; p++) {
-		for (int c=0; c<f.feature_count; c++) {
-			if (f.prev_ids[p] != f.ids[c]) continue;
-			float x = f.features[c].x - f.prev_features[p].x;
-			float y = f.features[c].y - f.prev_features[p].y;
-			hist.Inc(x, y);
-		}
+	for (size_t m=0; m<matches.size(); m++) {
+		int p = matches[m].first, c = matches[m].second;
+		float x = f.features[c].x - f.prev_features[p].x;
+		float y = f.features[c].y - f.prev_features[p].y;
+		hist.Inc(x, y);
 	}
 	xd = 0; yd = 0;
 	return hist.GetMax(&xd, &yd);
 }
 
+double TrackerStat::Track(IplImage *img) 
+{
+	if (img == NULL) return -1;
+	TrackMatches(img);
+	return VoteTranslation();
+}
+
 void TrackerStat::Compensate(double *x, double *y) { 
 	*x += xd; *y += yd; 
 }
 
-TrackerStatRot::TrackerStatRot(int binsize /*=8*/, int binsize_rot/*=3*/) : TrackerStat(binsize) {
+TrackerStatRot::TrackerStatRot(int binsize /*=8*/, int binsize_rot/*=3*/, int max_features/*=100*/, int min_features/*=90*/)
+	: TrackerStat(binsize, max_features, min_features) {
 	hist_rot.AddDimension(binsize_rot);
 }
 
 double TrackerStatRot::Track(IplImage *img)
 {
 	if (img == NULL) return -1;
-	f.Track(img);
+	TrackMatches(img);
 	// Translation
-	hist.Clear();
-	for (int p=0; p<f.prev_feature_count ; p++) {
-		for (int c=0; c<f.feature_count; c++) {
-			if (f.prev_ids[p] != f.ids[c]) continue;
-			float x = f.features[c].x - f.prev_features[p].x;
-			float y = f.features[c].y - f.prev_features[p].y;
-			hist.Inc(x, y);
-		}
-	}
-	xd = 0; yd = 0;
-	double ret = hist.GetMax(&xd, &yd);
+	double ret = VoteTranslation();
 	// Rotation
 	x_res = img->width;
 	y_res = img->height;
 	hist_rot.Clear();
-	for (int p=0; p<f.prev_feature_count ; p++) {
-		for (int c=0; c<f.feature_count; c++) {
-			if (f.prev_ids[p] != f.ids[c]) continue;
-			double x_pred = f.prev_features[p].x + xd;
-			double y_pred = f.prev_features[p].y + yd;
-			double x_curr = f.features[c].x;
-			double y_curr = f.features[c].y;
-			double x = x_curr - x_pred;
-			double y = y_curr - y_pred;
-			double theta_pred = atan2((double)y_pred-(y_res/2), (double)x_pred-(x_res/2))*180.0/3.1415926535;
-			double theta_curr = atan2((double)y_curr-(y_res/2), (double)x_curr-(x_res/2))*180.0/3.1415926535;
-			hist_rot.Inc(theta_curr-theta_pred);
-		}
+	for (size_t m=0; m<matches.size(); m++) {
+		int p = matches[m].first, c = matches[m].second;
+		double x_pred = f.prev_features[p].x + xd;
+		double y_pred = f.prev_features[p].y + yd;
+		double x_curr = f.features[c].x;
+		double y_curr = f.features[c].y;
+		double theta_pred = atan2((double)y_pred-(y_res/2), (double)x_pred-(x_res/2))*180.0/3.1415926535;
+		double theta_curr = atan2((double)y_curr-(y_res/2), (double)x_curr-(x_res/2))*180.0/3.1415926535;
+		hist_rot.Inc(theta_curr-theta_pred);
 	}
 	rotd=0;
 	hist_rot.GetMax(&rotd);
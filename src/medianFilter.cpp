@@ -42,46 +42,56 @@ namespace ar_track_alvar
 {
   using namespace alvar;
 
+  static double poseDistance(const Pose &a, const Pose &b){
+    double d, total = 0;
+    for(int k=0; k<3; k++){
+      d = a.translation[k] - b.translation[k];
+      total += d*d;
+    }
+    for(int k=0; k<4; k++){
+      d = a.quaternion[k] - b.quaternion[k];
+      total += d*d;
+    }
+    return total;
+  }
+
   MedianFilter::MedianFilter(int n){
      median_n = n;
      median_ind = 0;
-     median_init = false;
-     median_poses = new Pose[median_n];
+     median_count = 0;
+     median_poses.resize(median_n);
+     median_dist.assign(median_n*median_n, 0);
+     median_total.assign(median_n, 0);
   }
 
   void MedianFilter::addPose(const Pose &new_pose){
-      median_poses[median_ind] = new_pose;
+      // Replace the row and column of the overwritten pose and patch the
+      // row sums of the others, instead of redoing all the pairs
+      int k = median_ind;
+      median_poses[k] = new_pose;
+      if(median_count < median_n) median_count++;
+      median_total[k] = 0;
+      for(int j=0; j<median_count; j++){
+	if(j == k) continue;
+	double d = poseDistance(new_pose, median_poses[j]);
+	median_total[j] += d - median_dist[j*median_n+k];
+	median_total[k] += d;
+	median_dist[j*median_n+k] = d;
+	median_dist[k*median_n+j] = d;
+      }
       median_ind = (median_ind+1) % median_n;
   }
 
   void MedianFilter::getMedian(Pose &ret_pose){
-    if(!median_init){
-      if(median_ind == median_n-1)
-	median_init = true;
-      ret_pose = median_poses[median_ind-1];
+    if(median_count < median_n){
+      ret_pose = median_poses[(median_ind+median_n-1) % median_n];
     }
 
     else{
-      double min_dist = 0;
       int min_ind = 0;
-      for(int i=0; i<median_n; i++){
-	double total_dist = 0;
-	for(int j=0; j<median_n; j++){
-	  total_dist += pow(median_poses[i].translation[0] - median_poses[j].translation[0], 2);
-	  total_dist += pow(median_poses[i].translation[1] - median_poses[j].translation[1], 2);
-	  total_dist += pow(median_poses[i].translation[2] - median_poses[j].translation[2], 2);
-	  total_dist += pow(median_poses[i].quaternion[0] - median_poses[j].quaternion[0], 2);
-	  total_dist += pow(median_poses[i].quaternion[1] - median_poses[j].quaternion[1], 2);
-	  total_dist += pow(median_poses[i].quaternion[2] - median_poses[j].quaternion[2], 2);
-	  total_dist += pow(median_poses[i].quaternion[3] - median_poses[j].quaternion[3], 2);
-	}
-	if(i==0) min_dist = total_dist;
-	else{
-	  if(total_dist < min_dist){
-	    min_dist = total_dist;
-	    min_ind = i;
-	  }
-	}
+      for(int i=1; i<median_n; i++){
+	if(median_total[i] < median_total[min_ind])
+	  min_ind = i;
       }
       ret_pose = median_poses[min_ind];
     }
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file
+ *
+ * Per-marker pose filters for the detection nodes
+ *
+ */
+
+#include <ar_track_alvar/filter/poseFilterBank.h>
+#include <ros/console.h>
+#include <algorithm>
+#include <cmath>
+
+namespace ar_track_alvar
+{
+
+  static void normalizeQuaternion(double q[4]){
+    double norm = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    if(norm > 0)
+      for(int k=0; k<4; k++) q[k] /= norm;
+  }
+
+  // Flips q to the same hemisphere as ref, returns the cosine between them
+  static double alignQuaternion(const double ref[4], double q[4]){
+    double dot = ref[0]*q[0] + ref[1]*q[1] + ref[2]*q[2] + ref[3]*q[3];
+    if(dot < 0){
+      for(int k=0; k<4; k++) q[k] = -q[k];
+      dot = -dot;
+    }
+    return dot;
+  }
+
+  // Replaces old_value by new_value in the sorted window, keeping it sorted
+  static void replaceSorted(std::vector<double> &sorted, int count, double old_value, double new_value){
+    double *begin = &sorted[0];
+    double *end = begin + count;
+    double *pos = std::lower_bound(begin, end, old_value);
+    double *ins = std::lower_bound(begin, end, new_value);
+    if(ins > pos){
+      // Shift the values in between one step down
+      std::copy(pos+1, ins, pos);
+      *(ins-1) = new_value;
+    }
+    else{
+      std::copy_backward(ins, pos, pos+1);
+      *ins = new_value;
+    }
+  }
+
+  static void insertSorted(std::vector<double> &sorted, int count, double value){
+    double *begin = &sorted[0];
+    double *ins = std::upper_bound(begin, begin + count, value);
+    std::copy_backward(ins, begin + count, begin + count + 1);
+    *ins = value;
+  }
+
+  static double sortedMedian(const std::vector<double> &sorted, int count){
+    if(count % 2) return sorted[count/2];
+    return (sorted[count/2-1] + sorted[count/2]) / 2;
+  }
+
+  bool parsePoseFilterType(const std::string &name, PoseFilterType &type){
+    if(name == "none") type = POSE_FILTER_NONE;
+    else if(name == "median") type = POSE_FILTER_MEDIAN;
+    else if(name == "exponential") type = POSE_FILTER_EXPONENTIAL;
+    else if(name == "kalman") type = POSE_FILTER_KALMAN;
+    else return false;
+    return true;
+  }
+
+  PoseFilterOptions::PoseFilterOptions()
+    : type(POSE_FILTER_NONE),
+      window(5),
+      alpha(0.5),
+      translation_process_noise(1000.0),
+      translation_measurement_noise(1.0),
+      rotation_process_noise(1.0),
+      rotation_measurement_noise(1e-3),
+      reset_timeout(1.0)
+  {
+  }
+
+  PoseFilterOptions PoseFilterOptions::fromParams(const ros::NodeHandle &pn){
+    PoseFilterOptions options;
+    std::string name;
+    pn.param("pose_filter", name, std::string("none"));
+    if(!parsePoseFilterType(name, options.type))
+      ROS_WARN("Unknown pose_filter '%s', poses are not filtered", name.c_str());
+    pn.param("pose_filter_window", options.window, options.window);
+    pn.param("pose_filter_alpha", options.alpha, options.alpha);
+    pn.param("pose_filter_translation_process_noise", options.translation_process_noise, options.translation_process_noise);
+    pn.param("pose_filter_translation_measurement_noise", options.translation_measurement_noise, options.translation_measurement_noise);
+    pn.param("pose_filter_rotation_process_noise", options.rotation_process_noise, options.rotation_process_noise);
+    pn.param("pose_filter_rotation_measurement_noise", options.rotation_measurement_noise, options.rotation_measurement_noise);
+    pn.param("pose_filter_reset_timeout", options.reset_timeout, options.reset_timeout);
+    return options;
+  }
+
+  PoseFilterBank::PoseFilterBank(const PoseFilterOptions &options){
+    setOptions(options);
+  }
+
+  void PoseFilterBank::setOptions(const PoseFilterOptions &options){
+    options_ = options;
+    if(options_.window < 1) options_.window = 1;
+    if(options_.alpha <= 0 || options_.alpha > 1) options_.alpha = 1;
+    states_.clear();
+  }
+
+  void PoseFilterBank::forget(int id){
+    states_.erase(id);
+  }
+
+  void PoseFilterBank::clear(){
+    states_.clear();
+  }
+
+  void PoseFilterBank::filter(int id, double stamp, double translation[3], double quaternion[4]){
+    normalizeQuaternion(quaternion);
+    if(options_.type == POSE_FILTER_NONE) return;
+
+    StateMap::iterator iter = states_.find(id);
+    if(iter == states_.end()){
+      // The only allocation of the marker: its state and median window
+      MarkerState &state = states_[id];
+      if(options_.type == POSE_FILTER_MEDIAN){
+        for(int c=0; c<7; c++){
+          state.ring[c].resize(options_.window);
+          state.sorted[c].resize(options_.window);
+        }
+      }
+      reset(state, stamp, translation, quaternion);
+      return;
+    }
+
+    MarkerState &state = iter->second;
+    double dt = stamp - state.stamp;
+    if(dt < 0 || dt > options_.reset_timeout){
+      reset(state, stamp, translation, quaternion);
+      return;
+    }
+    state.stamp = stamp;
+    alignQuaternion(state.quaternion, quaternion);
+
+    switch(options_.type){
+    case POSE_FILTER_MEDIAN:
+      filterMedian(state, translation, quaternion);
+      break;
+    case POSE_FILTER_EXPONENTIAL:
+      filterExponential(state, translation, quaternion);
+      break;
+    case POSE_FILTER_KALMAN:
+      filterKalman(state, dt, translation, quaternion);
+      break;
+    default:
+      break;
+    }
+
+    normalizeQuaternion(quaternion);
+    std::copy(translation, translation+3, state.translation);
+    std::copy(quaternion, quaternion+4, state.quaternion);
+  }
+
+  void PoseFilterBank::reset(MarkerState &state, double stamp, const double translation[3], const double quaternion[4]){
+    state.stamp = stamp;
+    std::copy(translation, translation+3, state.translation);
+    std::copy(quaternion, quaternion+4, state.quaternion);
+
+    state.ring_head = 0;
+    state.ring_count = 0;
+    if(options_.type == POSE_FILTER_MEDIAN){
+      double t[3], q[4];
+      std::copy(translation, translation+3, t);
+      std::copy(quaternion, quaternion+4, q);
+      filterMedian(state, t, q);
+    }
+
+    if(options_.type == POSE_FILTER_KALMAN){
+      PoseFilterBankKalman<3> &tk = state.translation_kalman;
+      tk.process_noise = options_.translation_process_noise;
+      tk.x.setZero();
+      tk.P.setZero();
+      for(int i=0; i<3; i++){
+        tk.x(i) = translation[i];
+        tk.P(i, i) = options_.translation_measurement_noise;
+        // Unknown velocity
+        tk.P(3+i, 3+i) = options_.translation_process_noise;
+      }
+      state.translation_sensor.H.setIdentity();
+      state.translation_sensor.R.setIdentity();
+      state.translation_sensor.R *= options_.translation_measurement_noise;
+
+      PoseFilterBankKalman<4> &rk = state.rotation_kalman;
+      rk.process_noise = options_.rotation_process_noise;
+      rk.x.setZero();
+      rk.P.setZero();
+      for(int i=0; i<4; i++){
+        rk.x(i) = quaternion[i];
+        rk.P(i, i) = options_.rotation_measurement_noise;
+        rk.P(4+i, 4+i) = options_.rotation_process_noise;
+      }
+      state.rotation_sensor.H.setIdentity();
+      state.rotation_sensor.R.setIdentity();
+      state.rotation_sensor.R *= options_.rotation_measurement_noise;
+    }
+  }
+
+  void PoseFilterBank::filterMedian(MarkerState &state, double translation[3], double quaternion[4]){
+    // The pose enters the window; the oldest one leaves it once it is full
+    double pose[7];
+    std::copy(translation, translation+3, pose);
+    std::copy(quaternion, quaternion+4, pose+3);
+
+    int n = options_.window;
+    int head = state.ring_head;
+    for(int c=0; c<7; c++){
+      if(state.ring_count == n)
+        replaceSorted(state.sorted[c], n, state.ring[c][head], pose[c]);
+      else
+        insertSorted(state.sorted[c], state.ring_count, pose[c]);
+      state.ring[c][head] = pose[c];
+    }
+    state.ring_head = (head+1) % n;
+    if(state.ring_count < n) state.ring_count++;
+
+    for(int c=0; c<3; c++)
+      translation[c] = sortedMedian(state.sorted[c], state.ring_count);
+    for(int c=0; c<4; c++)
+      quaternion[c] = sortedMedian(state.sorted[3+c], state.ring_count);
+  }
+
+  void PoseFilterBank::filterExponential(MarkerState &state, double translation[3], double quaternion[4]){
+    double a = options_.alpha;
+    for(int c=0; c<3; c++)
+      translation[c] = state.translation[c] + a * (translation[c] - state.translation[c]);
+
+    // Spherical interpolation from the estimate towards the measurement;
+    // the quaternions were aligned so this takes the short way
+    double cos_theta = 0;
+    for(int c=0; c<4; c++) cos_theta += state.quaternion[c] * quaternion[c];
+    double w0 = 1 - a, w1 = a;
+    if(cos_theta < 0.9995){
+      double theta = acos(std::min(cos_theta, 1.0));
+      double sin_theta = sin(theta);
+      w0 = sin((1 - a) * theta) / sin_theta;
+      w1 = sin(a * theta) / sin_theta;
+    }
+    for(int c=0; c<4; c++)
+      quaternion[c] = w0 * state.quaternion[c] + w1 * quaternion[c];
+  }
+
+  void PoseFilterBank::filterKalman(MarkerState &state, double dt, double translation[3], double quaternion[4]){
+    PoseFilterBankKalman<3> &tk = state.translation_kalman;
+    for(int c=0; c<3; c++) state.translation_sensor.z(c) = translation[c];
+    tk.dt = dt;
+    tk.predict_update(state.translation_sensor, 0);
+    for(int c=0; c<3; c++) translation[c] = tk.x(c);
+
+    PoseFilterBankKalman<4> &rk = state.rotation_kalman;
+    for(int c=0; c<4; c++) state.rotation_sensor.z(c) = quaternion[c];
+    rk.dt = dt;
+    rk.predict_update(state.rotation_sensor, 0);
+    // Keep the estimate on the unit sphere, the velocity is left as is
+    double norm = rk.x.head<4>().norm();
+    if(norm > 0) rk.x.head<4>() /= norm;
+    for(int c=0; c<4; c++) quaternion[c] = rk.x(c);
+  }
+
+} //namespace
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file 
+ * 
+ * Benchmark of the labeling methods and the square candidate rejection cascade
+ *
+ * Runs the detector on the given images (or on a synthetic cluttered scene
+ * when none are given) with the cascade disabled and enabled, and reports
+ * the time per frame and how many candidates each stage rejected. Fails if
+ * the cascade makes the detector lose markers. Then compares the time of
+ * the labeling methods and fails if they give different blob corners, or if
+ * the border following of \e LabelingCvSeq finds other corners than the
+ * cvFindContours and cvApproxPoly extraction it replaced.
+ *
+ * Usage: benchmark_detection [marker_size] [image ...]
+ */
+
+#include <ar_track_alvar/MarkerDetector.h>
+#include <ar_track_alvar/FrameArena.h>
+#include <ros/time.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace al=alvar;
+
+using std::vector;
+
+// White scene with marker 'id', light and dark rectangles and a checkerboard
+IplImage *createClutteredImage(int id)
+{
+  IplImage *image = cvCreateImage(cvSize(640, 480), IPL_DEPTH_8U, 1);
+  cvSet(image, cvScalar(255));
+  srand(42);
+  for (int i=0; i<60; i++)
+  {
+    CvPoint p = cvPoint(rand()%640, rand()%480);
+    CvPoint q = cvPoint(p.x + 5 + rand()%75, p.y + 5 + rand()%75);
+    cvRectangle(image, p, q, cvScalar(rand()%256), 1 + rand()%3);
+  }
+  for (int y=0; y<8; y++)
+    for (int x=0; x<8; x++)
+      if ((x+y)%2)
+        cvRectangle(image, cvPoint(420+x*20, 20+y*20), cvPoint(439+x*20, 39+y*20),
+                    cvScalar(0), CV_FILLED);
+
+  al::MarkerData marker(5.0, 5, 2);
+  marker.SetContent(al::MarkerData::MARKER_CONTENT_TYPE_NUMBER, id, 0);
+  cvSetImageROI(image, cvRect(120, 200, 180, 180));
+  cvSet(image, cvScalar(255));
+  cvSetImageROI(image, cvRect(140, 220, 140, 140));
+  marker.ScaleMarkerToImage(image);
+  cvResetImageROI(image);
+  return image;
+}
+
+// Exposes the blob corners of the labeling
+class BenchmarkDetector : public al::MarkerDetector<al::MarkerData>
+{
+public:
+  void appendBlobCorners(vector<vector<al::PointDouble> > *corners) const
+  {
+    for (size_t i=0; i<labeling->blob_corners.size(); i++)
+      if (!labeling->blob_corners[i].empty())
+        corners->push_back(labeling->blob_corners[i]);
+  }
+};
+
+// The quad extraction of LabelingCvSeq before it followed the borders itself:
+// cvFindContours and cvApproxPoly, with the same line fitting afterwards
+class BaselineLabeling : public al::LabelingCvSeq
+{
+public:
+  void LabelSquares(IplImage* image, bool visualize=false)
+  {
+    ThresholdImage(image);
+    contour_points.clear();
+    quads.clear();
+
+    CvSeq* contours;
+    cvFindContours(bw, storage, &contours, sizeof(CvContour),
+                   CV_RETR_LIST, CV_CHAIN_APPROX_NONE, cvPoint(0,0));
+    for (; contours; contours = contours->h_next)
+    {
+      if (contours->total < _min_edge)
+        continue;
+      CvSeq* result = cvApproxPoly(contours, sizeof(CvContour), storage, CV_POLY_APPROX_DP,
+                                   cvContourPerimeter(contours)*0.035, 0);
+      if (result->total != 4 || !CheckBorder(result, image->width, image->height) ||
+          fabs(cvContourArea(result, CV_WHOLE_SEQ)) <= _min_area ||
+          !cvCheckContourConvexity(result))
+        continue;
+
+      QuadCandidate quad;
+      quad.first = (int)contour_points.size();
+      quad.count = contours->total;
+      for (int k=0; k<contours->total; k++)
+      {
+        CvPoint* p = (CvPoint*)cvGetSeqElem(contours, k);
+        contour_points.push_back(*p);
+        for (int j=0; j<4; j++)
+        {
+          CvPoint* v = (CvPoint*)cvGetSeqElem(result, j);
+          if (v->x == p->x && v->y == p->y)
+            quad.corners[j] = k;
+        }
+      }
+      quads.push_back(quad);
+    }
+    cvClearMemStorage(storage);
+    FitQuadCorners(image, visualize);
+  }
+};
+
+// Blob corners of one labeling of the image
+vector<vector<al::PointDouble> > labelCorners(al::Labeling *labeling, IplImage *image,
+                                              al::Camera *cam, al::FrameArena *arena)
+{
+  labeling->SetCamera(cam);
+  labeling->SetArena(arena);
+  labeling->LabelSquares(image);
+  vector<vector<al::PointDouble> > corners;
+  for (size_t i=0; i<labeling->blob_corners.size(); i++)
+    if (!labeling->blob_corners[i].empty())
+      corners.push_back(labeling->blob_corners[i]);
+  return corners;
+}
+
+// Largest distance between the corners of a and b, over the rotations of b
+double quadDistance(const vector<al::PointDouble> &a, const vector<al::PointDouble> &b)
+{
+  double best = -1;
+  for (int r=0; r<4; r++)
+  {
+    double worst = 0;
+    for (int j=0; j<4; j++)
+    {
+      const al::PointDouble &p = a[j], &q = b[(j+r)%4];
+      worst = std::max(worst, sqrt((p.x-q.x)*(p.x-q.x) + (p.y-q.y)*(p.y-q.y)));
+    }
+    if (best < 0 || worst < best)
+      best = worst;
+  }
+  return best;
+}
+
+// Checks that the border following finds the quads of the baseline extraction,
+// in any order, with every corner within 'tolerance' pixels
+bool sameAsBaseline(const vector<IplImage*> &images, al::Camera *cam, double tolerance)
+{
+  bool same = true;
+  al::FrameArena arena;
+  for (size_t i=0; i<images.size(); i++)
+  {
+    al::LabelingCvSeq traced;
+    BaselineLabeling baseline;
+    vector<vector<al::PointDouble> > t = labelCorners(&traced, images[i], cam, &arena);
+    vector<vector<al::PointDouble> > b = labelCorners(&baseline, images[i], cam, &arena);
+    if (t.size() != b.size())
+    {
+      ROS_ERROR("Image %zu: border following found %zu quads, cvFindContours %zu",
+                i, t.size(), b.size());
+      same = false;
+      continue;
+    }
+    for (size_t k=0; k<b.size(); k++)
+    {
+      double nearest = -1;
+      for (size_t l=0; l<t.size(); l++)
+      {
+        double d = quadDistance(b[k], t[l]);
+        if (nearest < 0 || d < nearest)
+          nearest = d;
+      }
+      if (nearest > tolerance)
+      {
+        ROS_ERROR("Image %zu: quad %zu of cvFindContours is %.3f pixels off", i, k, nearest);
+        same = false;
+      }
+    }
+  }
+  return same;
+}
+
+struct Result
+{
+  double ms_per_frame;
+  int markers;
+  al::Labeling::CascadeStats stats;
+  vector<vector<al::PointDouble> > corners;  // Blob corners of the first frame of every image
+};
+
+Result run(const vector<IplImage*> &images, al::Camera *cam, double marker_size,
+           bool cascade, al::LabelingMethod method, int frames)
+{
+  BenchmarkDetector detector;
+  detector.SetMarkerSize(marker_size, 5, 2);
+  detector.SetCandidateCascade(cascade);
+
+  Result result;
+  result.markers = 0;
+  ros::WallTime start = ros::WallTime::now();
+  for (int f=0; f<frames; f++)
+  {
+    for (size_t i=0; i<images.size(); i++)
+    {
+      detector.Detect(images[i], cam, false, false, 0.08, 0.2, method);
+      if (f == 0)
+        detector.appendBlobCorners(&result.corners);
+      al::Labeling::CascadeStats s = detector.GetCascadeStats();
+      result.stats.contours += s.contours;
+      result.stats.quads += s.quads;
+      result.stats.rejected_shape += s.rejected_shape;
+      result.stats.rejected_contrast += s.rejected_contrast;
+      result.stats.rejected_border += s.rejected_border;
+      result.stats.accepted += s.accepted;
+      result.markers += detector.GetDetections().size();
+    }
+  }
+  result.ms_per_frame = (ros::WallTime::now() - start).toSec() * 1000.0 /
+                        (frames * images.size());
+  return result;
+}
+
+double percent(int part, int whole)
+{
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+int main (int argc, char** argv)
+{
+  const int FRAMES = 50;
+  double marker_size = 5.0;
+  vector<IplImage*> images;
+  if (argc > 1)
+    marker_size = atof(argv[1]);
+  for (int i=2; i<argc; i++)
+  {
+    IplImage *image = cvLoadImage(argv[i], CV_LOAD_IMAGE_GRAYSCALE);
+    if (!image)
+    {
+      ROS_ERROR("Could not load %s", argv[i]);
+      return 1;
+    }
+    images.push_back(image);
+  }
+  if (images.empty())
+    images.push_back(createClutteredImage(5));
+
+  al::Camera cam;
+  bool baseline_ok = sameAsBaseline(images, &cam, 0.5);
+  Result plain = run(images, &cam, marker_size, false, al::CVSEQ, FRAMES);
+  Result cascade = run(images, &cam, marker_size, true, al::CVSEQ, FRAMES);
+  Result runlength = run(images, &cam, marker_size, true, al::RUNLENGTH, FRAMES);
+
+  const al::Labeling::CascadeStats &s = cascade.stats;
+  ROS_INFO("%zu images, %d frames each", images.size(), FRAMES);
+  ROS_INFO("Without cascade: %.2f ms/frame, %d quads decoded, %d markers",
+           plain.ms_per_frame, plain.stats.accepted, plain.markers);
+  ROS_INFO("With cascade:    %.2f ms/frame, %d quads decoded, %d markers",
+           cascade.ms_per_frame, s.accepted, cascade.markers);
+  ROS_INFO("Quads: %d of %d contours", s.quads, s.contours);
+  ROS_INFO("  shape rejected    %6d (%5.1f%%)", s.rejected_shape, percent(s.rejected_shape, s.quads));
+  ROS_INFO("  contrast rejected %6d (%5.1f%%)", s.rejected_contrast, percent(s.rejected_contrast, s.quads));
+  ROS_INFO("  border rejected   %6d (%5.1f%%)", s.rejected_border, percent(s.rejected_border, s.quads));
+  ROS_INFO("  accepted          %6d (%5.1f%%)", s.accepted, percent(s.accepted, s.quads));
+  ROS_INFO("Labeling: CVSEQ %.2f ms/frame, RUNLENGTH %.2f ms/frame",
+           cascade.ms_per_frame, runlength.ms_per_frame);
+
+  for (size_t i=0; i<images.size(); i++)
+    cvReleaseImage(&images[i]);
+
+  if (!baseline_ok)
+    return 1;
+  if (cascade.markers != plain.markers)
+  {
+    ROS_ERROR("The cascade lost markers: %d instead of %d", cascade.markers, plain.markers);
+    return 1;
+  }
+  bool same = (runlength.corners.size() == cascade.corners.size());
+  for (size_t i=0; same && i<cascade.corners.size(); i++)
+    for (size_t j=0; j<4; j++)
+      if (runlength.corners[i][j].x != cascade.corners[i][j].x ||
+          runlength.corners[i][j].y != cascade.corners[i][j].y)
+        same = false;
+  if (!same)
+  {
+    ROS_ERROR("The labeling methods found different blob corners (%zu and %zu blobs)",
+              cascade.corners.size(), runlength.corners.size());
+    return 1;
+  }
+  return 0;
+}
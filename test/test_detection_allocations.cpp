@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * \file 
+ * 
+ * Test that steady-state marker detection does not allocate per frame
+ *
+ * Heap allocations, including the ones OpenCV makes through malloc, are
+ * counted around the Detect calls themselves once the detector has seen a
+ * few frames of the same scene, with and without tracking, for both
+ * MarkerData and MarkerDataRes. Content reading and corner comparison are
+ * checked the same way on their own.
+ */
+
+#include <ar_track_alvar/MarkerDetector.h>
+#include <ar_track_alvar/FrameArena.h>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+
+namespace al=alvar;
+
+using std::vector;
+
+namespace
+{
+  bool counting = false;
+  size_t allocations = 0;
+}
+
+#ifdef __GLIBC__
+// Count malloc as well, OpenCV allocates its matrices through it
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+  if (counting) allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+  if (counting) allocations++;
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+  if (counting) allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+  if (counting) allocations++;
+  *ptr = __libc_memalign(alignment, size);
+  return *ptr ? 0 : ENOMEM;
+}
+
+void *operator new (size_t size)
+{
+  void *p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+#else
+void *operator new (size_t size)
+{
+  if (counting) allocations++;
+  void *p = std::malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+#endif
+
+void operator delete (void *p) throw()
+{
+  std::free(p);
+}
+
+void *operator new[] (size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete[] (void *p) throw()
+{
+  operator delete(p);
+}
+
+// Exposes the detector's candidates
+template <class M>
+class TestDetector : public al::MarkerDetector<M>
+{
+public:
+  size_t candidateCount() const { return this->candidate_slots.size(); }
+};
+
+// Detects the marker in 'image' for a few frames and then counts the heap
+// allocations of FRAMES more Detect calls, which must find the marker again
+template <class M>
+bool detectsWithoutAllocations(IplImage *image, al::Camera *cam, int id, bool track, const char *name)
+{
+  const int FRAMES = 20;
+  TestDetector<M> detector;
+  detector.SetMarkerSize(5.0, 5, 2);
+  for (int i=0; i<FRAMES; i++)
+    detector.Detect(image, cam, track, false);
+  if (detector.markers->size() != 1 || (*detector.markers)[0].GetId() != id)
+  {
+    ROS_ERROR("%s: expected marker %d, detected %zu markers", name, id, detector.markers->size());
+    return false;
+  }
+
+  allocations = 0;
+  bool found = true;
+  counting = true;
+  for (int i=0; i<FRAMES; i++)
+  {
+    detector.Detect(image, cam, track, false);
+    found = found && detector.markers->size() == 1;
+  }
+  counting = false;
+  if (!found)
+  {
+    ROS_ERROR("%s: the marker was lost in steady state", name);
+    return false;
+  }
+  if (allocations != 0)
+  {
+    ROS_ERROR("%s: %zu heap allocations in %d frames of detection (track %d)", name,
+              allocations, FRAMES, (int)track);
+    return false;
+  }
+  ROS_INFO("%s: no heap allocations in %d frames of detection (track %d)", name, FRAMES, (int)track);
+  return true;
+}
+
+// Draws marker 'id' on a white image with its top-left corner at (x, y)
+IplImage *createMarkerImage(int id, int x, int y, int size)
+{
+  IplImage *image = cvCreateImage(cvSize(640, 480), IPL_DEPTH_8U, 1);
+  cvSet(image, cvScalar(255));
+  al::MarkerData marker(5.0, 5, 2);
+  marker.SetContent(al::MarkerData::MARKER_CONTENT_TYPE_NUMBER, id, 0);
+  cvSetImageROI(image, cvRect(x, y, size, size));
+  marker.ScaleMarkerToImage(image);
+  cvResetImageROI(image);
+  return image;
+}
+
+int main (int argc, char** argv)
+{
+  const int ID = 5;
+  const int FRAMES = 20;
+  IplImage *image = createMarkerImage(ID, 240, 160, 180);
+
+  al::Camera cam;
+  cam.calib_D_data[0] = -0.05;
+  cam.calib_D_data[1] = 0.01;
+
+  // Detect makes no allocations once it has seen the scene
+  for (int track=0; track<2; track++)
+  {
+    if (!detectsWithoutAllocations<al::MarkerData>(image, &cam, ID, track, "MarkerData") ||
+        !detectsWithoutAllocations<al::MarkerDataRes<5> >(image, &cam, ID, track, "MarkerDataRes<5>"))
+      return 1;
+  }
+
+  // Switching the marker size on every frame, as the bundle node does per
+  // bundle, reuses one candidate per size instead of allocating new ones
+  TestDetector<al::MarkerData> detector;
+  for (int i=0; i<FRAMES; i++)
+  {
+    detector.SetMarkerSize(i%2 ? 10.0 : 5.0, 5, 2);
+    detector.Detect(image, &cam, true, false);
+  }
+  if (detector.candidateCount() != 2)
+  {
+    ROS_ERROR("Expected 2 candidates for 2 marker sizes, got %zu", detector.candidateCount());
+    return 1;
+  }
+
+  // Content reading and corner comparison make no allocations at all
+  vector<al::PointDouble> corners = (*detector.markers)[0].marker_corners_img;
+  al::FrameArena arena;
+  al::MarkerData marker(5.0, 5, 2);
+  al::MarkerData marker_auto(5.0, 0, 2);
+  al::MarkerDataRes<5> marker_res(5.0, 5, 2);
+  int orientation;
+  double error;
+  allocations = 0;
+  for (int pass=0; pass<2; pass++)
+  {
+    counting = (pass == 1);
+    for (int i=0; i<FRAMES; i++)
+    {
+      arena.Reset();
+      marker.UpdateContent(corners, image, &cam, 0, &arena);
+      marker.CompareCorners(corners, &orientation, &error);
+      marker_auto.SetMarkerSize(5.0, 0, 2);
+      if (!marker_auto.UpdateContent(corners, image, &cam, 0, &arena) ||
+          marker_auto.GetRes() != 5)
+      {
+        counting = false;
+        ROS_ERROR("Resolution detection failed");
+        return 1;
+      }
+      if (!marker_res.UpdateContent(corners, image, &cam, 0, &arena) ||
+          !marker_res.DecodeContent(&orientation) || marker_res.GetId() != ID)
+      {
+        counting = false;
+        ROS_ERROR("Decoding with MarkerDataRes failed");
+        return 1;
+      }
+    }
+    counting = false;
+  }
+  if (allocations != 0)
+  {
+    ROS_ERROR("%zu heap allocations in %d frames of content reading", allocations, FRAMES);
+    return 1;
+  }
+  ROS_INFO("No heap allocations in %d frames of content reading", FRAMES);
+
+  cvReleaseImage(&image);
+  return 0;
+}